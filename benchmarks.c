@@ -0,0 +1,1079 @@
+
+#include <time.h>
+
+#include "util.h"
+#include "symposium.h"
+#include "tinyoslib.h"
+#include "kernel_sched.h"
+#include "kernel_proc.h"
+#include "unit_testing.h"
+
+
+/*
+ *
+ *   BENCHMARKS
+ *
+ *   These are not tests: they do not check for correctness (beyond the
+ *   obvious), but report timings via MSG(). Run them with
+ *   @verbatim
+ *   $ ./benchmarks -c 1,4
+ *   @endverbatim
+ *   To compare scheduling policies on the same workload, select one
+ *   with -p (e.g., -p fair); see set_sched_policy().
+ */
+
+
+/* Wall-clock time in nanoseconds, at the finest available resolution */
+static double bench_now_nsec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1E9 + ts.tv_nsec;
+}
+
+
+/*
+	bench_switch_priority_levels
+
+	Measure the cost of a context switch between threads at the lowest and
+	at the highest MLFQ level. Two threads call yield() back to back with
+	a cause that drives them to one end of the priority range. Finding
+	the next thread should cost the same at every level, so the two
+	timings should be about equal.
+ */
+
+#define SWITCH_ROUNDS 200000
+
+static int switch_yielder(int argl, void* args)
+{
+	enum SCHED_CAUSE cause = argl;
+	for(int i=0; i<SWITCH_ROUNDS; i++)
+		yield(cause);
+	return 0;
+}
+
+static double switch_cost(enum SCHED_CAUSE cause)
+{
+	double start = bench_now_nsec();
+	Tid_t t1 = CreateThread(switch_yielder, cause, NULL);
+	Tid_t t2 = CreateThread(switch_yielder, cause, NULL);
+	ThreadJoin(t1, NULL);
+	ThreadJoin(t2, NULL);
+	return (bench_now_nsec() - start) / (2.0 * SWITCH_ROUNDS);
+}
+
+BOOT_TEST(bench_switch_priority_levels,
+	"Compare the cost of yield() at the lowest and the highest priority level.",
+	.timeout = 60
+	)
+{
+	double low = switch_cost(SCHED_QUANTUM);
+	double high = switch_cost(SCHED_IO);
+
+	MSG("yield at level 0:  %8.1f ns\n", low);
+	MSG("yield at level %d: %8.1f ns\n", PRIORITY_QUEUES-1, high);
+	MSG("ratio low/high:    %8.2f\n", low/high);
+	return 0;
+}
+
+
+/*
+	bench_thread_create_join
+
+	Measure the round-trip latency of creating a thread and joining it.
+	The thread does nothing, so this is mostly the cost of allocating,
+	initializing and releasing the TCB and its stack.
+ */
+
+#define CREATE_JOIN_ROUNDS 100000
+
+static int null_thread(int argl, void* args) { return argl; }
+
+BOOT_TEST(bench_thread_create_join,
+	"Measure the latency of a CreateThread/ThreadJoin round trip.",
+	.timeout = 60
+	)
+{
+	double start = bench_now_nsec();
+	for(int i=0; i<CREATE_JOIN_ROUNDS; i++) {
+		int exitval;
+		Tid_t t = CreateThread(null_thread, i, NULL);
+		ASSERT(ThreadJoin(t, &exitval)==0 && exitval==i);
+	}
+	double elapsed = bench_now_nsec() - start;
+
+	MSG("create+join: %8.1f ns\n", elapsed / CREATE_JOIN_ROUNDS);
+	return 0;
+}
+
+
+/*
+	bench_condvar_pingpong
+
+	Two threads take turns through a CondVar: each waits for its turn,
+	passes the turn to the other and signals it. On a single core, every
+	turn is a context switch. This is run with the core timers programmed
+	for every time slice and lazily, counting the timer syscalls of each.
+ */
+
+#define PINGPONG_ROUNDS 200000
+
+/* The number of times any core timer has been programmed */
+static unsigned long timer_syscalls_total()
+{
+	unsigned long total = 0;
+	for(uint c=0; c<cpu_cores(); c++)
+		total += cctx[c].timer_syscalls;
+	return total;
+}
+
+struct pingpong {
+	Mutex mx;
+	CondVar cv[2];
+	int turn;
+};
+
+static int pingpong_thread(int argl, void* args)
+{
+	struct pingpong* P = args;
+	int me = argl;
+
+	Mutex_Lock(&P->mx);
+	for(int i=0; i<PINGPONG_ROUNDS; i++) {
+		while(P->turn != me)
+			Cond_Wait(&P->mx, &P->cv[me]);
+		P->turn = 1-me;
+		Cond_Signal(&P->cv[1-me]);
+	}
+	Mutex_Unlock(&P->mx);
+	return 0;
+}
+
+static int pingpong_boot(int argl, void* args)
+{
+	struct pingpong P = { MUTEX_INIT, { COND_INIT, COND_INIT }, 0 };
+
+	unsigned long timer_syscalls = timer_syscalls_total();
+	double start = bench_now_nsec();
+	Tid_t t1 = CreateThread(pingpong_thread, 0, &P);
+	Tid_t t2 = CreateThread(pingpong_thread, 1, &P);
+	ThreadJoin(t1, NULL);
+	ThreadJoin(t2, NULL);
+	double elapsed = bench_now_nsec() - start;
+	timer_syscalls = timer_syscalls_total() - timer_syscalls;
+
+	/* Each turn is one switch */
+	MSG("%u cores, %s timer: %10.0f switches/sec, %6.4f timer syscalls/switch\n",
+		cpu_cores(), (const char*)args, 2.0 * PINGPONG_ROUNDS / elapsed * 1E9,
+		(double)timer_syscalls / (2.0 * PINGPONG_ROUNDS));
+	return 0;
+}
+
+BARE_TEST(bench_condvar_pingpong,
+	"Measure the rate of context switches between two threads ping-ponging through a CondVar,\n"
+	"and the timer syscalls per switch, with the timer programmed for every slice and lazily.",
+	.timeout = 60
+	)
+{
+	static const char eager[] = "eager", lazy[] = "lazy ";
+	static const uint cores[] = { 1, 2, 4 };
+
+	for(int i=0; i<3; i++) {
+		set_sched_lazy_timer(0);
+		boot(cores[i], 0, pingpong_boot, sizeof(eager), (void*)eager);
+
+		/* Restore the default */
+		set_sched_lazy_timer(1);
+		boot(cores[i], 0, pingpong_boot, sizeof(lazy), (void*)lazy);
+	}
+}
+
+
+/*
+	bench_pipe_pingpong
+
+	Two threads exchange a byte back and forth over a pair of pipes.
+	Each round trip is two writes, two reads and (at least) two
+	thread wakeups.
+ */
+
+#define PIPE_PINGPONG_ROUNDS 50000
+
+static int pipe_pingpong_thread(int argl, void* args)
+{
+	pipe_t* pipes = args;
+	Fid_t rfid = pipes[argl].read;
+	Fid_t wfid = pipes[1-argl].write;
+	char c = 'x';
+
+	for(int i=0; i<PIPE_PINGPONG_ROUNDS; i++) {
+		if(argl == 0)
+			ASSERT(Write(wfid, &c, 1)==1 && Read(rfid, &c, 1)==1);
+		else
+			ASSERT(Read(rfid, &c, 1)==1 && Write(wfid, &c, 1)==1);
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_pipe_pingpong,
+	"Measure the round-trip latency of a byte sent back and forth over two pipes.",
+	.timeout = 60
+	)
+{
+	pipe_t pipes[2];
+	ASSERT(Pipe(&pipes[0])==0 && Pipe(&pipes[1])==0);
+
+	double start = bench_now_nsec();
+	Tid_t t1 = CreateThread(pipe_pingpong_thread, 0, pipes);
+	Tid_t t2 = CreateThread(pipe_pingpong_thread, 1, pipes);
+	ThreadJoin(t1, NULL);
+	ThreadJoin(t2, NULL);
+	double elapsed = bench_now_nsec() - start;
+
+	MSG("pipe round trip: %8.1f ns\n", elapsed / PIPE_PINGPONG_ROUNDS);
+	return 0;
+}
+
+
+/*
+	bench_symposium_migrations
+
+	Run a symposium of philosopher threads in the current process, and
+	report how many times its threads resumed on a different core than
+	the one that last ran them.
+ */
+
+BOOT_TEST(bench_symposium_migrations,
+	"Count the core migrations of the threads of a symposium.",
+	.timeout = 120
+	)
+{
+	symposium_t symp = { .N = 10, .bites = 20 };
+	adjust_symposium(&symp, 0, -5);
+
+	unsigned long migrations = CURPROC->migrations;
+	double start = bench_now_nsec();
+	SymposiumOfThreads(sizeof(symp), &symp);
+	double elapsed = bench_now_nsec() - start;
+	migrations = CURPROC->migrations - migrations;
+
+	MSG("symposium: %8.1f ms, %lu migrations\n", elapsed / 1E6, migrations);
+	return 0;
+}
+
+
+/*
+	bench_starvation_wait
+
+	A CPU-bound thread sinks to the lowest MLFQ level, while pairs of
+	threads ping-ponging over pipes stay at a middle level and keep
+	every core busy. The CPU-bound thread only gets a core as it ages
+	(or is stolen by an idle core). Report the percentiles of the times
+	it waited between two runs.
+ */
+
+#define STARVATION_MSEC 3000
+#define STARVATION_MAX_WAITS 10000
+
+/* Waits shorter than this (in msec) are just the usual time slicing */
+#define STARVATION_MIN_WAIT 1.0
+
+struct starvation {
+	volatile int stop;
+	double waits[STARVATION_MAX_WAITS];
+	int nwaits;
+};
+
+static int starvation_pingpong_thread(int argl, void* args)
+{
+	struct starvation* S = args;
+	pipe_t* pipes = (pipe_t*)(S+1) + 2*(argl/2);
+	int me = argl % 2;
+	Fid_t rfid = pipes[me].read;
+	Fid_t wfid = pipes[1-me].write;
+	char c = 'x';
+
+	if(me == 0) {
+		while(! S->stop)
+			ASSERT(Write(wfid, &c, 1)==1 && Read(rfid, &c, 1)==1);
+
+		/* Tell the other thread to stop */
+		c = 'q';
+		ASSERT(Write(wfid, &c, 1)==1);
+	} else {
+		while(Read(rfid, &c, 1)==1 && c != 'q')
+			ASSERT(Write(wfid, &c, 1)==1);
+	}
+	return 0;
+}
+
+static int starved_thread(int argl, void* args)
+{
+	struct starvation* S = args;
+	double start = bench_now_nsec() / 1E6;
+	double last = start, now;
+
+	while((now = bench_now_nsec() / 1E6) < start + STARVATION_MSEC) {
+		if(now - last > STARVATION_MIN_WAIT && S->nwaits < STARVATION_MAX_WAITS)
+			S->waits[S->nwaits++] = now - last;
+		last = now;
+	}
+	S->stop = 1;
+	return 0;
+}
+
+static int cmp_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+BOOT_TEST(bench_starvation_wait,
+	"Report the waits of a low-priority CPU-bound thread among threads that stay at higher priority.",
+	.timeout = 60
+	)
+{
+	int npairs = cpu_cores();
+
+	/* The pipes follow the struct, two per pair of threads */
+	struct starvation* S = malloc(sizeof(struct starvation) + 2*npairs*sizeof(pipe_t));
+	S->stop = 0;
+	S->nwaits = 0;
+	pipe_t* pipes = (pipe_t*)(S+1);
+	for(int i=0; i<2*npairs; i++)
+		ASSERT(Pipe(&pipes[i])==0);
+
+	Tid_t threads[2*npairs];
+	for(int i=0; i<2*npairs; i++)
+		threads[i] = CreateThread(starvation_pingpong_thread, i, S);
+	Tid_t starved = CreateThread(starved_thread, 0, S);
+
+	ThreadJoin(starved, NULL);
+	for(int i=0; i<2*npairs; i++)
+		ThreadJoin(threads[i], NULL);
+
+	qsort(S->waits, S->nwaits, sizeof(double), cmp_double);
+	if(S->nwaits == 0)
+		MSG("starvation waits: none over %.0f msec\n", STARVATION_MIN_WAIT);
+	else
+		MSG("starvation waits: %d, p50 %.1f  p90 %.1f  p99 %.1f  max %.1f msec\n", S->nwaits,
+			S->waits[S->nwaits/2], S->waits[S->nwaits*9/10], S->waits[S->nwaits*99/100],
+			S->waits[S->nwaits-1]);
+	free(S);
+	return 0;
+}
+
+
+/*
+	bench_barrier_gang
+
+	A process of cpu_cores() threads runs rounds of a little work and a
+	BarrierSync, while as many CPU-bound threads of another process keep
+	every core busy. Every round waits for the slowest thread, so a
+	thread that waits for a core stalls the round. Report the rounds per
+	second with the process in gang mode and without.
+ */
+
+#define BARRIER_MSEC 1000
+#define BARRIER_WORK 2000
+
+struct barrier_run {
+	barrier bar;
+	unsigned int nthreads;
+	volatile long last;	/* the last round, once thread 0 has decided it */
+	unsigned long rounds;
+};
+
+static int barrier_worker(int argl, void* args)
+{
+	struct barrier_run* B = args;
+	double start = bench_now_nsec();
+	volatile unsigned long sink = 0;
+
+	for(long r=0; ; r++) {
+		for(int i=0; i<BARRIER_WORK; i++)
+			sink += i;
+		if(argl == 0) {
+			B->rounds++;
+			if(bench_now_nsec() > start + BARRIER_MSEC*1E6)
+				B->last = r;
+		}
+		BarrierSync(&B->bar, B->nthreads);
+
+		/* Everybody sees the same value here */
+		if(B->last == r)
+			break;
+	}
+	return 0;
+}
+
+/* argl is the gang mode; return the rounds per second */
+static int barrier_process(int argl, void* args)
+{
+	ASSERT(SetGang(GetPid(), argl)==0);
+
+	struct barrier_run B = { BARRIER_INIT, cpu_cores(), -1, 0 };
+	Tid_t threads[B.nthreads];
+	for(int i=0; i<B.nthreads; i++)
+		threads[i] = CreateThread(barrier_worker, i, &B);
+	for(int i=0; i<B.nthreads; i++)
+		ThreadJoin(threads[i], NULL);
+	return B.rounds * 1000 / BARRIER_MSEC;
+}
+
+static int barrier_burner(int argl, void* args)
+{
+	volatile int* stop = args;
+	while(! *stop)
+		;
+	return 0;
+}
+
+BOOT_TEST(bench_barrier_gang,
+	"Compare the rate of barrier rounds of a process with and without gang mode, under CPU load.",
+	.timeout = 60
+	)
+{
+	int rate[2];
+	for(int gang=0; gang<2; gang++) {
+		volatile int stop = 0;
+		Tid_t burners[cpu_cores()];
+		for(int i=0; i<cpu_cores(); i++)
+			burners[i] = CreateThread(barrier_burner, 0, (void*)&stop);
+
+		Pid_t pid = Exec(barrier_process, gang, NULL);
+		ASSERT(WaitChild(pid, &rate[gang])==pid);
+
+		stop = 1;
+		for(int i=0; i<cpu_cores(); i++)
+			ThreadJoin(burners[i], NULL);
+	}
+
+	MSG("barrier rounds/sec: %8d without gang mode\n", rate[0]);
+	MSG("barrier rounds/sec: %8d with gang mode\n", rate[1]);
+	return 0;
+}
+
+
+/*
+	bench_level_quanta
+
+	Two threads compute fibo() in a loop and sink to the lowest MLFQ
+	levels. Report the context switches per second among them, and then
+	the oversleep of an echo thread that wakes up every few msec, as a
+	terminal echo would, with a flat QUANTUM at every level and with the
+	default per-level time slices (see set_sched_quanta()).
+ */
+
+#define QUANTA_BURNERS 2
+#define QUANTA_SETTLE_MSEC 500
+#define QUANTA_MEASURE_MSEC 2000
+#define QUANTA_ECHOES 200
+#define QUANTA_ECHO_MSEC 3
+
+struct quanta_run {
+	volatile int stop;
+	double late[QUANTA_ECHOES];
+};
+
+static int quanta_burner(int argl, void* args)
+{
+	struct quanta_run* Q = args;
+	volatile unsigned int sink = 0;
+	while(! Q->stop)
+		sink += fibo(20);
+	return 0;
+}
+
+static int quanta_echo(int argl, void* args)
+{
+	struct quanta_run* Q = args;
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	Mutex_Lock(&mx);
+	for(int i=0; i<QUANTA_ECHOES; i++) {
+		double start = bench_now_nsec();
+		Cond_TimedWait(&mx, &cv, QUANTA_ECHO_MSEC);
+		Q->late[i] = (bench_now_nsec() - start) / 1E6 - QUANTA_ECHO_MSEC;
+	}
+	Mutex_Unlock(&mx);
+	return 0;
+}
+
+static unsigned long quanta_switches()
+{
+	unsigned long switches = 0;
+	for(int l=0; l<PRIORITY_QUEUES; l++)
+		switches += cctx[0].level_switches[l];
+	return switches;
+}
+
+static void quanta_sleep(timeout_t msec)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, msec);
+	Mutex_Unlock(&mx);
+}
+
+static int quanta_boot(int argl, void* args)
+{
+	struct quanta_run Q = { 0 };
+
+	Tid_t burners[QUANTA_BURNERS];
+	for(int i=0; i<QUANTA_BURNERS; i++)
+		burners[i] = CreateThread(quanta_burner, 0, &Q);
+
+	/* Let the burners sink, then count their switches */
+	quanta_sleep(QUANTA_SETTLE_MSEC);
+	unsigned long switches = quanta_switches();
+	double start = bench_now_nsec();
+	quanta_sleep(QUANTA_MEASURE_MSEC);
+	/* Less the switches to this thread and back */
+	switches = quanta_switches() - switches - 2;
+	double secs = (bench_now_nsec() - start) / 1E9;
+
+	Tid_t echo = CreateThread(quanta_echo, 0, &Q);
+	ThreadJoin(echo, NULL);
+	Q.stop = 1;
+	for(int i=0; i<QUANTA_BURNERS; i++)
+		ThreadJoin(burners[i], NULL);
+
+	qsort(Q.late, QUANTA_ECHOES, sizeof(double), cmp_double);
+	MSG("%s slices: %5.0f fibo switches/sec, echo late p50 %.2f  p99 %.2f msec\n",
+		(const char*)args, switches/secs, Q.late[QUANTA_ECHOES/2], Q.late[QUANTA_ECHOES*99/100]);
+	return 0;
+}
+
+BARE_TEST(bench_level_quanta,
+	"Compare the context switch rate of CPU-bound threads and the wakeup latency of an echo thread,\n"
+	"with a flat quantum and with per-level MLFQ time slices.",
+	.timeout = 60
+	)
+{
+	static const char flat[] = "flat     ", per_level[] = "per-level";
+
+	ASSERT(set_sched_quanta(QUANTUM/1000, QUANTUM/1000) == 0);
+	boot(1, 0, quanta_boot, sizeof(flat), (void*)flat);
+
+	/* Restore the default */
+	ASSERT(set_sched_quanta(MLFQ_QUANTUM_TOP/1000, MLFQ_QUANTUM_BOTTOM/1000) == 0);
+	boot(1, 0, quanta_boot, sizeof(per_level), (void*)per_level);
+}
+
+
+/*
+	bench_balance
+
+	Start BALANCE_PILE threads per core on core 0 and one more on each
+	other core, and then let the threads of core 0 run anywhere. The
+	other cores are never idle, so they do not steal; only the balancer
+	spreads the pile. Report the balancer migrations per second, and
+	the least and most progress of a thread of the pile, relative to
+	the mean.
+ */
+
+#define BALANCE_PILE 4
+#define BALANCE_MSEC 1000
+
+struct balance_run {
+	volatile int stop;
+	volatile unsigned long progress[];
+};
+
+static int balance_spinner(int argl, void* args)
+{
+	struct balance_run* R = args;
+	while(! R->stop)
+		R->progress[argl]++;
+	return 0;
+}
+
+static unsigned long balanced_in_total()
+{
+	unsigned long total = 0;
+	for(uint c=0; c<cpu_cores(); c++)
+		total += cctx[c].balanced_in;
+	return total;
+}
+
+BOOT_TEST(bench_balance,
+	"Report how the load balancer spreads threads piled on one core over busy cores.",
+	.timeout = 60
+	)
+{
+	uint ncores = cpu_cores();
+	if(ncores < 2) {
+		MSG("balance: needs at least 2 cores\n");
+		return 0;
+	}
+
+	int npile = BALANCE_PILE * ncores;
+	int nthreads = npile + ncores - 1;
+	struct balance_run* R = calloc(1, sizeof(struct balance_run) + nthreads*sizeof(unsigned long));
+	Tid_t threads[nthreads];
+
+	/* New threads inherit the affinity of their creator */
+	for(int i=0; i<nthreads; i++) {
+		uint core = (i < npile) ? 0 : i - npile + 1;
+		if(i == 0 || i >= npile)
+			ASSERT(SetAffinity(ThreadSelf(), 1u << core)==0);
+		threads[i] = CreateThread(balance_spinner, i, R);
+	}
+	ASSERT(SetAffinity(ThreadSelf(), ~0u)==0);
+
+	unsigned long balanced = balanced_in_total();
+	double start = bench_now_nsec();
+	for(int i=0; i<npile; i++)
+		ASSERT(SetAffinity(threads[i], ~0u)==0);
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, BALANCE_MSEC);
+	Mutex_Unlock(&mx);
+
+	R->stop = 1;
+	double secs = (bench_now_nsec() - start) / 1E9;
+	balanced = balanced_in_total() - balanced;
+	for(int i=0; i<nthreads; i++)
+		ThreadJoin(threads[i], NULL);
+
+	double sum = 0, least = R->progress[0], most = R->progress[0];
+	for(int i=0; i<npile; i++) {
+		sum += R->progress[i];
+		if(R->progress[i] < least) least = R->progress[i];
+		if(R->progress[i] > most) most = R->progress[i];
+	}
+	MSG("balance: %5.1f migrations/sec, pile progress min %.2f  max %.2f of the mean\n",
+		balanced / secs, least * npile / sum, most * npile / sum);
+	free(R);
+	return 0;
+}
+
+
+/*
+	bench_syscall_throughput
+
+	Processes that share nothing call the kernel in a loop: a byte
+	written to and read back from a pipe of their own, and GetPid().
+	Report the system calls per second with one such process and with
+	one per core. No lock is shared by the processes, so the rate
+	should grow with the number of cores.
+ */
+
+#define SYSCALL_MSEC 500
+
+static int syscall_process(int argl, void* args)
+{
+	unsigned long* ops = *(unsigned long**)args;
+	pipe_t pipe;
+	char c = 'x';
+	ASSERT(Pipe(&pipe)==0);
+
+	double end = bench_now_nsec() + SYSCALL_MSEC*1E6;
+	unsigned long n = 0;
+	while(bench_now_nsec() < end) {
+		for(int i=0; i<100; i++) {
+			ASSERT(Write(pipe.write, &c, 1)==1 && Read(pipe.read, &c, 1)==1);
+			GetPid();
+		}
+		n += 300;
+	}
+	*ops = n;
+	return 0;
+}
+
+/* Run nprocs syscall processes and return their total calls per second */
+static double syscall_rate(uint nprocs)
+{
+	unsigned long ops[nprocs];
+	Pid_t pids[nprocs];
+
+	double start = bench_now_nsec();
+	/* Exec copies the arguments, so pass a pointer to the slot */
+	for(uint i=0; i<nprocs; i++) {
+		unsigned long* slot = &ops[i];
+		pids[i] = Exec(syscall_process, sizeof(slot), &slot);
+	}
+	for(uint i=0; i<nprocs; i++)
+		ASSERT(WaitChild(pids[i], NULL)==pids[i]);
+	double secs = (bench_now_nsec() - start) / 1E9;
+
+	double total = 0;
+	for(uint i=0; i<nprocs; i++)
+		total += ops[i];
+	return total / secs;
+}
+
+BOOT_TEST(bench_syscall_throughput,
+	"Report the system call rate of independent processes, with one process and with one per core.",
+	.timeout = 60
+	)
+{
+	double one = syscall_rate(1);
+	double all = syscall_rate(cpu_cores());
+
+	MSG("syscalls/sec: %10.0f with 1 process\n", one);
+	MSG("syscalls/sec: %10.0f with %u processes (%.2fx)\n", all, cpu_cores(), all / one);
+	return 0;
+}
+
+
+/*
+	bench_lock_contention
+
+	One thread per core locks and unlocks the same lock in a loop, with
+	a short critical section and preemption off, as the scheduler does.
+	Report the percentiles of the time taken to acquire a Mutex and a
+	TicketLock, with 2, 8 and 32 cores.
+ */
+
+#define LOCK_MSEC 300
+#define LOCK_SAMPLES 20000
+#define LOCK_WORK 50
+
+struct lock_run {
+	barrier bar;
+	unsigned int nthreads;
+	Mutex mutex;
+	TicketLock ticket;
+	volatile unsigned long counter;
+	unsigned int nsamples[2][MAX_CORES];
+	double* samples[2];	/* LOCK_SAMPLES per thread */
+};
+
+static int lock_worker(int argl, void* args)
+{
+	struct lock_run* L = args;
+
+	for(int kind=0; kind<2; kind++) {
+		BarrierSync(&L->bar, L->nthreads);
+
+		double* samples = L->samples[kind] + argl*LOCK_SAMPLES;
+		unsigned int n = 0;
+		double end = bench_now_nsec() + LOCK_MSEC*1E6;
+		double now;
+		while((now = bench_now_nsec()) < end) {
+			int preempt = preempt_off;
+			if(kind==0) Mutex_Lock(&L->mutex); else Ticket_Lock(&L->ticket);
+			double took = bench_now_nsec() - now;
+			for(int i=0; i<LOCK_WORK; i++)
+				L->counter++;
+			if(kind==0) Mutex_Unlock(&L->mutex); else Ticket_Unlock(&L->ticket);
+			if(preempt) preempt_on;
+
+			if(n < LOCK_SAMPLES)
+				samples[n++] = took;
+		}
+		L->nsamples[kind][argl] = n;
+	}
+	return 0;
+}
+
+static int lock_boot(int argl, void* args)
+{
+	uint ncores = cpu_cores();
+	struct lock_run* L = calloc(1, sizeof(struct lock_run));
+	L->bar = BARRIER_INIT;
+	L->nthreads = ncores;
+	L->mutex = MUTEX_INIT;
+	L->ticket = TICKET_LOCK_INIT;
+	for(int kind=0; kind<2; kind++)
+		L->samples[kind] = malloc(ncores*LOCK_SAMPLES*sizeof(double));
+
+	Tid_t threads[ncores];
+	for(uint i=0; i<ncores; i++)
+		threads[i] = CreateThread(lock_worker, i, L);
+	for(uint i=0; i<ncores; i++)
+		ThreadJoin(threads[i], NULL);
+
+	static const char* names[2] = { "Mutex     ", "TicketLock" };
+	for(int kind=0; kind<2; kind++) {
+		/* Pack the samples of all threads and sort them */
+		double* all = L->samples[kind];
+		unsigned int total = 0;
+		for(uint i=0; i<ncores; i++) {
+			memmove(all + total, all + i*LOCK_SAMPLES, L->nsamples[kind][i]*sizeof(double));
+			total += L->nsamples[kind][i];
+		}
+		qsort(all, total, sizeof(double), cmp_double);
+		MSG("%2u cores, %s acquire p50 %8.0f  p99 %10.0f  p99.9 %10.0f ns\n", ncores, names[kind],
+			all[total/2], all[total*99/100], all[total*999/1000]);
+		free(all);
+	}
+	free(L);
+	return 0;
+}
+
+BARE_TEST(bench_lock_contention,
+	"Report the acquisition latency of a contended Mutex and TicketLock, with 2, 8 and 32 cores.",
+	.timeout = 120
+	)
+{
+	static const uint cores[] = { 2, 8, 32 };
+	for(int i=0; i<3; i++)
+		boot(cores[i], 0, lock_boot, 0, NULL);
+}
+
+
+/*
+	bench_sleep_mutex
+
+	Many threads, several per core, take turns on one lock with a long
+	critical section. Report the wall time and the host CPU time taken
+	when the lock is a Mutex, whose waiters spin and yield, and when it
+	is a SleepMutex, whose waiters sleep.
+ */
+
+#define SMX_THREADS_PER_CORE 8
+#define SMX_ROUNDS 40
+#define SMX_WORK 20000
+
+struct smx_run {
+	int sleeping;
+	Mutex mutex;
+	SleepMutex smx;
+	volatile unsigned long counter;
+};
+
+static int smx_worker(int argl, void* args)
+{
+	struct smx_run* R = args;
+	for(int r=0; r<SMX_ROUNDS; r++) {
+		if(R->sleeping) SleepMutex_Lock(&R->smx); else Mutex_Lock(&R->mutex);
+		for(int i=0; i<SMX_WORK; i++)
+			R->counter++;
+		if(R->sleeping) SleepMutex_Unlock(&R->smx); else Mutex_Unlock(&R->mutex);
+		yield(SCHED_USER);
+	}
+	return 0;
+}
+
+/* Host CPU time of the whole simulator, in nanoseconds */
+static double bench_cpu_nsec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1E9 + ts.tv_nsec;
+}
+
+BOOT_TEST(bench_sleep_mutex,
+	"Report the wall and CPU time of many threads sharing a Mutex and a SleepMutex.",
+	.timeout = 120
+	)
+{
+	uint nthreads = SMX_THREADS_PER_CORE * cpu_cores();
+	static const char* names[2] = { "Mutex     ", "SleepMutex" };
+
+	for(int sleeping=0; sleeping<2; sleeping++) {
+		struct smx_run R = { .sleeping = sleeping, .mutex = MUTEX_INIT, .smx = SLEEP_MUTEX_INIT };
+		Tid_t threads[nthreads];
+
+		double start = bench_now_nsec();
+		double cpu = bench_cpu_nsec();
+		for(uint i=0; i<nthreads; i++)
+			threads[i] = CreateThread(smx_worker, 0, &R);
+		for(uint i=0; i<nthreads; i++)
+			ThreadJoin(threads[i], NULL);
+		double elapsed = bench_now_nsec() - start;
+		cpu = bench_cpu_nsec() - cpu;
+
+		ASSERT(R.counter == (unsigned long) nthreads*SMX_ROUNDS*SMX_WORK);
+		MSG("%3u threads, %s wall %8.1f ms  cpu %8.1f ms\n", nthreads, names[sleeping],
+			elapsed / 1E6, cpu / 1E6);
+	}
+	return 0;
+}
+
+
+/*
+	bench_mutex_cpu
+
+	Report the wall time and the host CPU time of a symposium of
+	processes, and of ten threads writing into one pipe that one thread
+	reads. Each read and write locks the pipe, and the processes lock
+	the kernel's process table, so the CPU time includes the time
+	burnt waiting for kernel mutexes.
+ */
+
+#define MUTEX_CPU_PIPE_BYTES 1000000
+
+static int mutex_cpu_writer(int argl, void* args)
+{
+	char buffer[4096] = { 0 };
+	for(int n = MUTEX_CPU_PIPE_BYTES; n > 0; ) {
+		int rc = Write(argl, buffer, n < 4096 ? n : 4096);
+		ASSERT(rc > 0);
+		n -= rc;
+	}
+	return 0;
+}
+
+static int mutex_cpu_reader(int argl, void* args)
+{
+	char buffer[4096];
+	/* A read returns early only at end of file, so ask for no more than is left */
+	for(unsigned long n = 10ul*MUTEX_CPU_PIPE_BYTES; n > 0; ) {
+		int rc = Read(argl, buffer, n < 4096 ? n : 4096);
+		ASSERT(rc > 0);
+		n -= rc;
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_mutex_cpu,
+	"Report the wall and CPU time of a symposium of processes and of a pipe with ten writers.",
+	.timeout = 120
+	)
+{
+	symposium_t symp = { .N = 4*cpu_cores(), .bites = 10 };
+	adjust_symposium(&symp, 0, -5);
+
+	double start = bench_now_nsec();
+	double cpu = bench_cpu_nsec();
+	SymposiumOfProcesses(sizeof(symp), &symp);
+	MSG("symposium of %3u processes: wall %8.1f ms  cpu %8.1f ms\n", symp.N,
+		(bench_now_nsec() - start) / 1E6, (bench_cpu_nsec() - cpu) / 1E6);
+
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	Tid_t writers[10];
+
+	start = bench_now_nsec();
+	cpu = bench_cpu_nsec();
+	Tid_t reader = CreateThread(mutex_cpu_reader, pipe.read, NULL);
+	for(int i=0; i<10; i++)
+		writers[i] = CreateThread(mutex_cpu_writer, pipe.write, NULL);
+	for(int i=0; i<10; i++)
+		ThreadJoin(writers[i], NULL);
+	Close(pipe.write);
+	ThreadJoin(reader, NULL);
+	Close(pipe.read);
+	MSG("pipe with 10 writers:       wall %8.1f ms  cpu %8.1f ms\n",
+		(bench_now_nsec() - start) / 1E6, (bench_cpu_nsec() - cpu) / 1E6);
+	return 0;
+}
+
+
+/*
+	bench_rwlock
+
+	Two threads per core look up a small shared table, and now and then
+	update it, for a while. Report the operations per second when the
+	table is guarded by a Mutex and by a RWLock, with 10% and with 1% of
+	the operations being updates.
+ */
+
+#define RW_MSEC 300
+#define RW_TABLE 16
+
+struct rw_run {
+	int rwlock;
+	int write_pct;
+	Mutex mutex;
+	RWLock rw;
+	volatile int table[RW_TABLE];
+	unsigned long ops[2*MAX_CORES];
+};
+
+static int rw_worker(int argl, void* args)
+{
+	struct rw_run* R = args;
+	unsigned int seed = 12345 + argl;
+	unsigned long n = 0;
+	volatile int sum = 0;
+
+	double end = bench_now_nsec() + RW_MSEC*1E6;
+	while(bench_now_nsec() < end) {
+		for(int k=0; k<100; k++) {
+			seed = seed*1103515245u + 12345u;
+			int write = (seed>>16) % 100 < R->write_pct;
+
+			if(R->rwlock) {
+				if(write) RWLock_WriteLock(&R->rw); else RWLock_ReadLock(&R->rw);
+			} else
+				Mutex_Lock(&R->mutex);
+
+			if(write)
+				R->table[(seed>>8) % RW_TABLE]++;
+			else
+				for(int i=0; i<RW_TABLE; i++) sum += R->table[i];
+
+			if(R->rwlock) {
+				if(write) RWLock_WriteUnlock(&R->rw); else RWLock_ReadUnlock(&R->rw);
+			} else
+				Mutex_Unlock(&R->mutex);
+		}
+		n += 100;
+	}
+	R->ops[argl] = n;
+	return 0;
+}
+
+BOOT_TEST(bench_rwlock,
+	"Report the throughput of a table under a Mutex and a RWLock, at 90/10 and 99/1 read/write mixes.",
+	.timeout = 60
+	)
+{
+	uint nthreads = 2*cpu_cores();
+	static const char* names[2] = { "Mutex ", "RWLock" };
+	static const int write_pct[2] = { 10, 1 };
+
+	struct rw_run* R = malloc(sizeof(struct rw_run));
+	for(int mix=0; mix<2; mix++)
+		for(int rwlock=0; rwlock<2; rwlock++) {
+			memset(R, 0, sizeof(struct rw_run));
+			R->rwlock = rwlock;
+			R->write_pct = write_pct[mix];
+			R->mutex = MUTEX_INIT;
+			R->rw = RWLOCK_INIT;
+
+			Tid_t threads[nthreads];
+			double start = bench_now_nsec();
+			for(uint i=0; i<nthreads; i++)
+				threads[i] = CreateThread(rw_worker, i, R);
+			for(uint i=0; i<nthreads; i++)
+				ThreadJoin(threads[i], NULL);
+			double secs = (bench_now_nsec() - start) / 1E9;
+
+			double total = 0;
+			for(uint i=0; i<nthreads; i++)
+				total += R->ops[i];
+			MSG("%2d/%d read/write, %s: %10.0f ops/sec\n", 100-write_pct[mix], write_pct[mix],
+				names[rwlock], total / secs);
+		}
+	free(R);
+	return 0;
+}
+
+
+TEST_SUITE(all_benchmarks,
+	"All scheduler and kernel benchmarks."
+	)
+{
+	&bench_switch_priority_levels,
+	&bench_thread_create_join,
+	&bench_condvar_pingpong,
+	&bench_pipe_pingpong,
+	&bench_symposium_migrations,
+	&bench_starvation_wait,
+	&bench_barrier_gang,
+	&bench_level_quanta,
+	&bench_balance,
+	&bench_syscall_throughput,
+	&bench_lock_contention,
+	&bench_sleep_mutex,
+	&bench_mutex_cpu,
+	&bench_rwlock,
+	NULL
+};
+
+
+int main(int argc, char** argv)
+{
+	register_test(&all_benchmarks);
+	return run_program(argc, argv, &all_benchmarks);
+}
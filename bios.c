@@ -70,6 +70,21 @@ typedef struct core
 /* Used to store the set of core threads' signal mask */
 static sigset_t core_signal_set;
 
+/*
+	The soft interrupt mask of the current core.
+
+	SIGUSR1 is not blocked on core threads. Instead, cpu_disable_interrupts()
+	sets this flag, and sigusr1_handler() leaves interrupts pending while it
+	is set, to be dispatched by cpu_enable_interrupts(). Thus, masking costs
+	a memory write instead of a system call.
+
+	This is a thread-local variable of the core thread (and not a field of
+	Core), so that each access is a single instruction on the current core.
+	If a thread is switched out and resumed on another core between reading
+	and writing the flag, it writes the flag of the core it is running on.
+ */
+static _Thread_local volatile sig_atomic_t intr_disabled;
+
 /* Uset to store the singleton set containing SIGUSR1 */
 static sigset_t sigusr1_set;
 
@@ -94,6 +109,12 @@ static volatile sig_atomic_t PIC_active;
 /* Bit vector denoting halted cores */
 static _Atomic uint32_t halt_vector;
 
+/* Set by cpu_core_restart_one(), so that a core about to halt does not miss it */
+static _Atomic uint32_t restart_pending;
+
+/* Bit c is set by cpu_core_restart(c), so that core c does not miss it */
+static _Atomic uint32_t restart_vector;
+
 /* PIC thread id */
 static pthread_t PIC_thread;
 
@@ -123,7 +144,11 @@ static void initialize()
 	physical_cores = get_nprocs();
 
 	USR1_sigaction.sa_sigaction = sigusr1_handler;
-	USR1_sigaction.sa_flags = SA_SIGINFO;
+	/* 
+		The handler may switch threads, so SIGUSR1 must not stay blocked
+		while it runs; nesting is prevented by the soft interrupt mask.
+	 */
+	USR1_sigaction.sa_flags = SA_SIGINFO | SA_NODEFER;
 	sigemptyset(& USR1_sigaction.sa_mask);
 
 	/* Create the sigmask to block all signals, except USR1 */
@@ -186,6 +211,7 @@ static void* core_thread(void* _core)
 		core->intvec[i] = NULL;
 
 	cpu_core_id = core->id;
+	intr_disabled = 0;
 
 	/* Set core signal mask */
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_signal_set, NULL));
@@ -347,13 +373,22 @@ static inline void dispatch_interrupts(Core* core)
  */
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 {
-	Core* core = & CORE[si->si_value.sival_int];
-
 #if defined(CORE_STATISTICS)
-	core->irq_count++;
+	CORE[si->si_value.sival_int].irq_count++;
 #endif
 
-	dispatch_interrupts(core);
+	/* If interrupts are disabled, they stay pending until re-enabled */
+	if(intr_disabled) return;
+
+	intr_disabled = 1;
+	dispatch_interrupts(curr_core());
+
+	/* 
+		We may be running on a different core now (the dispatched handler
+		may have switched threads). Re-enable interrupts there, dispatching
+		any that were deferred.
+	 */
+	cpu_enable_interrupts();
 }
 
 
@@ -901,6 +936,8 @@ void vm_run(vm_config* vmc)
 
 	/* Initialize the halted vector */
 	halt_vector = 0;
+	restart_pending = 0;
+	restart_vector = 0;
 
 	/* Launch the core threads */
 	for(uint c=0; c < ncores; c++) {
@@ -992,6 +1029,11 @@ uint cpu_cores()
 	return ncores;
 }
 
+uint cpu_physical_cores()
+{
+	return physical_cores;
+}
+
 
 
 void cpu_core_halt()
@@ -1006,25 +1048,30 @@ void cpu_core_halt()
 #endif
 
 	/* Set halt bit */
-	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_RELAXED);
+	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_SEQ_CST);
 
 #if defined(CORE_STATISTICS)
 	core->hlt_count ++;
 #endif
 
-	siginfo_t info;
-
-	/* Sleep for 10 msec */
-	//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
-	//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
-	int rc = sigwaitinfo(&sigusr1_set, &info);
-
-	if(rc>0) {
-		/* Got signal, dispatch */
-		dispatch_interrupts(core);
-	}
-	else {
-		assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
+	/* 
+		If a restart was requested while no core was halted, or this core
+		was asked to restart before it halted, do not sleep. Together with
+		the ordering in cpu_core_restart_one() and cpu_core_restart(), this
+		ensures that a restart request is never lost.
+	 */
+	int noted = __atomic_exchange_n(& restart_pending, 0, __ATOMIC_SEQ_CST);
+	noted |= __atomic_fetch_and(& restart_vector, ~cmask, __ATOMIC_SEQ_CST) & cmask;
+	if(! noted) {
+		siginfo_t info;
+
+		/* Sleep for 10 msec */
+		//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
+		//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
+		int rc = sigwaitinfo(&sigusr1_set, &info);
+		(void)rc;
+
+		assert(rc>0 || (rc==-1 &&  (errno == EINTR || errno == EAGAIN)));
 	}
 
 #if defined(CORE_STATISTICS)
@@ -1035,13 +1082,21 @@ void cpu_core_halt()
 	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
 
 	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+
+	/* 
+		Dispatch what woke us up, under the soft mask. The dispatched
+		handlers may switch threads, so SIGUSR1 must be unblocked by now.
+	 */
+	int enabled = cpu_disable_interrupts();
+	dispatch_interrupts(core);
+	if(enabled) cpu_enable_interrupts();
 }
 
 static int __core_restart(uint c)
 {
 	uint32_t cmask = 1 << c;
 
-	uint32_t prevhv = __atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
+	uint32_t prevhv = __atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_SEQ_CST);
 	if( prevhv & cmask ) {
 		interrupt_core(CORE+c);
 #if defined(CORE_STATISTICS)		
@@ -1056,16 +1111,21 @@ static int __core_restart(uint c)
 
 void cpu_core_restart(uint c)
 {
+	/* Leave a note for core c, in case it is about to halt */
+	__atomic_fetch_or(& restart_vector, 1 << c, __ATOMIC_SEQ_CST);
 	__core_restart(c);
 }
 
 
 void cpu_core_restart_one()
 {
+	/* Leave a note for any core that is about to halt */
+	__atomic_store_n(& restart_pending, 1, __ATOMIC_SEQ_CST);
+
 	/* Only restart if core_id < physical_cores */
-	uint32_t hv = halt_vector;
+	uint32_t hv;
 
-	if( (hv=halt_vector)!=0 ) {
+	if( (hv=__atomic_load_n(& halt_vector, __ATOMIC_SEQ_CST))!=0 ) {
 		uint c = __builtin_ctz(hv);
 		if(c < physical_cores)
 			__core_restart(c);
@@ -1100,24 +1160,33 @@ void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 
 int cpu_interrupts_enabled()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, NULL, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	return ! intr_disabled;
 }
 
 int cpu_disable_interrupts()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	int was_disabled = intr_disabled;
+	intr_disabled = 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	return ! was_disabled;
 }
 
 void cpu_enable_interrupts()
 {
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	intr_disabled = 0;
+
+	/* Dispatch the interrupts deferred while disabled */
+	while(curr_core()->intr_pending) {
+		intr_disabled = 1;
+		dispatch_interrupts(curr_core());
+		intr_disabled = 0;
+	}
 }
 
 
+#ifdef CPU_CONTEXT_UCONTEXT
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -1129,8 +1198,8 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
   ctx->uc_stack.ss_size = ss_size;
   ctx->uc_stack.ss_flags = 0;
 
-  //CHECKRC(pthread_sigmask(0, NULL, & ctx->uc_sigmask));  /* We don't want any signals changed */
-  sigfillset( & ctx->uc_sigmask );
+  /* Interrupts are masked by the soft mask, not the signal mask */
+  ctx->uc_sigmask = core_signal_set;
   makecontext(ctx, (void*) ctx_func, 0);
 }
 
@@ -1140,6 +1209,86 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#else
+
+/*
+	x86-64 context switch.
+
+	A saved context is a pointer to the top of a stack, which looks as
+	follows (higher addresses first):
+
+		return address (into cpu_swap_context)
+		rbp, rbx, r12, r13, r14, r15
+		mxcsr          (at sp+8)
+		x87 control    (at sp)
+
+	These are exactly the registers that the System V ABI requires a
+	function call to preserve; all others are saved by the caller of
+	cpu_swap_context(). The signal mask is not touched.
+
+	void __cpu_switch(void** oldsp, void* newsp)
+ */
+void __cpu_switch(void** oldsp, void* newsp);
+
+__asm__(
+	"	.text\n"
+	"	.p2align 4\n"
+	"	.type __cpu_switch, @function\n"
+	"__cpu_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $16, %rsp\n"
+	"	stmxcsr 8(%rsp)\n"
+	"	fnstcw (%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	fldcw (%rsp)\n"
+	"	ldmxcsr 8(%rsp)\n"
+	"	addq $16, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	"	.size __cpu_switch, .-__cpu_switch\n"
+);
+
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* The top of the stack, aligned to 16 bytes */
+	uint64_t* top = (uint64_t*) (((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15);
+
+	/*
+		Build the frame that __cpu_switch() will pop. It 'returns' into
+		ctx_func, with the stack aligned as if ctx_func had been called
+		(with a null return address, since ctx_func never returns).
+	 */
+	uint64_t* sp = top - 10;
+	sp[9] = 0;                      /* return address of ctx_func */
+	sp[8] = (uint64_t) ctx_func;    /* return address of __cpu_switch */
+	for(int i=2; i<8; i++) 
+		sp[i] = 0;                  /* rbp, rbx, r12-r15 */
+	sp[1] = 0x1F80;                 /* default mxcsr */
+	sp[0] = 0x037F;                 /* default x87 control word */
+
+	ctx->sp = sp;
+}
+
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	__cpu_switch(& oldctx->sp, newctx->sp);
+}
+
+#endif
+
 
 
 /*
@@ -1176,6 +1325,13 @@ TimerDuration bios_clock()
 	return get_coarse_time();
 }	
 
+TimerDuration bios_clock_fine()
+{
+	struct timespec curtime;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_nsec / 1000ul + curtime.tv_sec*1000000ull;
+}
+
 
 
 uint bios_serial_ports()
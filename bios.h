@@ -302,6 +302,15 @@ extern _Thread_local uint cpu_core_id;
  */
 uint cpu_cores();
 
+/**
+	@brief Returns the number of CPUs of the host machine.
+
+	When there are more simulated cores than host CPUs, a halted core
+	whose id is not less than this number is not restarted by
+	@c cpu_core_restart_one(), so as not to oversubscribe the host.
+ */
+uint cpu_physical_cores();
+
 
 /**
 	@brief Barrier synchronization for all cores.
@@ -386,6 +395,8 @@ void cpu_core_halt();
 	@brief Restart the given core.
 
 	This call will restart the given core, if it was halted.
+	If the core is not halted, the request is remembered, and the
+	next call to @c cpu_core_halt() on that core returns immediately.
 	@param c the core to restart
 */
 void cpu_core_restart(uint c);
@@ -394,6 +405,9 @@ void cpu_core_restart(uint c);
 	@brief Restart some halted core.
 
 	This call will restart some halted core, if at least one exists.
+	If no core is halted, the request is remembered, and the next call
+	to @c cpu_core_halt() returns immediately. Thus, a core that decides
+	to halt concurrently with this call will not miss it.
 */
 void cpu_core_restart_one();
 
@@ -405,10 +419,33 @@ void cpu_core_restart_one();
 void cpu_core_restart_all();
 
 
+/**
+	@brief Use the portable context switch.
+
+	On x86-64, CPU contexts are switched by a few lines of assembly, which
+	save and restore the callee-saved registers and the floating point
+	control state. Elsewhere (or if this macro is defined), the slower
+	@c swapcontext() is used, which also makes a system call to save and
+	restore the signal mask.
+
+	Neither implementation saves the interrupt state of the core: context
+	switches are done with interrupts disabled, and the new context decides
+	whether to enable them.
+*/
+#if !defined(__x86_64__) && !defined(CPU_CONTEXT_UCONTEXT)
+#define CPU_CONTEXT_UCONTEXT
+#endif
+
 /**
 	@brief A type for saving CPU context into.
 */
+#ifdef CPU_CONTEXT_UCONTEXT
 typedef ucontext_t cpu_context_t;
+#else
+typedef struct {
+	void* sp;	/**< @brief The saved stack pointer; the registers are saved on the stack */
+} cpu_context_t;
+#endif
 
 
 /**
@@ -484,6 +521,19 @@ TimerDuration bios_cancel_timer();
 TimerDuration bios_clock();
 
 
+/**
+	@brief Get the current time from the fine-grained monotonic clock.
+
+	This function returns a monotonic clock value, in usec, with an
+	arbitrary starting point. This is the clock that drives the core
+	timers (see @c bios_set_timer). Its resolution is around 1 usec,
+	and reading it is cheap (it does not need a system call on Linux).
+	It is appropriate for measuring short intervals, and for computing
+	timer deadlines.
+ */
+TimerDuration bios_clock_fine();
+
+
 
 
 /**
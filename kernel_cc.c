@@ -32,17 +32,34 @@
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
+
+/*
+	Adaptive spinning: a waiter keeps spinning only while the owner of the
+	mutex is the current thread of another core, since then the owner is
+	making progress towards unlocking. The owner's TCB is only compared,
+	never read, as it may have been released. A NULL owner means that the 
+	mutex was locked in the non-preemptive domain, where the owner runs
+	until it unlocks, or that the locker has not recorded itself yet.
+ */
+static inline int mutex_owner_running(Mutex* lock)
+{
+  void* owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+  if(owner == NULL) return 1;
+  uint core = __atomic_load_n(&lock->core, __ATOMIC_RELAXED);
+  return core != cpu_core_id && cctx[core].current_thread == owner;
+}
+
 void Mutex_Lock(Mutex* lock)
 {
 #define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
+  while(__atomic_test_and_set(&lock->locked,__ATOMIC_ACQUIRE)) {
     int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+    while(__atomic_load_n(&lock->locked, __ATOMIC_RELAXED)) {
 #if defined(__x86__) || defined(__x86_64__)
       __builtin_ia32_pause();
 #endif
-      if(spin>0) 
+      if(spin>0 && mutex_owner_running(lock)) 
       	spin--; 
       else { 
       	spin=MUTEX_SPINS; 
@@ -52,12 +69,63 @@ void Mutex_Lock(Mutex* lock)
     }
   }
 #undef MUTEX_SPINS
+
+  /* Record the owner, if it may be preempted while it holds the mutex */
+  if(cpu_interrupts_enabled()) {
+    int preempt = preempt_off;
+    lock->core = cpu_core_id;
+    __atomic_store_n(&lock->owner, cctx[cpu_core_id].current_thread, __ATOMIC_RELAXED);
+    if(preempt) preempt_on;
+  }
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+  __atomic_store_n(&lock->owner, NULL, __ATOMIC_RELAXED);
+  __atomic_clear(&lock->locked, __ATOMIC_RELEASE);
+}
+
+
+/*
+ 	Ticket lock.
+ 	------------
+
+ 	A locker turns preemption off, as a Linux spinlock does, takes the next
+ 	ticket and spins reading the ticket being served, so the lock is
+ 	granted in FIFO order. Each waiter pauses in proportion to the number
+ 	of tickets ahead of it, so that the cache line of the lock is not read
+ 	in lockstep by everyone.
+
+ 	Since neither the holder nor a waiter can be preempted, no waiter ever
+ 	waits for a thread that has lost its core; an interrupt handler can
+ 	also take the lock, as it cannot interrupt a holder on its own core.
+ 	The preemption state of the holder is kept in the lock, and restored
+ 	by Ticket_Unlock.
+ */
+void Ticket_Lock(TicketLock* lock)
+{
+  int preempt = preempt_off;
+  unsigned int ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+  unsigned int owner;
+  while((owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE)) != ticket) {
+    for(unsigned int ahead = ticket - owner; ahead > 0; ahead--) {
+#if defined(__x86__) || defined(__x86_64__)
+      __builtin_ia32_pause();
+#endif
+    }
+  }
+  lock->preempt = preempt;
+}
+
+
+void Ticket_Unlock(TicketLock* lock)
+{
+  int preempt = lock->preempt;
+
+  /* Only the holder writes owner */
+  __atomic_store_n(&lock->owner, lock->owner+1, __ATOMIC_RELEASE);
+  if(preempt) preempt_on;
 }
 
 
@@ -91,6 +159,22 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 }
 
 
+/**
+   @internal
+   Push a waiter to the back of the ring of a condition variable.
+   Must be called with cv->waitset_lock held.
+ */
+static inline void push_to_ring(CondVar* cv, __cv_waiter* w)
+{
+	if(cv->waitset) {
+		__cv_waiter* wset = cv->waitset;
+		rlist_push_back(& wset->node, & w->node);
+	} else {
+		cv->waitset = w;
+	}
+}
+
+
 /** 
    @internal
    @brief Wait on a condition variable, specifying the cause. 
@@ -109,6 +193,7 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
   it first re-locks the mutex and then returns.  
 
   @param mx The mutex to be unlocked as the thread sleeps.
+  @param smx The sleeping mutex to be unlocked as the thread sleeps, if @c mx is NULL.
   @param cv The condition variable to sleep on.
   @param cause A cause provided to the kernel scheduler.
   @param timeout The time to sleep, or @c NO_TIMEOUT to sleep for ever.
@@ -118,36 +203,37 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
   @see Cond_Signal
   @see Cond_Broadcast
   */
-static int cv_wait(Mutex* mutex, CondVar* cv, 
+static int cv_wait(Mutex* mutex, SleepMutex* smx, CondVar* cv, 
 		enum SCHED_CAUSE cause, TimerDuration timeout)
 {
 	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0 };
 	rlnode_init(& waiter.node, &waiter);
 
-	Mutex_Lock(&(cv->waitset_lock));
+	Ticket_Lock(&(cv->waitset_lock));
 	/* We just push the current thread to the back of the list */
-	if(cv->waitset) {
-		__cv_waiter* wset = cv->waitset;
-		rlist_push_back(& wset->node, & waiter.node);
-	} else {
-		cv->waitset = &waiter;
-	}
+	push_to_ring(cv, &waiter);
 
 	/* Now atomically release mutex and sleep */
-	Mutex_Unlock(mutex);
-	sleep_releasing(STOPPED, &(cv->waitset_lock), cause, timeout);
+	if(mutex)
+		Mutex_Unlock(mutex);
+	else
+		SleepMutex_Unlock(smx);
+	sleep_releasing_ticket(STOPPED, &(cv->waitset_lock), cause, timeout);
 
 	/* Woke up, we must check wether we were signaled, and tidy up */
-	Mutex_Lock(&(cv->waitset_lock));
+	Ticket_Lock(&(cv->waitset_lock));
 	if(! waiter.removed) {
 		assert(! waiter.signalled);
 
 		/* We must remove ourselves from the ring! */
 		remove_from_ring(cv, &waiter);
 	}
-	Mutex_Unlock(&(cv->waitset_lock));
+	Ticket_Unlock(&(cv->waitset_lock));
 
-	Mutex_Lock(mutex);
+	if(mutex)
+		Mutex_Lock(mutex);
+	else
+		SleepMutex_Lock(smx);
 	return waiter.signalled;
 }
 
@@ -157,15 +243,18 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
   Helper for Cond_Signal and Cond_Broadcast. This method 
   will actually find a waiter to signal, if one exists. 
   Else, it leaves the cv->waitset == NULL.
+
+  The waiter is made ready by @c wake, which is either @c wakeup or
+  @c wakeup_to.
  */
-static inline void cv_signal(CondVar* cv)
+static inline void cv_signal(CondVar* cv, int (*wake)(TCB*))
 {
 	/* Wakeup first process in the waiters' queue, if it exists. */
 	while(cv->waitset) {
 		__cv_waiter* waiter = cv->waitset;
 		remove_from_ring(cv, waiter);
 		waiter->removed = 1;
-		if(wakeup(waiter->thread)) {
+		if(wake(waiter->thread)) {
 			waiter->signalled = 1;
 			return;
 		}
@@ -176,33 +265,194 @@ static inline void cv_signal(CondVar* cv)
 
 int Cond_Wait(Mutex* mutex, CondVar* cv)
 {
-	return cv_wait(mutex, cv, SCHED_USER, NO_TIMEOUT);
+	return cv_wait(mutex, NULL, cv, SCHED_USER, NO_TIMEOUT);
 }
 
 int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
 {
 	/* We have to translate timeout from msec to usec */
-	return cv_wait(mutex, cv, SCHED_USER, timeout*1000ul);
+	return cv_wait(mutex, NULL, cv, SCHED_USER, timeout*1000ul);
 }
 
 
 void Cond_Signal(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
-  cv_signal(cv);
-  Mutex_Unlock(&(cv->waitset_lock));
+  Ticket_Lock(&(cv->waitset_lock));
+  cv_signal(cv, wakeup);
+  Ticket_Unlock(&(cv->waitset_lock));
 }
 
 
 void Cond_Broadcast(CondVar* cv)
 {
-  Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
-  Mutex_Unlock(&(cv->waitset_lock));
+  Ticket_Lock(&(cv->waitset_lock));
+  while(cv->waitset) cv_signal(cv, wakeup);
+  Ticket_Unlock(&(cv->waitset_lock));
 }
 
 
 
+/*
+	Sleeping mutexes.
+	-----------------
+
+	This is the futex-based mutex of Drepper's "Futexes are tricky", with
+	the wait queue of the mutex in place of the kernel futex queue. The
+	state is 0 when unlocked, 1 when locked, and 2 when locked with 
+	(possibly) sleepers. A locker that finds the mutex locked sets the
+	state to 2 and sleeps; an unlocker that finds the state at 2 wakes up
+	a sleeper, which tries again.
+ */
+
+/* Sleep on the wait queue of mx, unless it has been unlocked meanwhile */
+static void smx_sleep(SleepMutex* mx)
+{
+	CondVar* cv = &mx->sleepers;
+	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0 };
+	rlnode_init(& waiter.node, &waiter);
+
+	Ticket_Lock(&(cv->waitset_lock));
+	if(__atomic_load_n(&mx->state, __ATOMIC_RELAXED) != 2) {
+		Ticket_Unlock(&(cv->waitset_lock));
+		return;
+	}
+	push_to_ring(cv, &waiter);
+	sleep_releasing_ticket(STOPPED, &(cv->waitset_lock), SCHED_USER, NO_TIMEOUT);
+
+	Ticket_Lock(&(cv->waitset_lock));
+	if(! waiter.removed)
+		remove_from_ring(cv, &waiter);
+	Ticket_Unlock(&(cv->waitset_lock));
+}
+
+void SleepMutex_Lock(SleepMutex* mx)
+{
+	/* The fast path: the mutex is free */
+	int c = 0;
+	if(__atomic_compare_exchange_n(&mx->state, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	/* Mark it contended, and sleep until we find it free */
+	if(c != 2)
+		c = __atomic_exchange_n(&mx->state, 2, __ATOMIC_ACQUIRE);
+	while(c != 0) {
+		smx_sleep(mx);
+		c = __atomic_exchange_n(&mx->state, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+void SleepMutex_Unlock(SleepMutex* mx)
+{
+	if(__atomic_exchange_n(&mx->state, 0, __ATOMIC_RELEASE) == 2) {
+		Ticket_Lock(&(mx->sleepers.waitset_lock));
+		cv_signal(&mx->sleepers, wakeup);
+		Ticket_Unlock(&(mx->sleepers.waitset_lock));
+	}
+}
+
+int Cond_SleepWait(SleepMutex* mx, CondVar* cv)
+{
+	return cv_wait(NULL, mx, cv, SCHED_USER, NO_TIMEOUT);
+}
+
+int Cond_SleepTimedWait(SleepMutex* mx, CondVar* cv, timeout_t timeout)
+{
+	/* We have to translate timeout from msec to usec */
+	return cv_wait(NULL, mx, cv, SCHED_USER, timeout*1000ul);
+}
+
+
+
+/*
+	Reader-writer locks.
+	--------------------
+
+	A reader increments the counter of its core, and then checks the
+	writer flag; a writer raises the flag, and then sums the counters. 
+	Both sides use sequentially consistent atomics, so at least one of 
+	them sees the other: either the writer counts the reader, or the
+	reader sees the flag, and gives way by undoing its increment.
+
+	A reader may unlock on a different core than it locked on, so a
+	counter can go negative; only the sum of the counters matters.
+ */
+
+#if RWLOCK_SLOTS < MAX_CORES
+#error "RWLOCK_SLOTS must be at least MAX_CORES"
+#endif
+
+#define RWLOCK_SPINS (cpu_cores()>1 ?  1000 : 10000)
+
+/* Wait a little; yield now and then, in the preemptive domain */
+static inline void rwlock_backoff(int* spin)
+{
+#if defined(__x86__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#endif
+	if(*spin>0)
+		(*spin)--;
+	else {
+		*spin = RWLOCK_SPINS;
+		if(cpu_interrupts_enabled())
+			yield(SCHED_MUTEX);
+	}
+}
+
+static inline int rwlock_readers(RWLock* rw)
+{
+	int sum = 0;
+	for(uint c=0; c<cpu_cores(); c++)
+		sum += __atomic_load_n(&rw->readers[c].count, __ATOMIC_SEQ_CST);
+	return sum;
+}
+
+void rwlock_read_lock(RWLock* rw)
+{
+	int spin = RWLOCK_SPINS;
+	for(;;) {
+		int* count = &rw->readers[cpu_core_id].count;
+		__atomic_add_fetch(count, 1, __ATOMIC_SEQ_CST);
+		if(! __atomic_load_n(&rw->writer, __ATOMIC_SEQ_CST))
+			return;
+
+		/* Give way to the writer */
+		__atomic_sub_fetch(count, 1, __ATOMIC_RELEASE);
+		while(__atomic_load_n(&rw->writer, __ATOMIC_RELAXED))
+			rwlock_backoff(&spin);
+	}
+}
+
+void rwlock_read_unlock(RWLock* rw)
+{
+	__atomic_sub_fetch(&rw->readers[cpu_core_id].count, 1, __ATOMIC_RELEASE);
+}
+
+void rwlock_write_lock(RWLock* rw)
+{
+	Mutex_Lock(&rw->writers);
+	__atomic_store_n(&rw->writer, 1, __ATOMIC_SEQ_CST);
+
+	int spin = RWLOCK_SPINS;
+	while(rwlock_readers(rw) != 0)
+		rwlock_backoff(&spin);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
+void rwlock_write_unlock(RWLock* rw)
+{
+	__atomic_store_n(&rw->writer, 0, __ATOMIC_RELEASE);
+	Mutex_Unlock(&rw->writers);
+}
+
+#undef RWLOCK_SPINS
+
+void sys_RWLock_ReadLock(RWLock* rw) { rwlock_read_lock(rw); }
+void sys_RWLock_ReadUnlock(RWLock* rw) { rwlock_read_unlock(rw); }
+void sys_RWLock_WriteLock(RWLock* rw) { rwlock_write_lock(rw); }
+void sys_RWLock_WriteUnlock(RWLock* rw) { rwlock_write_unlock(rw); }
+
+
+
 
 
 /*
@@ -212,58 +462,49 @@ void Cond_Broadcast(CondVar* cv)
  */
 
 /**
- * @brief The kernel lock.
+ * @brief The kernel locks.
  *
- * Kernel locking is provided by a semaphore, implemented as a monitor.
- * A semaphre for kernel locking has advantages over a simple mutex. 
- * The main advantage is that @c kernel_mutex is held for a very short time
- * regardless of contention. Thus, in multicore machines, it allows for cores
- * to be passed to other threads. 
+ * Kernel locking is provided by semaphores, implemented as monitors.
+ * A semaphore for kernel locking has advantages over a simple mutex. 
+ * The main advantage is that the lock's @c mutex is held for a very short
+ * time regardless of contention. Thus, in multicore machines, it allows for
+ * cores to be passed to other threads. 
  * 
  */
 
-/* This mutex is used to implement the kernel semaphore as a monitor. */
-static Mutex kernel_mutex = MUTEX_INIT;
-
-/* Semaphore counter */
-static int kernel_sem = 1;
-
-/* Semaphore condition */
-static CondVar kernel_sem_cv = COND_INIT;
-
-void kernel_lock()
+void kernel_lock(kernel_lock_t* kl)
 {
-	Mutex_Lock(& kernel_mutex);
-	while(kernel_sem<=0) {
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
+	Mutex_Lock(& kl->mutex);
+	while(kl->sem<=0) {
+		Cond_Wait(& kl->mutex, &kl->cv);
 	}
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);
+	kl->sem--;
+	Mutex_Unlock(& kl->mutex);
 }
 
-void kernel_unlock()
+void kernel_unlock(kernel_lock_t* kl)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	Mutex_Unlock(& kernel_mutex);
+	Mutex_Lock(& kl->mutex);
+	kl->sem++;
+	Cond_Signal(&kl->cv);
+	Mutex_Unlock(& kl->mutex);
 }
 
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(kernel_lock_t* kl, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan_name, TimerDuration timeout)
 {
 	/* Atomically release kernel semaphore */
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
+	Mutex_Lock(& kl->mutex);
+	kl->sem++;
+	Cond_Signal(&kl->cv);	
 
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
+	int ret = cv_wait(&kl->mutex, NULL, cv, cause, timeout);
 
 	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);		
+	while(kl->sem<=0)
+		Cond_Wait(& kl->mutex, &kl->cv);
+	kl->sem--;
+	Mutex_Unlock(& kl->mutex);		
 
 	return ret;
 }
@@ -278,12 +519,27 @@ void kernel_broadcast(CondVar* cv)
 	Cond_Broadcast(cv); 
 }
 
-void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
+void kernel_signal_handoff(CondVar* cv)
+{
+	Ticket_Lock(&(cv->waitset_lock));
+	cv_signal(cv, wakeup_to);
+	Ticket_Unlock(&(cv->waitset_lock));
+}
+
+void kernel_broadcast_handoff(CondVar* cv)
+{
+	/* Only the first waiter can be reserved; wakeup_to() falls back to wakeup() */
+	Ticket_Lock(&(cv->waitset_lock));
+	while(cv->waitset) cv_signal(cv, wakeup_to);
+	Ticket_Unlock(&(cv->waitset_lock));
+}
+
+void kernel_sleep(kernel_lock_t* kl, Thread_state newstate, enum SCHED_CAUSE cause)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
+	Mutex_Lock(& kl->mutex);
+	kl->sem++;
+	Cond_Signal(&kl->cv);
+	sleep_releasing(newstate, &kl->mutex, cause, NO_TIMEOUT);
 }
 
 
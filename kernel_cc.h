@@ -33,31 +33,55 @@
 
 
 /*
- * Kernel preemption control.
- * These are wrappers for the kernel monitor.
+ * Kernel locks.
+ * These are semaphores, implemented as monitors.
  */
 
 /**
-	@brief Lock the kernel.
+	@brief A kernel lock.
+
+	Each kernel subsystem (processes, pipes, sockets, devices) has its
+	own kernel lock, so that system calls on unrelated objects can run
+	in parallel. The @c mutex is held only for a short time, regardless
+	of contention; a thread that blocks holding a kernel lock releases
+	it by @c kernel_wait or @c kernel_sleep.
+
+	When more than one kernel lock is needed, they are taken in the
+	order: process lock, socket lock, pipe locks, device locks.
+
+	@see KERNEL_LOCK_INIT
+ */
+typedef struct kernel_lock
+{
+	Mutex mutex;		/**< @brief Protects the semaphore counter */
+	int sem;			/**< @brief The semaphore counter */
+	CondVar cv;			/**< @brief Signalled when the semaphore is released */
+} kernel_lock_t;
+
+/** @brief Initializer for kernel locks. */
+#define KERNEL_LOCK_INIT ((kernel_lock_t){ { 0, 0, NULL }, 1, { NULL, { 0, 0, 0 } } })
+
+/**
+	@brief Lock a kernel lock.
  */
-void kernel_lock();
+void kernel_lock(kernel_lock_t* kl);
 
 /**
-	@brief Unlock the kernel.
+	@brief Unlock a kernel lock.
  */
-void kernel_unlock();
+void kernel_unlock(kernel_lock_t* kl);
 
 /**
-	@brief Wait on a condition variable using the kernel lock.
+	@brief Wait on a condition variable using a kernel lock.
 	@returns 1 if signalled, 0 if not
   */
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(kernel_lock_t* kl, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan, TimerDuration timeout);
 
-#define kernel_wait(cv, cause) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, NO_TIMEOUT)
-#define kernel_timedwait(cv, cause, timeout) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
+#define kernel_wait(kl, cv, cause) \
+	kernel_wait_wchan((kl),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+#define kernel_timedwait(kl, cv, cause, timeout) \
+	kernel_wait_wchan((kl),(cv),(cause),__FUNCTION__, (timeout))
 
 /**
 	@brief Signal a kernel condition to one waiter.
@@ -71,14 +95,60 @@ void kernel_signal(CondVar* cv);
   */
 void kernel_broadcast(CondVar* cv);
 
+/**
+	@brief Signal a kernel condition to one waiter, handing it the core.
+
+	The waiter is woken by @c wakeup_to(), so that it runs on the current
+	core as soon as the caller blocks. Use this when the caller is about
+	to wait for the woken thread.
+	@see kernel_handoff_wait
+  */
+void kernel_signal_handoff(CondVar* cv);
+
+/**
+	@brief Signal a kernel condition to all waiters, handing the core to the first.
+	@see kernel_signal_handoff
+  */
+void kernel_broadcast_handoff(CondVar* cv);
+
+/**
+	@brief Wake up all waiters of @c wake_cv and wait on @c cv.
+
+	The core passes directly to the first thread woken, without a trip
+	through the run queues.
+  */
+#define kernel_handoff_wait(kl, wake_cv, cv, cause) \
+	(kernel_broadcast_handoff(wake_cv), kernel_wait((kl),(cv),(cause)))
+
 
 /**
-	@brief Put thread to sleep, unlocking the kernel.
+	@brief Put thread to sleep, unlocking a kernel lock.
 
 	System calls should call this function instead of @c sleep_releasing,
 	as the kernel lock is not a mutex.
   */
-void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
+void kernel_sleep(kernel_lock_t* kl, Thread_state state, enum SCHED_CAUSE cause);
+
+
+/**
+	@brief Lock a reader-writer lock for reading.
+
+	These are the kernel's entry points to the @c RWLock of tinyos.h; 
+	user code calls them through the @c RWLock_ReadLock etc. system calls.
+	They spin, and in the preemptive domain they yield now and then, 
+	like @c Mutex_Lock.
+	@see RWLock
+  */
+void rwlock_read_lock(RWLock* rw);
+
+/** @brief Unlock a reader-writer lock locked for reading. */
+void rwlock_read_unlock(RWLock* rw);
+
+/** @brief Lock a reader-writer lock for writing. */
+void rwlock_write_lock(RWLock* rw);
+
+/** @brief Unlock a reader-writer lock locked for writing. */
+void rwlock_write_unlock(RWLock* rw);
 
 
 
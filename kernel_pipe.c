@@ -37,6 +37,7 @@ int sys_Pipe(pipe_t* pipe)
 	/*initialization of the new pipe*/
 	pipe_cb* new_pipe_cb = (pipe_cb*)xmalloc(sizeof(pipe_cb));
 	new_pipe_cb -> buffer_size = 0;
+	new_pipe_cb -> lock = KERNEL_LOCK_INIT;
 
 	if(new_pipe_cb == NULL) {
 		return -1;	//failure
@@ -65,18 +66,20 @@ int pipe_write(void* pipecb_t, const char *buf, unsigned int n)
 {
 	//cast to get the pipe control block
 	pipe_cb* pipe = (pipe_cb*) pipecb_t;
+
+	kernel_lock(&pipe->lock);
 	
 	//writer and reader must not be NULL
 	if(pipe->reader == NULL || pipe->writer == NULL) {
+		kernel_unlock(&pipe->lock);
 		return -1;
 	}
 	int i=0;
 	for(i=0; i<n; i++) {
 		//if buffer is full we wait
 		while(pipe->reader!=NULL && pipe->buffer_size==PIPE_BUFFER_SIZE) {
-			//kernel broadcast since there is data to be read and writer can't write
-			kernel_broadcast(&pipe->has_data);
-			kernel_wait(&pipe->has_space, SCHED_PIPE);
+			//wake up the readers since there is data to be read and writer can't write
+			kernel_handoff_wait(&pipe->lock, &pipe->has_data, &pipe->has_space, SCHED_PIPE);
 		}
 		//write byte at position i
 		pipe->BUFFER[pipe->w_position] = buf[i];
@@ -86,7 +89,10 @@ int pipe_write(void* pipecb_t, const char *buf, unsigned int n)
 		pipe->buffer_size++;
 	}
 
+	//no handoff here: the writer may go on running, and a reserved reader
+	//could not be taken by an idle core (see kernel_handoff_wait for that)
 	kernel_broadcast(&pipe->has_data);
+	kernel_unlock(&pipe->lock);
 	return i;
 }
 
@@ -95,23 +101,26 @@ int pipe_read(void* pipecb_t, char *buf, unsigned int n)
 	//cast to get the pipe control block
 	pipe_cb* pipe = (pipe_cb*) pipecb_t;
 
+	kernel_lock(&pipe->lock);
+
 	if(pipe->reader == NULL) {
+		kernel_unlock(&pipe->lock);
 		return -1;
 	}
 	//if read position is the same as the write position then there is nothing to read
 	if(pipe->writer == NULL && pipe->r_position==pipe->w_position) {
+		kernel_unlock(&pipe->lock);
 		return 0;
 	}
 	
 	int i=0;
 	for(i=0; i<n; i++) {
 		while(pipe->writer!=NULL && pipe->buffer_size==0) {
-			kernel_broadcast(&pipe->has_space);
-			kernel_wait(&pipe->has_data, SCHED_PIPE);
+			kernel_handoff_wait(&pipe->lock, &pipe->has_space, &pipe->has_data, SCHED_PIPE);
 		}
 		//writer closed and there is nothing to be read
 		if(pipe->buffer_size == 0 && pipe->writer == NULL) {
-			return i; //success
+			break; //success
 		}
 		// read from read position of buffer the character and write it on buf at position i
 		buf[i] = pipe->BUFFER[pipe->r_position];
@@ -121,6 +130,7 @@ int pipe_read(void* pipecb_t, char *buf, unsigned int n)
 		pipe->buffer_size--;
 	}
 	kernel_broadcast(&pipe->has_space);
+	kernel_unlock(&pipe->lock);
 	return i;
 }
 
@@ -129,11 +139,16 @@ int pipe_writer_close(void* _pipecb)
 	//cast to get the pipe
 	pipe_cb* pipe = (pipe_cb*)_pipecb;
 	//check it is not closed already
-	if(pipe==NULL || pipe->writer==NULL){
+	if(pipe==NULL)
+		return -1;
+	kernel_lock(&pipe->lock);
+	if(pipe->writer==NULL){
+		kernel_unlock(&pipe->lock);
 		return -1;
 	}
 	//close the writer
 	pipe->writer = NULL;
+	kernel_unlock(&pipe->lock);
 
 	return 0;
 }
@@ -142,12 +157,17 @@ int pipe_reader_close(void* _pipecb)
 {	//cast to get the pipe
 	pipe_cb* pipe = (pipe_cb*)_pipecb;
 	//check that it is not closed already
-	if(pipe==NULL || pipe->reader==NULL) {
+	if(pipe==NULL)
+		return -1;
+	kernel_lock(&pipe->lock);
+	if(pipe->reader==NULL) {
+		kernel_unlock(&pipe->lock);
 		return -1;
 	}
 
 	//close the reader
 	pipe->reader = NULL;
+	kernel_unlock(&pipe->lock);
 
 	return 0;
 }
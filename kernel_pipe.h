@@ -2,10 +2,12 @@
 #define __KERNEL_PIPE_H
 
 #include "kernel_streams.h"  // FCB declared there
+#include "kernel_cc.h"
 
 #define PIPE_BUFFER_SIZE 256
 
 typedef struct pipe_control_block {
+    kernel_lock_t lock; /* Held by the pipe operations */
     FCB *reader, *writer;
     CondVar has_space; /* For blocking writer if no space is available 
     */
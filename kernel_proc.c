@@ -19,6 +19,12 @@
 PCB PT[MAX_PROC];
 unsigned int process_count;
 
+/* Held by the process system calls */
+kernel_lock_t proc_lock = KERNEL_LOCK_INIT;
+
+/* Held by the readers of the process table, and by its writers in proc_lock */
+RWLock pt_lock = RWLOCK_INIT;
+
 PCB* get_pcb(Pid_t pid)
 {
   return PT[pid].pstate==FREE ? NULL : &PT[pid];
@@ -63,6 +69,12 @@ static inline void initialize_PCB(PCB* pcb)
 
   rlnode_init(& pcb->ptcb_list, pcb);   //PCB contains now a list of ptcbs
   pcb->thread_count = 0;                //each PCB has many threads now
+  pcb->migrations = 0;
+  pcb->weight = DEFAULT_WEIGHT;
+  pcb->runnable = 0;
+  pcb->cpu_group = NULL;
+  pcb->gang = 0;
+  pcb->queued = 0;
 }
 
 
@@ -93,7 +105,7 @@ void initialize_processes()
 
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 PCB* acquire_PCB()
 {
@@ -110,14 +122,16 @@ PCB* acquire_PCB()
 }
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 void release_PCB(PCB* pcb)
 {
+  rwlock_write_lock(&pt_lock);
   pcb->pstate = FREE;
   pcb->parent = pcb_freelist;
   pcb_freelist = pcb;
   process_count--;
+  rwlock_write_unlock(&pt_lock);
 }
 
 
@@ -162,18 +176,37 @@ void start_thread()
 	System call to create a new process.
  */
 Pid_t sys_Exec(Task call, int argl, void* args)
+{
+  return sys_ExecEx(call, argl, args, 0);
+}
+
+
+
+/*
+	Create a new process, with the given main thread stack size.
+	Must be called with proc_lock held.
+ */
+static Pid_t exec_locked(Task call, int argl, void* args, unsigned int stack_size)
 {
   PCB *curproc, *newproc;
+
+  if(stack_size != 0 && (stack_size < MIN_STACK_SIZE || stack_size > MAX_STACK_SIZE))
+    return NOPROC;
   
-  /* The new process PCB */
+  /* The new process PCB; it is not shown to the readers before it is set up */
+  rwlock_write_lock(&pt_lock);
   newproc = acquire_PCB();
 
-  if(newproc == NULL) goto finish;  /* We have run out of PIDs! */
+  if(newproc == NULL) {
+    rwlock_write_unlock(&pt_lock);
+    goto finish;  /* We have run out of PIDs! */
+  }
 
   if(get_pid(newproc)<=1) {
     /* Processes with pid<=1 (the scheduler and the init process) 
        are parentless and are treated specially. */
     newproc->parent = NULL;
+    newproc->weight = DEFAULT_WEIGHT;
   }
   else
   {
@@ -184,17 +217,21 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     newproc->parent = curproc;
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
+    /* Inherit the CPU weight and group */
+    newproc->weight = curproc->weight;
+    set_cpu_group(newproc, curproc->cpu_group);
+
     /* Inherit file streams from parent */
-    for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
-    }
+    FIDT_copy(newproc, curproc);
   }
 
 
+  /* Gang mode is not inherited */
+  newproc->gang = 0;
+
   /* Set the main thread's function */
   newproc->main_task = call;
+  newproc->migrations = 0;
 
   /* Copy the arguments to new storage, owned by the new process */
   newproc->argl = argl;
@@ -204,6 +241,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
   }
   else
     newproc->args=NULL;
+  rwlock_write_unlock(&pt_lock);
 
   /* 
     Create and wake up the thread for the main function. This must be the last thing
@@ -214,7 +252,21 @@ Pid_t sys_Exec(Task call, int argl, void* args)
 
    // TCB* main_thread = spawn_thread(newproc, start_main_thread); 
 
-    newproc-> main_thread = spawn_thread(newproc, start_main_thread); //Create the new processes' main thread
+    newproc-> main_thread = spawn_thread(newproc, start_main_thread, stack_size); //Create the new processes' main thread
+    if(newproc->main_thread == NULL) {
+      /* Out of memory for threads: undo the process */
+      if(newproc->parent != NULL)
+        rlist_remove(& newproc->children_node);
+      FIDT_clear(newproc);
+      set_cpu_group(newproc, NULL);
+      rwlock_write_lock(&pt_lock);
+      free(newproc->args);
+      newproc->args = NULL;
+      rwlock_write_unlock(&pt_lock);
+      release_PCB(newproc);
+      newproc = NULL;
+      goto finish;
+    }
 
     PTCB* ptcb = xmalloc(sizeof(PTCB)); //Allocate space for a new PTCB that will be connected with the main thread
     //Initialize PTCB
@@ -236,6 +288,18 @@ finish:
 }
 
 
+/*
+	System call to create a new process, with the given main thread stack size.
+ */
+Pid_t sys_ExecEx(Task call, int argl, void* args, unsigned int stack_size)
+{
+  kernel_lock(&proc_lock);
+  Pid_t pid = exec_locked(call, argl, args, stack_size);
+  kernel_unlock(&proc_lock);
+  return pid;
+}
+
+
 /* System call */
 Pid_t sys_GetPid()
 {
@@ -245,7 +309,89 @@ Pid_t sys_GetPid()
 
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  kernel_lock(&proc_lock);
+  Pid_t ppid = get_pid(CURPROC->parent);
+  kernel_unlock(&proc_lock);
+  return ppid;
+}
+
+
+/* The caller, or a live child of the caller; NULL for any other pid. 
+   Must be called with proc_lock held. */
+static PCB* get_weighted_pcb(Pid_t pid)
+{
+  if(pid<0 || pid>=MAX_PROC)
+    return NULL;
+
+  PCB* pcb = get_pcb(pid);
+  if(pcb == NULL || pcb->pstate != ALIVE || (pcb != CURPROC && pcb->parent != CURPROC))
+    return NULL;
+  return pcb;
+}
+
+
+int sys_SetWeight(Pid_t pid, unsigned int weight)
+{
+  int ret = -1;
+  kernel_lock(&proc_lock);
+
+  PCB* pcb = get_weighted_pcb(pid);
+  if(pcb != NULL && weight >= 1 && weight <= MAX_WEIGHT) {
+    /* Read without locks by the scheduler, when it charges the threads */
+    __atomic_store_n(&pcb->weight, weight, __ATOMIC_RELAXED);
+    ret = 0;
+  }
+
+  kernel_unlock(&proc_lock);
+  return ret;
+}
+
+
+unsigned int sys_GetWeight(Pid_t pid)
+{
+  kernel_lock(&proc_lock);
+  PCB* pcb = get_weighted_pcb(pid);
+  unsigned int weight = (pcb == NULL) ? 0 : pcb->weight;
+  kernel_unlock(&proc_lock);
+  return weight;
+}
+
+
+int sys_SetGang(Pid_t pid, int gang)
+{
+  kernel_lock(&proc_lock);
+  PCB* pcb = get_weighted_pcb(pid);
+  if(pcb != NULL)
+    pcb->gang = (gang != 0);
+  kernel_unlock(&proc_lock);
+  return (pcb == NULL) ? -1 : 0;
+}
+
+
+int sys_CreateCpuGroup(timeout_t quota, timeout_t period)
+{
+  //the scheduler works in microseconds
+  kernel_lock(&proc_lock);
+  int group = create_cpu_group(quota*1000ul, period*1000ul);
+  kernel_unlock(&proc_lock);
+  return group;
+}
+
+
+int sys_SetCpuGroup(Pid_t pid, int group)
+{
+  int ret = -1;
+  kernel_lock(&proc_lock);
+
+  PCB* pcb = get_weighted_pcb(pid);
+  if(pcb != NULL && group >= NOGROUP && group < MAX_CPU_GROUPS
+     && (group == NOGROUP || cpu_groups[group].active)) {
+    set_cpu_group(pcb, (group == NOGROUP) ? NULL : &cpu_groups[group]);
+    ret = 0;
+  }
+
+  kernel_unlock(&proc_lock);
+  return ret;
 }
 
 
@@ -280,7 +426,7 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
   while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    kernel_wait(&proc_lock, & parent->child_exit, SCHED_USER);
   
   cleanup_zombie(child, status);
   
@@ -304,7 +450,7 @@ static Pid_t wait_for_any_child(int* status)
     has_exited = ! is_rlist_empty(& parent->exited_list);
     if( has_exited ) break;
 
-    kernel_wait(& parent->child_exit, SCHED_USER);    
+    kernel_wait(&proc_lock, & parent->child_exit, SCHED_USER);    
   }
 
   if(no_children)
@@ -321,15 +467,19 @@ static Pid_t wait_for_any_child(int* status)
 
 Pid_t sys_WaitChild(Pid_t cpid, int* status)
 {
+  kernel_lock(&proc_lock);
+
   /* Wait for specific child. */
   if(cpid != NOPROC) {
-    return wait_for_specific_child(cpid, status);
+    cpid = wait_for_specific_child(cpid, status);
   }
   /* Wait for any child */
   else {
-    return wait_for_any_child(status);
+    cpid = wait_for_any_child(status);
   }
 
+  kernel_unlock(&proc_lock);
+  return cpid;
 }
 
 
@@ -378,11 +528,16 @@ int procinfo_read(void* _procinfo_cb, char* buf, unsigned int size)
     return -1;
   }
 
+  /* The counters and links copied below may be changed under proc_lock 
+     meanwhile; the snapshot is only as consistent as a glance at them */
+  rwlock_read_lock(&pt_lock);
+
   while(proc_cb->pcb_cursor < MAX_PROC && PT[proc_cb->pcb_cursor].pstate == FREE) {
     proc_cb->pcb_cursor++;
   }
   
   if(proc_cb->pcb_cursor == MAX_PROC) {
+    rwlock_read_unlock(&pt_lock);
     return 0;
   }
 
@@ -403,15 +558,22 @@ int procinfo_read(void* _procinfo_cb, char* buf, unsigned int size)
   }
 
   proc_info->thread_count = tmp_pcb.thread_count;
+  proc_info->migrations = tmp_pcb.migrations;
+  proc_info->cpu_group = (tmp_pcb.cpu_group == NULL) ? NOGROUP : tmp_pcb.cpu_group - cpu_groups;
   proc_info->main_task = tmp_pcb.main_task;
   proc_info->argl = tmp_pcb.argl;
 
-  if(tmp_pcb.argl < PROCINFO_MAX_ARGS_SIZE) {
-    memcpy(proc_info->args, tmp_pcb.args, tmp_pcb.argl);
-  }
-  else {
-    memcpy(proc_info->args, tmp_pcb.args, PROCINFO_MAX_ARGS_SIZE);
+  /* The arguments of a zombie have been released */
+  if(tmp_pcb.args != NULL) {
+    if(tmp_pcb.argl < PROCINFO_MAX_ARGS_SIZE) {
+      memcpy(proc_info->args, tmp_pcb.args, tmp_pcb.argl);
+    }
+    else {
+      memcpy(proc_info->args, tmp_pcb.args, PROCINFO_MAX_ARGS_SIZE);
+    }
   }
+
+  rwlock_read_unlock(&pt_lock);
  
   memcpy(buf, proc_info, size);
 
@@ -433,4 +595,72 @@ int procinfo_close(void* proccb){
   free(proc_cb);
 
   return 0;
-}
\ No newline at end of file
+}
+
+
+static int groupinfo_read(void* _cursor, char* buf, unsigned int size);
+static int groupinfo_close(void* _cursor);
+
+static file_ops groupinfo_file_ops = {
+  .Open = NULL,
+  .Read = groupinfo_read,
+  .Write = NULL,
+  .Close = groupinfo_close
+};
+
+Fid_t sys_OpenGroupInfo()
+{
+  Fid_t fid;
+  FCB* fcb;
+
+  if(FCB_reserve(1, &fid, &fcb) == 0) {
+    return -1;
+  }
+
+  int* cursor = (int*)xmalloc(sizeof(int));  //the next group to return
+  *cursor = NOGROUP + 1;
+  fcb->streamobj = cursor;
+  fcb->streamfunc = &groupinfo_file_ops;
+
+  return fid;
+}
+
+static int groupinfo_read(void* _cursor, char* buf, unsigned int size)
+{
+  int* cursor = (int*) _cursor;
+
+  while(*cursor < MAX_CPU_GROUPS && !cpu_groups[*cursor].active) {
+    (*cursor)++;
+  }
+
+  if(*cursor == MAX_CPU_GROUPS) {
+    return 0;
+  }
+
+  cpu_group_t* grp = &cpu_groups[*cursor];
+  cpugroupinfo info;
+
+  info.group = *cursor;
+  info.quota = grp->quota / 1000;
+  info.period = grp->period / 1000;
+
+  Mutex_Lock(&grp->spinlock);
+  info.procs = grp->nprocs;
+  info.throttled_periods = grp->throttled_periods;
+  info.throttled_time = grp->throttled_time / 1000;
+  Mutex_Unlock(&grp->spinlock);
+
+  if(size > sizeof(info))
+    size = sizeof(info);
+  memcpy(buf, &info, size);
+
+  (*cursor)++;
+
+  return size;
+}
+
+static int groupinfo_close(void* _cursor)
+{
+  free(_cursor);
+  return 0;
+}
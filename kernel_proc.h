@@ -17,6 +17,7 @@
 
 #include "tinyos.h"
 #include "kernel_sched.h"
+#include "kernel_cc.h"
 
 /**
   @brief PID state
@@ -60,6 +61,13 @@ typedef struct process_control_block {
 
   rlnode ptcb_list;
   int thread_count;
+  unsigned long migrations; /**< @brief Core migrations of all the threads of the process, so far */
+
+  unsigned int weight;    /**< @brief The CPU weight of the process (see @c SetWeight) */
+  unsigned int runnable;  /**< @brief The threads of the process that are ready or running */
+  cpu_group_t* cpu_group; /**< @brief The CPU group of the process, or NULL (see @c SetCpuGroup) */
+  int gang;               /**< @brief Set if the process is in gang mode (see @c SetGang) */
+  unsigned int queued;    /**< @brief The threads of the process in run queues */
 
   FCB* FIDT[MAX_FILEID];  /**< @brief The fileid table of the process */
 
@@ -90,6 +98,26 @@ typedef struct process_info_control_block {
 int procinfo_read(void* procinfo_cb, char* buf, unsigned int size);
 int procinfo_close(void* proccb);
 
+/**
+  @brief The process lock.
+
+  This kernel lock protects the process table, the process tree, the
+  thread lists of the processes (PTCBs) and the CPU groups. It does not
+  protect the file tables of the processes, which are guarded by the
+  streams subsystem.
+*/
+extern kernel_lock_t proc_lock;
+
+/**
+  @brief The process table reader-writer lock.
+
+  The readers of the process table that do not hold @c proc_lock, such
+  as @c procinfo_read, lock it for reading. Whoever allocates or releases
+  a PCB, or changes its arguments, locks it for writing, while holding 
+  @c proc_lock; so the holders of @c proc_lock need not lock it to read.
+*/
+extern RWLock pt_lock;
+
 /**
   @brief Initialize the process table.
 
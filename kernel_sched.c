@@ -1,5 +1,6 @@
 
 #include <assert.h>
+#include <string.h>
 #include <sys/mman.h>
 
 #include "kernel_cc.h"
@@ -21,6 +22,9 @@
 /* Core control blocks */
 CCB cctx[MAX_CORES];
 
+/* CPU groups */
+cpu_group_t cpu_groups[MAX_CPU_GROUPS];
+
 
 /* 
 	The current core's CCB. This must only be used in a 
@@ -55,21 +59,30 @@ TCB* cur_thread()
    The thread layout.
   --------------------
 
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+  On the x86 (Pentium) architecture, the stack grows downward. Therefore, we
+  allocate the TCB at the bottom of the memory block, separated from the
+  stack by a guard page.
 
   +-------------+
   |   TCB       |
   +-------------+
+  | guard page  |
+  +-------------+
+  |      |      |
+  |      v      |
   |             |
   |    stack    |
   |             |
-  |      ^      |
-  |      |      |
   +-------------+
   | first frame |
   +-------------+
 
+  The stack size is given per thread (see spawn_thread()). The block is
+  mapped with mmap, and the guard page is made inaccessible, so that a
+  stack overflow is detected as a seg.fault instead of corrupting the TCB.
+  Pages are only backed by memory when touched, so a large stack that is
+  mostly unused costs little.
+
   Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
   crash own thread, before it affects other threads (which may make debugging
   easier).
@@ -92,45 +105,130 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+/* The guard page between the TCB and the stack */
+#define THREAD_GUARD_SIZE SYSTEM_PAGE_SIZE
+
+/* The size of the memory block of a thread with the given stack size */
+#define THREAD_SIZE(stack_size) (THREAD_TCB_SIZE + THREAD_GUARD_SIZE + (stack_size))
 
-//#define MMAPPED_THREAD_MEM
-#ifdef MMAPPED_THREAD_MEM
+/* Round a stack size up to a multiple of SYSTEM_PAGE_SIZE */
+#define THREAD_STACK_ROUND(stack_size) \
+	((((stack_size) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
+/* The bottom of the stack of a thread */
+#define THREAD_STACK(tcb) (((void*)(tcb)) + THREAD_TCB_SIZE + THREAD_GUARD_SIZE)
 
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Use mmap to allocate a thread, and make the guard page inaccessible.
+  The memory must be executable, because gcc places the trampolines of
+  nested functions on the stack.
+
+  Return NULL if the host refuses the memory; with many threads, this
+  happens when the process runs out of memory mappings. For testing,
+  the number of blocks can be limited (see set_thread_alloc_limit()).
  */
-void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
+static unsigned int thread_alloc_limit = 0;
+static unsigned int thread_blocks = 0;
+
+void set_thread_alloc_limit(unsigned int limit)
+{
+	thread_alloc_limit = limit;
+}
+
+void free_thread(void* ptr, size_t size)
+{
+	CHECK(munmap(ptr, size));
+	__atomic_sub_fetch(&thread_blocks, 1, __ATOMIC_RELAXED);
+}
 
 void* allocate_thread(size_t size)
 {
+	unsigned int blocks = __atomic_add_fetch(&thread_blocks, 1, __ATOMIC_RELAXED);
+	if (thread_alloc_limit != 0 && blocks > thread_alloc_limit) {
+		__atomic_sub_fetch(&thread_blocks, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
 	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
 		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
 
-	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+	if (ptr == MAP_FAILED) {
+		__atomic_sub_fetch(&thread_blocks, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	if (mprotect(ptr + THREAD_TCB_SIZE, THREAD_GUARD_SIZE, PROT_NONE) != 0) {
+		free_thread(ptr, size);
+		return NULL;
+	}
 
 	return ptr;
 }
-#else
+
+
 /*
-  Use malloc to allocate a thread. This is probably faster than  mmap, but
-  cannot be made easily to 'detect' stack overflow.
- */
-void free_thread(void* ptr, size_t size) { free(ptr); }
+  Get a TCB+stack block from the cache of the current core, or allocate
+  a new one. Return the block and set *cached if it came from the cache,
+  or NULL if a new block cannot be allocated.
 
-void* allocate_thread(size_t size)
+  Only blocks with the default stack size are cached. Cached blocks are
+  linked through their (otherwise unused) sched_node, and keep their
+  valgrind stack registration.
+*/
+static TCB* get_thread_block(size_t stack_size, int* cached)
 {
-	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
-	CHECK((ptr == NULL) ? -1 : 0);
-	return ptr;
+	int preempt = preempt_off;
+	CCB* ccb = &CURCORE;
+	TCB* tcb = NULL;
+	if (stack_size == THREAD_STACK_SIZE && ccb->thread_cache_size > 0) {
+		tcb = rlist_pop_front(&ccb->thread_cache)->tcb;
+		ccb->thread_cache_size--;
+	}
+	if (preempt)
+		preempt_on;
+
+	*cached = (tcb != NULL);
+	if (tcb == NULL) {
+		tcb = (TCB*)allocate_thread(THREAD_SIZE(stack_size));
+		if (tcb != NULL)
+			tcb->stack_size = stack_size;
+	}
+	return tcb;
 }
+
+/* Free a TCB+stack block */
+static void free_thread_block(TCB* tcb)
+{
+#ifndef NVALGRIND
+	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
+	free_thread(tcb, THREAD_SIZE(tcb->stack_size));
+}
+
+/*
+  Return a TCB+stack block to the cache of the current core, or free it
+  if the cache is full.
 
+  This is called in the non-preemptive domain.
+*/
+static void put_thread_block(TCB* tcb)
+{
+	CCB* ccb = &CURCORE;
+	if (tcb->stack_size == THREAD_STACK_SIZE && ccb->thread_cache_size < THREAD_CACHE_HIGH_WATER) {
+		rlnode_init(&tcb->sched_node, tcb);
+		rlist_push_front(&ccb->thread_cache, &tcb->sched_node);
+		ccb->thread_cache_size++;
+	} else
+		free_thread_block(tcb);
+}
 
+/* Free all the blocks in the cache of a core */
+static void drain_thread_cache(CCB* ccb)
+{
+	while (!is_rlist_empty(&ccb->thread_cache))
+		free_thread_block(rlist_pop_front(&ccb->thread_cache)->tcb);
+	ccb->thread_cache_size = 0;
+}
 
 
 /*
@@ -141,6 +239,8 @@ void gain(int preempt); /* forward */
 
 static void thread_start()
 {
+	/* The first core to run a thread is a placement, not a migration */
+	cur_thread()->last_core = cpu_core_id;
 	gain(1);
 	cur_thread()->thread_func();
 
@@ -149,12 +249,16 @@ static void thread_start()
 }
 
 /*
-  Initialize and return a new TCB
+  Initialize and return a new TCB, or NULL if there is no memory for it
 */
-TCB* spawn_thread(PCB* pcb, void (*func)())
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size)
 {
 	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	stack_size = (stack_size == 0) ? THREAD_STACK_SIZE : THREAD_STACK_ROUND(stack_size);
+	int cached;
+	TCB* tcb = get_thread_block(stack_size, &cached);
+	if (tcb == NULL)
+		return NULL;
 
 	/* Set the owner */
 	tcb->owner_pcb = pcb;
@@ -166,6 +270,7 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->phase = CTX_CLEAN;
 	tcb->thread_func = func;
 	tcb->wakeup_time = NO_TIMEOUT;
+	tcb->state_spinlock = MUTEX_INIT;
 	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
 
 	tcb->its = QUANTUM;
@@ -173,14 +278,31 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->last_cause = SCHED_IDLE;
 	tcb->curr_cause = SCHED_IDLE;
 
+	/* The creating core has just touched the new thread's memory. 
+	   Do not migrate between reading the core and its current thread. */
+	int preempt = preempt_off;
+	tcb->affinity = CURTHREAD->affinity;
+	tcb->last_core = cpu_core_id;
+	if (preempt)
+		preempt_on;
+	tcb->migrations = 0;
+	tcb->queue_core = -1;
+
+	/* Real-time scheduling is not inherited */
+	tcb->rt_runtime = 0;
+
+	/* Placed by the fair policy when it wakes up */
+	tcb->vruntime = 0;
+
 	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	void* sp = THREAD_STACK(tcb);
 
 	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	cpu_initialize_context(&tcb->context, sp, stack_size, thread_start);
 
 #ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
+	if (!cached)
+		tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + stack_size);
 #endif
 
 	/* increase the count of active threads */
@@ -191,16 +313,16 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	return tcb;
 }
 
+static void sched_rt_release(TCB* tcb); /* forward */
+
 /*
-  This is called with sched_spinlock locked !
+  This is called from gain(), in the non-preemptive domain.
  */
+
 void release_TCB(TCB* tcb)
 {
-#ifndef NVALGRIND
-	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
-#endif
-
-	free_thread(tcb, THREAD_SIZE);
+	sched_rt_release(tcb);
+	put_thread_block(tcb);
 
 	Mutex_Lock(&active_threads_spinlock);
 	active_threads--;
@@ -218,297 +340,2018 @@ void release_TCB(TCB* tcb)
  */
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
+  Each core owns a set of MLFQ run queues (SCHED[] in its CCB), which
+  are implemented as doubly linked lists and protected by the core's own
+  sched_spinlock. A thread that becomes ready is added to the run
+  queues of the core that last ran it, unless that core is busy and
+  another core in its affinity is idle (see sched_select_core()). A
+  core whose run queues are empty steals work from the run queues of
+  other cores.
+
+  Also, the scheduler contains a hierarchical timer wheel holding all
+  the sleeping threads with a timeout, protected by @c timeout_spinlock.
+
+  The state of each thread is protected by the thread's own
+  state_spinlock. The locking order is
 
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
+    mx (of sleep_releasing) -> tcb->state_spinlock -> timeout_spinlock -> ccb->sched_spinlock
 
-  Both of these structures are protected by @c sched_spinlock.
+  rt_admit_spinlock is taken after tcb->state_spinlock, and before no other lock.
+
+  The only exception is sched_wakeup_expired_timeouts(), which only
+  tries to lock a thread's state_spinlock while holding timeout_spinlock.
 */
-int yieldCounter;	//variable to count the yields
-rlnode SCHED[PRIORITY_QUEUES]; /* The scheduler queue */
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
+Mutex timeout_spinlock = MUTEX_INIT; /* spinlock for the timer wheel */
+Mutex rt_admit_spinlock = MUTEX_INIT; /* spinlock for CCB::rt_util */
 
-/* Interrupt handler for ALARM */
-void yield_handler() { yield(SCHED_QUANTUM); }
+/* True if the thread is in the real-time class */
+#define SCHED_IS_RT(tcb) ((tcb)->rt_runtime != 0)
 
-/* Interrupt handle for inter-core interrupts */
-void ici_handler()
-{ /* noop for now... */
+/* Bit of core c in a cpumask_t, and the mask of all existing cores */
+#define CORE_BIT(c) (((cpumask_t)1) << (c))
+#define CORE_MASK_ALL (cpu_cores() >= 32 ? ~(cpumask_t)0 : CORE_BIT(cpu_cores()) - 1)
+_Static_assert(MAX_CORES <= 32, "cpumask_t cannot hold all cores");
+
+/* True if thread tcb may run on core ccb; a real-time thread only runs on the core it is admitted on */
+#define SCHED_ALLOWED(tcb, ccb) (((tcb)->affinity & CORE_BIT((ccb)->id)) != 0 \
+	&& (!SCHED_IS_RT(tcb) || (tcb)->rt_core == (ccb)->id))
+
+/* Bit of priority level p in CCB::ready_mask, and the mask of all levels */
+#define PRIO_BIT(p) (((uint64_t)1) << (p))
+#define PRIO_MASK (PRIO_BIT(PRIORITY_QUEUES-1) | (PRIO_BIT(PRIORITY_QUEUES-1) - 1))
+_Static_assert(PRIORITY_QUEUES <= 64, "ready_mask cannot hold all priority levels");
+
+/*
+  The core timer.
+
+  ccb->sched_deadline is the time by which the core must next enter the
+  scheduler: the end of the current time slice, or (on a tickless core)
+  the time the timer wheel next needs service, or NO_TIMEOUT.
+  ccb->timer_deadline is the time the host timer is armed for.
+
+  Programming the host timer is a system call, so it is done lazily:
+  only when the scheduler needs an earlier deadline than the armed one.
+  An ALARM that arrives before sched_deadline is stale, and the handler
+  just re-arms the timer for sched_deadline. For comparison, the timer
+  can be reprogrammed for every deadline (see set_sched_lazy_timer()).
+*/
+
+/* Whether the host timer is programmed lazily */
+static int sched_lazy_timer = 1;
+
+void set_sched_lazy_timer(int lazy)
+{
+	sched_lazy_timer = lazy;
 }
 
+/* Alarms this close to the deadline (in usec) are not stale */
+#define TIMER_SLACK 50
+
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Arm the host timer for ccb->sched_deadline.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
 */
-static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
+static void sched_arm_timer(CCB* ccb, TimerDuration now)
 {
-	if (timeout != NO_TIMEOUT) {
-		/* set the wakeup time */
-		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
+	TimerDuration interval = (ccb->sched_deadline > now + TIMER_SLACK)
+		? ccb->sched_deadline - now : TIMER_SLACK;
+	bios_set_timer(interval);
+	ccb->timer_deadline = now + interval;
+	ccb->timer_syscalls++;
+}
 
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+/*
+  Disarm the host timer of the current core, if armed.
+
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
+*/
+static void sched_cancel_timer(CCB* ccb)
+{
+	ccb->sched_deadline = NO_TIMEOUT;
+	if (ccb->timer_deadline != NO_TIMEOUT) {
+		bios_cancel_timer();
+		ccb->timer_deadline = NO_TIMEOUT;
+		ccb->timer_syscalls++;
 	}
 }
 
 /*
-  Add TCB to the end of the scheduler list.
+  Set the scheduler deadline of the current core, reprogramming the host
+  timer only if the deadline is earlier than the one it is armed for.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
 */
-static void sched_queue_add(TCB* tcb)
+static void sched_set_deadline(CCB* ccb, TimerDuration deadline)
 {
-	/* Insert at the end of the equivalent scheduling list according to the priority of the tcb*/
-	rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node);
+	if (!sched_lazy_timer) {
+		if (deadline == NO_TIMEOUT)
+			sched_cancel_timer(ccb);
+		else {
+			ccb->sched_deadline = deadline;
+			sched_arm_timer(ccb, bios_clock_fine());
+		}
+		return;
+	}
 
-	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+	ccb->sched_deadline = deadline;
+	if (deadline < ccb->timer_deadline)
+		sched_arm_timer(ccb, bios_clock_fine());
 }
 
 /*
-	Adjust the state of a thread to make it READY.
+  The real-time class.
+
+  The ready real-time threads of a core are kept in ccb->RT, ordered by
+  rt_abs_deadline, under ccb->sched_spinlock. A real-time thread is
+  always queued on its rt_core, and is never stolen by another core.
+
+  The budget of the running real-time thread is charged in yield(), for
+  the time since ccb->slice_start; its time slice never exceeds its
+  budget. When the budget runs out, the thread gets a fresh budget and
+  its deadline is postponed by a period (as in the Constant Bandwidth
+  Server). A thread that wakes up after its deadline has passed starts
+  afresh, with a deadline relative to its wakeup.
+*/
 
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
- */
-static void sched_make_ready(TCB* tcb)
+/* True if thread a should run before thread b */
+static inline int sched_rt_earlier(TCB* a, TCB* b)
 {
-	assert(tcb->state == STOPPED || tcb->state == INIT);
-
-	/* Possibly remove from TIMEOUT_LIST */
-	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
-		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
-		rlist_remove(&tcb->sched_node);
-		tcb->wakeup_time = NO_TIMEOUT;
-	}
+	return !SCHED_IS_RT(b) || a->rt_abs_deadline < b->rt_abs_deadline;
+}
 
-	/* Mark as ready */
-	tcb->state = READY;
+/*
+  Insert a real-time thread in the EDF queue of a core, after the
+  threads with the same deadline.
 
-	/* Possibly add to the scheduler queue */
-	if (tcb->phase == CTX_CLEAN)
-		sched_queue_add(tcb);
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
+*/
+static void sched_rt_insert(CCB* ccb, TCB* tcb)
+{
+	rlnode* n = ccb->RT.next;
+	while (n != &ccb->RT && n->tcb->rt_abs_deadline <= tcb->rt_abs_deadline)
+		n = n->next;
+	rl_splice(n->prev, &tcb->sched_node);
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+  Return the real-time thread that should run next on a core: the head
+  of its EDF queue, which is removed, or the current thread if it is
+  ready and has an earlier deadline. Return NULL if there is neither.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
 */
-static void sched_wakeup_expired_timeouts()
+static TCB* sched_rt_pop(CCB* ccb, TCB* current)
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
-	TimerDuration curtime = bios_clock();
+	int current_rt = (current->state == READY && SCHED_IS_RT(current) && SCHED_ALLOWED(current, ccb));
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
-			break;
-		sched_make_ready(tcb);
-	}
+	if (is_rlist_empty(&ccb->RT))
+		return current_rt ? current : NULL;
+
+	TCB* head = ccb->RT.next->tcb;
+	if (current_rt && !sched_rt_earlier(head, current))
+		return current;
+
+	rlist_remove(&head->sched_node);
+	head->queue_core = -1;
+	ccb->nr_ready--;
+	ccb->load -= head->load_weight;
+	__atomic_fetch_sub(&head->owner_pcb->queued, 1, __ATOMIC_RELAXED);
+	return head;
+}
+
+/* True if a real-time thread queued on the core should preempt its current thread */
+static int sched_rt_pending(CCB* ccb)
+{
+	Mutex_Lock(&ccb->sched_spinlock);
+	int ret = !is_rlist_empty(&ccb->RT) && sched_rt_earlier(ccb->RT.next->tcb, ccb->current_thread);
+	Mutex_Unlock(&ccb->sched_spinlock);
+	return ret;
 }
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Charge the running real-time thread for the time it used. A budget
+  too small to be worth a time slice counts as used up.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
 */
-static TCB* sched_queue_select(TCB* current)
+static void sched_rt_charge(TCB* tcb, TimerDuration used)
 {
-	/* Get the head of the SCHED list */
-	rlnode* sel = NULL;
-	// pop the first available tcb starting from the highest priority queue
-	for(int i=PRIORITY_QUEUES-1; i>=0; i--) {
-		if(!is_rlist_empty(&SCHED[i])){
-			sel = rlist_pop_front(&SCHED[i]);
-			break;
-		}
+	if (used + TIMER_SLACK < tcb->rt_budget) {
+		tcb->rt_budget -= used;
+		return;
 	}
 
+	/* Overrun: postpone the deadline, with a fresh budget */
+	tcb->rt_abs_deadline += tcb->rt_period;
+	tcb->rt_budget = tcb->rt_runtime;
+}
+
+/*
+  Start the next job of a real-time thread, released at 'release'.
 
-	//TCB* next_thread = sel->tcb; /* When the list is empty, this is NULL */
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_rt_release_job(TCB* tcb, TimerDuration release)
+{
+	tcb->rt_release = release;
+	tcb->rt_job_deadline = release + tcb->rt_deadline;
+	tcb->rt_abs_deadline = tcb->rt_job_deadline;
+	tcb->rt_budget = tcb->rt_runtime;
+}
 
-	TCB* next_thread = NULL;
+/*
+  Adjust a real-time thread that wakes up: if its deadline has passed,
+  it starts afresh.
 
-	if(sel!=NULL){
-		next_thread = sel->tcb; /* When the list is empty, this is NULL */
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_rt_wakeup(TCB* tcb)
+{
+	TimerDuration now = bios_clock_fine();
+	if (now >= tcb->rt_abs_deadline) {
+		tcb->rt_abs_deadline = now + tcb->rt_deadline;
+		tcb->rt_budget = tcb->rt_runtime;
 	}
+}
 
-	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
-
-	next_thread->its = QUANTUM;
+/*
+  Find a core in the affinity of a thread that can admit another
+  'density' of real-time load, trying the thread's last core first.
+  Return -1 if there is none.
 
-	return next_thread;
+  *** MUST BE CALLED WITH rt_admit_spinlock HELD ***
+*/
+static int sched_rt_admit(TCB* tcb, unsigned long density)
+{
+	uint ncores = cpu_cores();
+	for (uint i = 0; i < ncores; i++) {
+		uint c = (tcb->last_core + i) % ncores;
+		if ((tcb->affinity & CORE_BIT(c)) && cctx[c].rt_util + density <= RT_CAPACITY)
+			return c;
+	}
+	return -1;
 }
 
-/*
-  Make the process ready.
- */
-int wakeup(TCB* tcb)
+/* Give back the capacity reserved by a real-time thread, if any */
+static void sched_rt_release(TCB* tcb)
 {
-	int ret = 0;
+	if (!SCHED_IS_RT(tcb))
+		return;
 
-	/* Preemption off */
-	int oldpre = preempt_off;
+	Mutex_Lock(&rt_admit_spinlock);
+	cctx[tcb->rt_core].rt_util -= tcb->rt_density;
+	Mutex_Unlock(&rt_admit_spinlock);
+	tcb->rt_runtime = 0;
+}
 
-	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
 
-	if (tcb->state == STOPPED || tcb->state == INIT) {
-		sched_make_ready(tcb);
-		ret = 1;
-	}
+/*
+  Gang scheduling: the ready threads of a process in gang mode (see
+  SetGang) are dispatched together. When a core dispatches a thread of
+  such a process, it opens a gang slot for the process, which lasts a
+  quantum. While the slot is open, every core prefers the threads of the
+  gang, from its own run queues or stolen from other cores, to the
+  choice of the policy, and the cores that run threads of other
+  processes are preempted if the gang has queued threads. A thread of
+  the gang that becomes ready during the slot is queued on a core that
+  does not run the gang, and preempts it.
+
+  A slot is followed by a quantum in which no slot may open, so that
+  gangs cannot starve the other threads. Real-time threads are not
+  affected by gangs.
+*/
+static Mutex gang_spinlock = MUTEX_INIT; /* protects the gang slot, and before no other lock */
+static PCB* gang_pcb; /* the process of the last gang slot */
+static TimerDuration gang_until; /* the end of the last gang slot, on bios_clock_fine() */
 
-	Mutex_Unlock(&sched_spinlock);
+/* The process whose gang slot is open at time 'now', or NULL; racy */
+static PCB* sched_gang_current(TimerDuration now)
+{
+	PCB* pcb = __atomic_load_n(&gang_pcb, __ATOMIC_RELAXED);
+	return (pcb != NULL && now < __atomic_load_n(&gang_until, __ATOMIC_RELAXED)) ? pcb : NULL;
+}
 
-	/* Restore preemption state */
-	if (oldpre)
-		preempt_on;
+/* True if a thread of the open gang that is ready should preempt thread 'current' */
+static int sched_gang_preempts(TCB* tcb, TCB* current)
+{
+	PCB* gang = sched_gang_current(bios_clock_fine());
+	return gang != NULL && tcb->owner_pcb == gang && current->owner_pcb != gang
+		&& !SCHED_IS_RT(current);
+}
 
-	return ret;
+/* True if the core should switch to a queued thread of the open gang */
+static int sched_gang_pending(CCB* ccb)
+{
+	PCB* gang = sched_gang_current(bios_clock_fine());
+	TCB* current = ccb->current_thread;
+	return gang != NULL && current->owner_pcb != gang && !SCHED_IS_RT(current)
+		&& __atomic_load_n(&gang->queued, __ATOMIC_RELAXED) > 0;
 }
 
 /*
-  Atomically put the current process to sleep, after unlocking mx.
- */
-void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
-	TimerDuration timeout)
+  A core on which a thread of the open gang can run at once: its last
+  core, or else the first core that does not run the gang. Return NULL
+  if the thread is not in the open gang, or no core will do.
+*/
+static CCB* sched_gang_core(TCB* tcb)
 {
-	assert(state == STOPPED || state == EXITED);
+	PCB* gang = sched_gang_current(bios_clock_fine());
+	if (gang == NULL || tcb->owner_pcb != gang || SCHED_IS_RT(tcb))
+		return NULL;
+
+	uint ncores = cpu_cores();
+	for (uint i = 0; i < ncores; i++) {
+		CCB* ccb = &cctx[(tcb->last_core + i) % ncores];
+		TCB* current = ccb->current_thread;
+		if (SCHED_ALLOWED(tcb, ccb) && current->owner_pcb != gang && !SCHED_IS_RT(current)
+				&& (current->type != IDLE_THREAD || ccb == &CURCORE || ccb->id < cpu_physical_cores()))
+			return ccb;
+	}
+	return NULL;
+}
+
+/*
+  Open a gang slot for the process of a thread just dispatched, if it is
+  in gang mode and no slot is open or resting, and preempt the cores
+  that run threads of other processes.
+*/
+static void sched_gang_open(TCB* tcb, TimerDuration now)
+{
+	PCB* pcb = tcb->owner_pcb;
+	if (!pcb->gang || tcb->type == IDLE_THREAD || SCHED_IS_RT(tcb))
+		return;
+
+	Mutex_Lock(&gang_spinlock);
+	int open = (gang_pcb == NULL || now >= gang_until + QUANTUM);
+	if (open) {
+		__atomic_store_n(&gang_pcb, pcb, __ATOMIC_RELAXED);
+		__atomic_store_n(&gang_until, now + QUANTUM, __ATOMIC_RELAXED);
+	}
+	Mutex_Unlock(&gang_spinlock);
 
+	if (!open || __atomic_load_n(&pcb->queued, __ATOMIC_RELAXED) == 0)
+		return;
 
-	int preempt = preempt_off;
-	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+	for (uint c = 0; c < cpu_cores(); c++) {
+		TCB* current = cctx[c].current_thread;
+		if (c != cpu_core_id && current->owner_pcb != pcb && current->type != IDLE_THREAD)
+			cpu_ici(c);
+	}
+}
 
-	/* mark the thread as stopped or exited */
-	tcb->state = state;
 
-	/* register the timeout (if any) for the sleeping thread */
-	if (state != EXITED)
-		sched_register_timeout(tcb, timeout);
+static void sched_balance(TimerDuration now); /* forward */
 
-	/* Release mx */
-	if (mx != NULL)
-		Mutex_Unlock(mx);
+/* Interrupt handler for ALARM */
+void yield_handler()
+{
+	CCB* ccb = &CURCORE;
+	TimerDuration now = bios_clock_fine();
 
-	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
+	/* The timer has expired */
+	ccb->timer_deadline = NO_TIMEOUT;
 
-	/* call this to schedule someone else */
-	yield(cause);
+	if (ccb->id == BALANCE_CORE)
+		sched_balance(now);
 
-	/* Restore preemption state */
-	if (preempt)
-		preempt_on;
+	/* A stale alarm: re-arm for the current deadline, if any */
+	if (now + TIMER_SLACK < ccb->sched_deadline) {
+		if (ccb->sched_deadline != NO_TIMEOUT)
+			sched_arm_timer(ccb, now);
+		return;
+	}
+
+	yield(sched_rt_pending(ccb) ? SCHED_PREEMPT : SCHED_QUANTUM);
 }
 
-/* This function is the entry point to the scheduler's context switching */
+/*
+  Interrupt handle for inter-core interrupts. These are sent to a
+  core when a real-time thread that should preempt its current thread
+  is added to its run queues, when a gang slot opens or a thread of
+  the open gang is queued (see sched_gang_open()), and to a tickless
+  core when a thread is added to its run queues; restart the quantum
+  alarm.
+*/
+void ici_handler()
+{
+	CCB* ccb = &CURCORE;
 
+	if (sched_rt_pending(ccb) || sched_gang_pending(ccb)) {
+		yield(SCHED_PREEMPT);
+		return;
+	}
 
+	TimerDuration deadline = bios_clock_fine() + QUANTUM;
+	if (deadline < ccb->sched_deadline)
+		sched_set_deadline(ccb, deadline);
+}
 
-void yield(enum SCHED_CAUSE cause)
+/*
+  Try to lock a spinlock without spinning. Return 1 on success.
+*/
+static inline int spinlock_trylock(Mutex* lock)
 {
-	//icrease the counter of the yields
-	
-	/* Reset the timer, so that we are not interrupted by ALARM */
-	TimerDuration remaining = bios_cancel_timer();
+	return !__atomic_test_and_set(lock, __ATOMIC_ACQUIRE);
+}
 
-	/* We must stop preemption but save it! */
-	int preempt = preempt_off;
+/*
+  The timer wheel.
+
+  Time, on bios_clock_fine(), is divided into ticks of TW_TICK
+  microseconds. (The coarse bios_clock() may lag by several msec,
+  which would wake threads up early.) The wheel has
+  TW_LEVELS levels of TW_SLOTS slots each; a slot at level l spans
+  TW_SLOTS^l ticks, so the wheel covers TW_SLOTS^TW_LEVELS ticks ahead
+  of tw_now (about 4.6 hours). Later timeouts are parked in the last
+  slot of the top level and re-filed when that slot comes up.
+
+  A thread whose timeout expires at tick T is filed at the lowest level
+  whose range covers T - tw_now, in the slot selected by the bits of T
+  for that level. Filing and cancelling are O(1). As tw_now advances,
+  each time it crosses a slot boundary of level l>0, the entries of the
+  slot of level l are re-filed at lower levels (cascaded). The entries
+  of a level-0 slot have all expired when tw_now reaches it; they are
+  moved to TW_EXPIRED, from where they are woken up.
+
+  tw_mask[l] has bit i set if slot i of level l may be non-empty; it is
+  used to skip over empty stretches of the wheel. tw_count is the
+  exact number of threads in the wheel (including TW_EXPIRED).
+*/
+#define TW_TICK 1000
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_LEVELS 4
 
-	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
+static rlnode TW[TW_LEVELS][TW_SLOTS]; /* The wheel slots */
+static rlnode TW_EXPIRED; /* Expired threads, to be woken up */
+static uint64_t tw_mask[TW_LEVELS]; /* Possibly non-empty slots per level */
+static TimerDuration tw_now; /* The last tick processed */
+static unsigned int tw_count; /* The number of threads in the wheel */
 
-	Mutex_Lock(&sched_spinlock);
-	yieldCounter ++;
-	//adjust the priority according to the SCHED_CAUSE
-	switch(cause) {
+/* The tick at which a wakeup time expires (rounded up) */
+static inline TimerDuration tw_tick(TimerDuration t) { return (t + TW_TICK - 1) / TW_TICK; }
 
-		case SCHED_QUANTUM: //if the quantum has ended priority has to be decreased
-			if(current->priority != 0){
-				current->priority --;
-			}
-			break;
-		case SCHED_IO:	//If the thread is waiting for I/O priority has to be increased
-			if(current->priority != PRIORITY_QUEUES-1){
-				current->priority ++;
-			}
-			break;
-		case SCHED_MUTEX:  //if Mutex_Lock yielded on contention priority has to be decreased
-			if(current->curr_cause == current->last_cause && current->priority != 0)  {
-				current->priority --;
-			}
-			break;
-		default:	//By default a TCB gets places in the middle queue
-			current->priority = PRIORITY_QUEUES/2;
-			break;
-	}
-	//Boost
-	if(yieldCounter == N) {
-		yieldCounter = 0;  //reset counter
-		// increase the priority of all possible TCBs and insert them at the back of the above priority queue
-		rlnode* currTcb;
-		for(int i=PRIORITY_QUEUES-2; i >= 0; i--) {
-			while(!is_rlist_empty(&SCHED[i])) {
-				currTcb = rlist_pop_front(&SCHED[i]);
-				rlist_push_back(&SCHED[i+1],currTcb);
-				currTcb->tcb->priority++;
-			}
-		}
-	}
+/*
+  File a TCB into the wheel, according to its wakeup time.
 
-	/* Update CURTHREAD state */
-	if (current->state == RUNNING)
-		current->state = READY;
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void tw_file(TCB* tcb)
+{
+	TimerDuration expires = tw_tick(tcb->wakeup_time);
 
-	/* Update CURTHREAD scheduler data */
-	current->rts = remaining;
-	current->last_cause = current->curr_cause;
-	current->curr_cause = cause;
+	if (expires <= tw_now) {
+		rlist_push_back(&TW_EXPIRED, &tcb->sched_node);
+		return;
+	}
 
-	/* Wake up threads whose sleep timeout has expired */
-	sched_wakeup_expired_timeouts();
+	/* Clamp timeouts beyond the range of the wheel */
+	TimerDuration delta = expires - tw_now;
+	if (delta >= ((TimerDuration)1 << (TW_BITS * TW_LEVELS)))
+		expires = tw_now + ((TimerDuration)1 << (TW_BITS * TW_LEVELS)) - 1;
 
-	/* Get next */
-	TCB* next = sched_queue_select(current);
-	assert(next != NULL);
+	int level = 0;
+	while (level < TW_LEVELS - 1 && delta >= ((TimerDuration)1 << (TW_BITS * (level + 1))))
+		level++;
 
-	/* Save the current TCB for the gain phase */
-	CURCORE.previous_thread = current;
+	int slot = (expires >> (TW_BITS * level)) & (TW_SLOTS - 1);
+	rlist_push_back(&TW[level][slot], &tcb->sched_node);
+	tw_mask[level] |= ((uint64_t)1) << slot;
+}
 
-	Mutex_Unlock(&sched_spinlock);
+/*
+  Remove all entries of a wheel slot, and return them in list.
 
-	/* Switch contexts */
-	if (current != next) {
-		CURTHREAD = next;
-		cpu_swap_context(&current->context, &next->context);
-	}
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void tw_take_slot(int level, int slot, rlnode* list)
+{
+	rlist_append(list, &TW[level][slot]);
+	tw_mask[level] &= ~(((uint64_t)1) << slot);
+}
 
-	/* This is where we get after we are switched back on! A long time
-	   may have passed. Start a new timeslice...
-	  */
-	gain(preempt);
+/* Return 1 if no wheel slot may hold a thread */
+static inline int tw_is_empty()
+{
+	uint64_t mask = 0;
+	for (int l = 0; l < TW_LEVELS; l++)
+		mask |= tw_mask[l];
+	return mask == 0;
 }
 
 /*
-  This function must be called at the beginning of each new timeslice.
-  This is done mostly from inside yield().
-  However, for threads that are executed for the first time, this
-  has to happen in thread_start.
+  Advance the wheel up to tick now, moving expired threads to TW_EXPIRED.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void tw_advance(TimerDuration now)
+{
+	while (tw_now < now) {
+		/* Nothing left in the wheel: just jump ahead */
+		if (tw_is_empty()) {
+			tw_now = now;
+			break;
+		}
+
+		/* If level 0 is empty, skip to the next boundary of level 1 */
+		TimerDuration next = tw_now + 1;
+		if (tw_mask[0] == 0) {
+			next = (tw_now | (TW_SLOTS - 1)) + 1;
+			if (next > now) next = now;
+		}
+		tw_now = next;
+
+		/* Find the highest level whose slot boundary we just crossed */
+		int top = 0;
+		while (top < TW_LEVELS - 1 && (tw_now & ((((TimerDuration)1) << (TW_BITS * (top + 1))) - 1)) == 0)
+			top++;
+
+		/* Cascade the current slots of the upper levels, from the top down */
+		for (int level = top; level > 0; level--) {
+			rlnode cascade;
+			rlnode_init(&cascade, NULL);
+			tw_take_slot(level, (tw_now >> (TW_BITS * level)) & (TW_SLOTS - 1), &cascade);
+			while (!is_rlist_empty(&cascade))
+				tw_file(rlist_pop_front(&cascade)->tcb);
+		}
+
+		/* Everything in the current level-0 slot has expired */
+		tw_take_slot(0, tw_now & (TW_SLOTS - 1), &TW_EXPIRED);
+	}
+}
+
+/*
+  Return the earliest tick at which the wheel may need service (because a
+  timeout expires, or a slot must be cascaded), or NO_TIMEOUT if the wheel
+  is empty.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static TimerDuration tw_next_tick()
+{
+	if (!is_rlist_empty(&TW_EXPIRED))
+		return tw_now;
+
+	TimerDuration next = NO_TIMEOUT;
+	for (int level = 0; level < TW_LEVELS; level++) {
+		if (tw_mask[level] == 0)
+			continue;
+
+		/* Rotate the mask so that bit 0 is the slot after the current one */
+		TimerDuration base = tw_now >> (TW_BITS * level);
+		int r = (base + 1) & (TW_SLOTS - 1);
+		uint64_t rot = r ? (tw_mask[level] >> r) | (tw_mask[level] << (TW_SLOTS - r)) : tw_mask[level];
+
+		TimerDuration tick = (base + 1 + __builtin_ctzll(rot)) << (TW_BITS * level);
+		if (tick < next)
+			next = tick;
+	}
+	return next;
+}
+
+/*
+  Possibly add TCB to the scheduler timer wheel.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
+{
+	if (timeout != NO_TIMEOUT) {
+		Mutex_Lock(&timeout_spinlock);
+
+		/* set the wakeup time */
+		TimerDuration curtime = bios_clock_fine();
+		tcb->wakeup_time = curtime + timeout;
+
+		tw_file(tcb);
+		tw_count++;
+
+		Mutex_Unlock(&timeout_spinlock);
+	}
+}
+
+/*
+  Remove TCB from the scheduler timer wheel.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock AND timeout_spinlock HELD ***
+*/
+static void sched_cancel_timeout(TCB* tcb)
+{
+	/* tcb is in the timer wheel, fix it */
+	assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
+	rlist_remove(&tcb->sched_node);
+	tcb->wakeup_time = NO_TIMEOUT;
+	tw_count--;
+}
+
+/*
+  Scheduling policies.
+
+  A policy (see sched_policy_t) orders the ready threads of each core,
+  apart from real-time threads. It owns the SCHED[] lists and the
+  ready_mask of each CCB, and the policy fields of each TCB (priority,
+  vruntime). Everything else (nr_ready, placement, real-time threads,
+  handoff, tickless operation) is common to all policies.
+
+  The policy is chosen before boot, by set_sched_policy().
+*/
+
+/*
+  Remove the first thread in a list that may run on core 'thief' (and
+  belongs to process 'only', unless NULL), and return it, or NULL.
+*/
+static TCB* sched_list_steal(rlnode* q, CCB* thief, PCB* only)
+{
+	for (rlnode* n = q->next; n != q; n = n->next) {
+		if (SCHED_ALLOWED(n->tcb, thief) && (only == NULL || n->tcb->owner_pcb == only)) {
+			rlist_remove(n);
+			return n->tcb;
+		}
+	}
+	return NULL;
+}
+
+
+/*
+  MLFQ: a multi-level feedback queue with PRIORITY_QUEUES levels, one
+  list per level. The highest non-empty level is found in constant time
+  from the core's ready_mask. The priority of a thread changes according
+  to the cause of each yield(). A thread that waits in the run queues
+  ages: it moves up a level for every sched_aging_period it waits, so
+  that low-priority threads do not starve.
+
+  tcb->aging_time is the time since which a queued thread waits at its
+  level. Threads are queued in order of aging_time, except those that
+  have aged into a level, which go to its end.
+
+  Each level has its own time slice, in mlfq_quanta[], shortest at the
+  top and longest at the bottom, where the CPU-bound threads end up. A
+  thread queued at a higher level than the running thread cuts the
+  slice of the latter to at most a QUANTUM (see sched_queue_insert()).
+*/
+
+/* The MLFQ aging period, see set_sched_aging() */
+static TimerDuration sched_aging_period = MLFQ_AGING_PERIOD;
+
+int set_sched_aging(timeout_t period)
+{
+	if (period == 0)
+		return -1;
+	sched_aging_period = period * 1000ul;
+	return 0;
+}
+
+/* The time slice of each level, see set_sched_quanta() */
+static TimerDuration mlfq_quanta[PRIORITY_QUEUES];
+
+static void mlfq_fill_quanta(TimerDuration top, TimerDuration bottom)
+{
+	for (int level = 0; level < PRIORITY_QUEUES; level++)
+		mlfq_quanta[level] = ((long long)bottom * (PRIORITY_QUEUES-1 - level) + (long long)top * level)
+			/ (PRIORITY_QUEUES-1);
+}
+
+int set_sched_quanta(timeout_t top, timeout_t bottom)
+{
+	if (top == 0 || bottom == 0)
+		return -1;
+	mlfq_fill_quanta(top * 1000ul, bottom * 1000ul);
+	return 0;
+}
+
+static void mlfq_enqueue(CCB* ccb, TCB* tcb)
+{
+	/* Insert at the end of the equivalent scheduling list according to the priority of the tcb*/
+	tcb->aging_time = bios_clock_fine();
+	rlist_push_back(&ccb->SCHED[tcb->priority], &tcb->sched_node);
+	ccb->ready_mask |= PRIO_BIT(tcb->priority);
+}
+
+/*
+  The priority of a queued thread may be stale (see mlfq_on_tick()),
+  so it is set here from the level the thread was found in.
+*/
+static TCB* mlfq_pick_next(CCB* ccb)
+{
+	if (ccb->ready_mask == 0)
+		return NULL;
+
+	int level = 63 - __builtin_clzll(ccb->ready_mask);
+	TCB* tcb = rlist_pop_front(&ccb->SCHED[level])->tcb;
+	if (is_rlist_empty(&ccb->SCHED[level]))
+		ccb->ready_mask &= ~PRIO_BIT(level);
+
+	tcb->priority = level;
+	return tcb;
+}
+
+/* Unlike mlfq_pick_next(), this has to scan the queues */
+static TCB* mlfq_steal(CCB* ccb, CCB* thief, PCB* only)
+{
+	uint64_t mask = ccb->ready_mask;
+	while (mask != 0) {
+		int level = 63 - __builtin_clzll(mask);
+		TCB* tcb = sched_list_steal(&ccb->SCHED[level], thief, only);
+		if (tcb != NULL) {
+			if (is_rlist_empty(&ccb->SCHED[level]))
+				ccb->ready_mask &= ~PRIO_BIT(level);
+			tcb->priority = level;
+			return tcb;
+		}
+		mask &= ~PRIO_BIT(level);
+	}
+	return NULL;
+}
+
+static TimerDuration mlfq_slice(TCB* tcb)
+{
+	return mlfq_quanta[tcb->priority];
+}
+
+static int mlfq_outranks(TCB* tcb, TCB* current)
+{
+	return current->type != IDLE_THREAD && tcb->priority > current->priority;
+}
+
+static void mlfq_on_yield(CCB* ccb, TCB* current, enum SCHED_CAUSE cause, TimerDuration used)
+{
+	//adjust the priority according to the SCHED_CAUSE
+	switch(cause) {
+
+		case SCHED_QUANTUM: //if the quantum has ended priority has to be decreased
+			if(current->priority != 0){
+				current->priority --;
+			}
+			break;
+		case SCHED_IO:	//If the thread is waiting for I/O priority has to be increased
+			if(current->priority != PRIORITY_QUEUES-1){
+				current->priority ++;
+			}
+			break;
+		case SCHED_MUTEX:  //if Mutex_Lock yielded on contention priority has to be decreased
+			if(current->curr_cause == current->last_cause && current->priority != 0)  {
+				current->priority --;
+			}
+			break;
+		case SCHED_PREEMPT:	//a preempted thread keeps its priority
+			break;
+		default:	//By default a TCB gets places in the middle queue
+			current->priority = PRIORITY_QUEUES/2;
+			break;
+	}
+}
+
+/*
+  Age the threads in the run queues of a core, once every aging period.
+
+  Only the heads of the non-empty levels are examined: a thread that has
+  waited a period at its level moves to the end of the level above. The
+  levels are visited from the top down, so a thread moves up at most one
+  level per pass. The priority field of the moved threads is not
+  touched; it is corrected when the thread is popped (see
+  mlfq_pick_next()).
+
+  The period is that of a level whose time slice is a QUANTUM, and
+  scales with the slice of each level; otherwise CPU-bound threads that
+  wait for each other's long slices at the bottom would age up again.
+*/
+static void mlfq_on_tick(CCB* ccb, TimerDuration now)
+{
+	if (now < ccb->next_aging)
+		return;
+	TimerDuration period = sched_aging_period;
+	ccb->next_aging = now + period;
+
+	Mutex_Lock(&ccb->sched_spinlock);
+	uint64_t mask = ccb->ready_mask & ~PRIO_BIT(PRIORITY_QUEUES-1);
+	while (mask != 0) {
+		int level = 63 - __builtin_clzll(mask);
+		mask &= ~PRIO_BIT(level);
+
+		rlnode* q = &ccb->SCHED[level];
+		TimerDuration wait = period * mlfq_quanta[level] / QUANTUM;
+		while (!is_rlist_empty(q) && q->next->tcb->aging_time + wait <= now) {
+			TCB* tcb = rlist_pop_front(q)->tcb;
+			tcb->aging_time += wait;
+			rlist_push_back(&ccb->SCHED[level+1], &tcb->sched_node);
+			ccb->ready_mask |= PRIO_BIT(level+1);
+		}
+		if (is_rlist_empty(q))
+			ccb->ready_mask &= ~PRIO_BIT(level);
+	}
+	Mutex_Unlock(&ccb->sched_spinlock);
+}
+
+static const sched_policy_t mlfq_policy = {
+	.name = "mlfq",
+	.enqueue = mlfq_enqueue,
+	.pick_next = mlfq_pick_next,
+	.steal = mlfq_steal,
+	.on_yield = mlfq_on_yield,
+	.on_tick = mlfq_on_tick,
+	.on_wakeup = NULL,
+	.slice = mlfq_slice,
+	.outranks = mlfq_outranks,
+	.keep = NULL
+};
+
+
+/*
+  Round-robin: a single FIFO list per core, SCHED[0]. Every thread gets
+  a full quantum in turn, whatever the cause of its yields.
+*/
+
+static void rr_enqueue(CCB* ccb, TCB* tcb)
+{
+	rlist_push_back(&ccb->SCHED[0], &tcb->sched_node);
+}
+
+static TCB* rr_pick_next(CCB* ccb)
+{
+	if (is_rlist_empty(&ccb->SCHED[0]))
+		return NULL;
+	return rlist_pop_front(&ccb->SCHED[0])->tcb;
+}
+
+static TCB* rr_steal(CCB* ccb, CCB* thief, PCB* only)
+{
+	return sched_list_steal(&ccb->SCHED[0], thief, only);
+}
+
+static const sched_policy_t rr_policy = {
+	.name = "rr",
+	.enqueue = rr_enqueue,
+	.pick_next = rr_pick_next,
+	.steal = rr_steal,
+	.on_yield = NULL,
+	.on_tick = NULL,
+	.on_wakeup = NULL,
+	.slice = NULL,
+	.outranks = NULL,
+	.keep = NULL
+};
+
+
+/*
+  Fair: every thread accumulates the CPU time it uses in its vruntime,
+  and the thread with the least vruntime runs next. SCHED[0] holds the
+  ready threads of a core in vruntime order.
+
+  Each core keeps a min_vruntime, which follows the least vruntime of
+  its threads (the running one included) and never decreases. A thread
+  that wakes up gets at most FAIR_SLEEPER_CREDIT of vruntime below it,
+  so that it cannot bank the time it slept. A thread that moves to
+  another core keeps its lag behind the min_vruntime of its old core.
+
+  The CPU time of a thread is charged in proportion to the runnable
+  threads of its process, and in inverse proportion to the weight of
+  the process (see SetWeight). Thus, a process gets the same share of
+  a core with one thread as with many, and the threads of a process
+  split its share.
+*/
+
+#define FAIR_SLEEPER_CREDIT (QUANTUM/2)
+
+/* Place a thread of core 'from' in the virtual time of core 'to' */
+static void fair_place(TCB* tcb, CCB* from, CCB* to)
+{
+	long long lag = (long long)(tcb->vruntime - from->min_vruntime);
+	if (lag < -FAIR_SLEEPER_CREDIT)
+		lag = -FAIR_SLEEPER_CREDIT;
+	long long vruntime = (long long)to->min_vruntime + lag;
+	tcb->vruntime = (vruntime > 0) ? vruntime : 0;
+}
+
+/* The vruntime charged to a thread for 'used' CPU time */
+static TimerDuration fair_charge(TCB* tcb, TimerDuration used)
+{
+	PCB* pcb = tcb->owner_pcb;
+	unsigned int runnable = __atomic_load_n(&pcb->runnable, __ATOMIC_RELAXED);
+	unsigned int weight = __atomic_load_n(&pcb->weight, __ATOMIC_RELAXED);
+
+	/* A thread that just stopped is no longer counted */
+	if (runnable == 0)
+		runnable = 1;
+	return used * runnable * DEFAULT_WEIGHT / weight;
+}
+
+/*
+  Insert after the threads with the same vruntime. A thread that goes
+  behind all the queued threads, as after a SCHED_MUTEX yield, is
+  appended without walking the queue.
+*/
+static void fair_enqueue(CCB* ccb, TCB* tcb)
+{
+	if (tcb->last_core != ccb->id)
+		fair_place(tcb, &cctx[tcb->last_core], ccb);
+
+	rlnode* q = &ccb->SCHED[0];
+	rlnode* n = (!is_rlist_empty(q) && q->prev->tcb->vruntime <= tcb->vruntime) ? q : q->next;
+	while (n != q && n->tcb->vruntime <= tcb->vruntime)
+		n = n->next;
+	rl_splice(n->prev, &tcb->sched_node);
+}
+
+static TCB* fair_steal(CCB* ccb, CCB* thief, PCB* only)
+{
+	TCB* tcb = sched_list_steal(&ccb->SCHED[0], thief, only);
+	if (tcb != NULL)
+		fair_place(tcb, ccb, thief);
+	return tcb;
+}
+
+/*
+  A thread that yields while spinning on a Mutex has used little CPU
+  time, and would run again at once, ahead of the lock holder; it goes
+  behind all the ready threads of the core instead.
+*/
+static void fair_on_yield(CCB* ccb, TCB* current, enum SCHED_CAUSE cause, TimerDuration used)
+{
+	current->vruntime += fair_charge(current, used);
+
+	Mutex_Lock(&ccb->sched_spinlock);
+	rlnode* q = &ccb->SCHED[0];
+	if (cause == SCHED_MUTEX && !is_rlist_empty(q) && q->prev->tcb->vruntime > current->vruntime)
+		current->vruntime = q->prev->tcb->vruntime;
+
+	TimerDuration least = current->vruntime;
+	if (!is_rlist_empty(q) && q->next->tcb->vruntime < least)
+		least = q->next->tcb->vruntime;
+	if (least > ccb->min_vruntime)
+		ccb->min_vruntime = least;
+	Mutex_Unlock(&ccb->sched_spinlock);
+}
+
+static void fair_on_wakeup(TCB* tcb)
+{
+	fair_place(tcb, &cctx[tcb->last_core], &cctx[tcb->last_core]);
+}
+
+/* The yielding thread goes on while it is behind all the queued threads */
+static int fair_keep(CCB* ccb, TCB* current)
+{
+	rlnode* q = &ccb->SCHED[0];
+	return !is_rlist_empty(q) && current->vruntime < q->next->tcb->vruntime;
+}
+
+static const sched_policy_t fair_policy = {
+	.name = "fair",
+	.enqueue = fair_enqueue,
+	.pick_next = rr_pick_next,
+	.steal = fair_steal,
+	.on_yield = fair_on_yield,
+	.on_tick = NULL,
+	.on_wakeup = fair_on_wakeup,
+	.slice = NULL,
+	.outranks = NULL,
+	.keep = fair_keep
+};
+
+
+static const sched_policy_t* sched_policies[] = { &mlfq_policy, &rr_policy, &fair_policy, NULL };
+
+/* The policy in force; it must not change while the kernel runs */
+static const sched_policy_t* sched_policy = &mlfq_policy;
+
+int set_sched_policy(const char* name)
+{
+	for (const sched_policy_t** p = sched_policies; *p != NULL; p++) {
+		if (strcmp((*p)->name, name) == 0) {
+			sched_policy = *p;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+  A racy check that a core has nothing to do: it runs its idle thread
+  (possibly halted) and has no ready threads.
+*/
+static inline int sched_core_is_idle(CCB* ccb)
+{
+	return ccb->current_thread->type == IDLE_THREAD && ccb->nr_ready == 0;
+}
+
+/*
+  A halted core is only worth waking if the BIOS would restart it for
+  cpu_core_restart_one() (see cpu_physical_cores()); otherwise, placing
+  threads on it would oversubscribe the host.
+*/
+static inline int sched_core_is_restartable(CCB* ccb)
+{
+	return ccb == &CURCORE || ccb->id < cpu_physical_cores();
+}
+
+/*
+  Choose the core on whose run queues a ready thread is added.
+
+  A real-time thread goes to the core it is admitted on. Otherwise,
+  only the cores in the thread's affinity are considered. Among them,
+  the thread's last core is preferred, since its caches are likely to
+  hold the thread's working set. If that core is busy, the current core
+  (if it is idle, e.g., when it wakes up expired timeouts) or else any
+  idle core is chosen, so that the thread does not wait while another
+  core sits idle. If all cores are busy, the thread waits at its last
+  core, unless that core is idle but not restartable.
+*/
+static CCB* sched_select_core(TCB* tcb)
+{
+	if (SCHED_IS_RT(tcb))
+		return &cctx[tcb->rt_core];
+
+	/* During its gang slot, a thread goes where it can run at once */
+	CCB* gang_core = sched_gang_core(tcb);
+	if (gang_core != NULL)
+		return gang_core;
+
+	CCB* preferred = &cctx[tcb->last_core];
+	if (! SCHED_ALLOWED(tcb, preferred))
+		preferred = &cctx[__builtin_ctz(tcb->affinity)];
+	if (sched_core_is_idle(preferred) && sched_core_is_restartable(preferred))
+		return preferred;
+
+	if (SCHED_ALLOWED(tcb, &CURCORE) && sched_core_is_idle(&CURCORE))
+		return &CURCORE;
+
+	uint ncores = cpu_cores();
+	for (uint i = 1; i < ncores; i++) {
+		CCB* ccb = &cctx[(preferred->id + i) % ncores];
+		if (SCHED_ALLOWED(tcb, ccb) && sched_core_is_idle(ccb) && sched_core_is_restartable(ccb))
+			return ccb;
+	}
+
+	if (SCHED_ALLOWED(tcb, &CURCORE) && sched_core_is_idle(preferred))
+		return &CURCORE;
+	return preferred;
+}
+
+/*
+  Add TCB to the run queues of a core, and restart that core if it is
+  halted.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_queue_insert(CCB* ccb, TCB* tcb)
+{
+	Mutex_Lock(&ccb->sched_spinlock);
+
+	/* Insert into the EDF queue, or as the policy says */
+	if (SCHED_IS_RT(tcb))
+		sched_rt_insert(ccb, tcb);
+	else
+		sched_policy->enqueue(ccb, tcb);
+	tcb->queue_core = ccb->id;
+	ccb->nr_ready++;
+	tcb->load_weight = __atomic_load_n(&tcb->owner_pcb->weight, __ATOMIC_RELAXED);
+	ccb->load += tcb->load_weight;
+	__atomic_fetch_add(&tcb->owner_pcb->queued, 1, __ATOMIC_RELAXED);
+
+	/*
+	  A real-time thread preempts any thread with a later deadline, and a
+	  thread of the open gang any thread of another process.
+	 */
+	int preempt = SCHED_IS_RT(tcb) ? sched_rt_earlier(tcb, ccb->current_thread)
+		: sched_gang_preempts(tcb, ccb->current_thread);
+
+	/* A thread that the policy ranks above the current one cuts a long slice short */
+	TCB* current = ccb->current_thread;
+	int cut = !preempt && !SCHED_IS_RT(tcb) && !SCHED_IS_RT(current) && sched_policy->outranks != NULL
+		&& ccb->sched_deadline > bios_clock_fine() + QUANTUM && sched_policy->outranks(tcb, current);
+
+	/* The core now has something to preempt for */
+	int was_tickless = ccb->tickless;
+	ccb->tickless = 0;
+
+	Mutex_Unlock(&ccb->sched_spinlock);
+
+	if (preempt) {
+		if (ccb == &CURCORE)
+			sched_set_deadline(ccb, bios_clock_fine());
+		else
+			cpu_ici(ccb->id);
+	}
+	else if (cut) {
+		if (ccb == &CURCORE)
+			sched_set_deadline(ccb, bios_clock_fine() + QUANTUM);
+		else
+			cpu_ici(ccb->id);
+	}
+#ifdef SCHED_TICKLESS
+	else if (was_tickless) {
+		if (ccb == &CURCORE)
+			sched_set_deadline(ccb, bios_clock_fine() + QUANTUM);
+		else
+			cpu_ici(ccb->id);
+	}
+#endif
+
+	/* Restart the core, if halted */
+	if (ccb != &CURCORE)
+		cpu_core_restart(ccb->id);
+}
+
+/*
+  Take a thread out of the run queues of its core. Return 0 if it was
+  not queued, e.g. because a core has just picked it to run.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static int sched_queue_remove(TCB* tcb)
+{
+	int core = __atomic_load_n(&tcb->queue_core, __ATOMIC_RELAXED);
+	if (core < 0)
+		return 0;
+
+	CCB* ccb = &cctx[core];
+	Mutex_Lock(&ccb->sched_spinlock);
+	int queued = (tcb->queue_core == core);
+	if (queued) {
+		rlist_remove(&tcb->sched_node);
+		tcb->queue_core = -1;
+
+		/* The MLFQ level of the thread may be stale (see mlfq_on_tick()) */
+		uint64_t mask = ccb->ready_mask;
+		while (mask != 0) {
+			int level = 63 - __builtin_clzll(mask);
+			if (is_rlist_empty(&ccb->SCHED[level]))
+				ccb->ready_mask &= ~PRIO_BIT(level);
+			mask &= ~PRIO_BIT(level);
+		}
+
+		ccb->nr_ready--;
+		ccb->load -= tcb->load_weight;
+		__atomic_fetch_sub(&tcb->owner_pcb->queued, 1, __ATOMIC_RELAXED);
+	}
+	Mutex_Unlock(&ccb->sched_spinlock);
+	return queued;
+}
+
+/*
+  Add TCB to the end of the scheduler list of the core chosen by
+  sched_select_core().
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_queue_add(TCB* tcb)
+{
+	sched_queue_insert(sched_select_core(tcb), tcb);
+}
+
+/*
+	Adjust the state of a thread to make it READY, without adding it
+	to the run queues.
+
+	*** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+ */
+static void sched_mark_ready(TCB* tcb)
+{
+	assert(tcb->state == STOPPED || tcb->state == INIT);
+
+	/* Possibly remove from the timer wheel */
+	if (tcb->wakeup_time != NO_TIMEOUT) {
+		Mutex_Lock(&timeout_spinlock);
+		sched_cancel_timeout(tcb);
+		Mutex_Unlock(&timeout_spinlock);
+	}
+
+	if (SCHED_IS_RT(tcb))
+		sched_rt_wakeup(tcb);
+	else if (sched_policy->on_wakeup != NULL)
+		sched_policy->on_wakeup(tcb);
+
+	/* Mark as ready */
+	tcb->state = READY;
+	__atomic_fetch_add(&tcb->owner_pcb->runnable, 1, __ATOMIC_RELAXED);
+}
+
+/*
+	Adjust the state of a thread to make it READY.
+
+	*** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+ */
+static void sched_make_ready(TCB* tcb)
+{
+	sched_mark_ready(tcb);
+
+	/* Possibly add to the scheduler queue */
+	if (tcb->phase == CTX_CLEAN)
+		sched_queue_add(tcb);
+}
+
+/*
+  Advance the timer wheel to the current time, and wake up the threads
+  whose timeout has expired.
+
+  Since the locking order is reversed here, threads whose state_spinlock
+  is busy are skipped; they stay in TW_EXPIRED and will be woken up by
+  a subsequent call (or by whoever holds their lock).
+*/
+static void sched_wakeup_expired_timeouts()
+{
+	/* Avoid the lock in the common case */
+	if (tw_count == 0)
+		return;
+
+	TimerDuration now = bios_clock_fine() / TW_TICK;
+
+	Mutex_Lock(&timeout_spinlock);
+	tw_advance(now);
+
+	rlnode* n = TW_EXPIRED.next;
+	while (n != &TW_EXPIRED) {
+		TCB* tcb = n->tcb;
+		n = n->next;
+
+		if (spinlock_trylock(&tcb->state_spinlock)) {
+			sched_cancel_timeout(tcb);
+			sched_make_ready(tcb);
+			Mutex_Unlock(&tcb->state_spinlock);
+		}
+	}
+	Mutex_Unlock(&timeout_spinlock);
+}
+
+/*
+  Remove the next thread from the run queues of a core, as chosen by
+  the policy, and return it. Return NULL if the queues are empty.
+
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
+*/
+static TCB* sched_queue_pop(CCB* ccb)
+{
+	TCB* tcb = sched_policy->pick_next(ccb);
+	if (tcb != NULL) {
+		tcb->queue_core = -1;
+		ccb->nr_ready--;
+		ccb->load -= tcb->load_weight;
+		__atomic_fetch_sub(&tcb->owner_pcb->queued, 1, __ATOMIC_RELAXED);
+	}
+	return tcb;
+}
+
+/*
+  Remove the next thread that may run on core 'thief' (and belongs to
+  process 'only', unless NULL) from the run queues of a core, as chosen
+  by the policy, and return it. Return NULL if there is none.
+
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
+*/
+static TCB* sched_queue_pop_allowed(CCB* ccb, CCB* thief, PCB* only)
+{
+	TCB* tcb = sched_policy->steal(ccb, thief, only);
+	if (tcb != NULL) {
+		tcb->queue_core = -1;
+		ccb->nr_ready--;
+		ccb->load -= tcb->load_weight;
+		__atomic_fetch_sub(&tcb->owner_pcb->queued, 1, __ATOMIC_RELAXED);
+	}
+	return tcb;
+}
+
+/*
+  Steal a ready thread (of process 'only', unless NULL) from the run
+  queues of some other core. Return NULL if no other core has a ready
+  thread that may run here.
+*/
+static TCB* sched_queue_steal(CCB* thief, PCB* only)
+{
+	uint ncores = cpu_cores();
+
+	for (uint i = 1; i < ncores; i++) {
+		CCB* victim = &cctx[(thief->id + i) % ncores];
+
+		/* A racy peek, to avoid locking idle cores */
+		if (victim->nr_ready == 0)
+			continue;
+
+		Mutex_Lock(&victim->sched_spinlock);
+		TCB* tcb = sched_queue_pop_allowed(victim, thief, only);
+		Mutex_Unlock(&victim->sched_spinlock);
+
+		if (tcb != NULL)
+			return tcb;
+	}
+	return NULL;
+}
+
+/*
+  The load balancer, see BALANCE_PERIOD.
+
+  The loads are read without locks; a stale reading only makes a pass
+  move too few or too many threads, and the next pass corrects it.
+  Threads only move to cores that run or can be restarted, and in
+  their affinity. A moved thread counts as a migration of the thread,
+  and its last_core becomes the target, so that it is not placed back
+  on its old core when it next wakes up.
+*/
+static TimerDuration balance_next; /* When the balancer next runs */
+static CCB* balance_from; /* The pair found out of balance by the last pass, if any */
+static CCB* balance_to;
+
+static inline unsigned long sched_core_load(CCB* ccb)
+{
+	return ccb->load + ccb->current_load;
+}
+
+/* When the balancer must next run, or NO_TIMEOUT if no core has threads to spare */
+static TimerDuration sched_balance_deadline()
+{
+	for (uint c = 0; c < cpu_cores(); c++)
+		if (cctx[c].nr_ready >= 2)
+			return balance_next;
+	return NO_TIMEOUT;
+}
+
+static void sched_balance(TimerDuration now)
+{
+	if (now < balance_next)
+		return;
+	balance_next = now + BALANCE_PERIOD;
+
+	CCB *busiest = NULL, *idlest = NULL;
+	unsigned long busy_load = 0, idle_load = 0;
+	for (uint c = 0; c < cpu_cores(); c++) {
+		CCB* ccb = &cctx[c];
+		unsigned long load = sched_core_load(ccb);
+		if (busiest == NULL || load > busy_load) {
+			busiest = ccb;
+			busy_load = load;
+		}
+		int awake = (ccb->current_thread->type != IDLE_THREAD || sched_core_is_restartable(ccb));
+		if (awake && (idlest == NULL || load < idle_load)) {
+			idlest = ccb;
+			idle_load = load;
+		}
+	}
+
+	/* Out of balance by at least two average ready threads? */
+	unsigned int nr = busiest->nr_ready;
+	int unbalanced = (idlest != NULL && idlest != busiest && nr >= 2
+		&& busy_load >= idle_load + 2 * (busiest->load / nr));
+
+	/* ... and for two passes in a row? */
+	if (!unbalanced || busiest != balance_from || idlest != balance_to) {
+		balance_from = unbalanced ? busiest : NULL;
+		balance_to = unbalanced ? idlest : NULL;
+		return;
+	}
+	balance_from = balance_to = NULL;
+
+	for (int moved = 0; moved < BALANCE_BATCH; moved++) {
+		TCB* tcb = NULL;
+		Mutex_Lock(&busiest->sched_spinlock);
+		nr = busiest->nr_ready;
+		if (nr >= 2 && busy_load >= idle_load + 2 * (busiest->load / nr))
+			tcb = sched_queue_pop_allowed(busiest, idlest, NULL);
+		Mutex_Unlock(&busiest->sched_spinlock);
+		if (tcb == NULL)
+			break;
+
+		busy_load -= tcb->load_weight;
+		idle_load += tcb->load_weight;
+
+		/* It may have become real-time, or changed its affinity, in the meantime */
+		Mutex_Lock(&tcb->state_spinlock);
+		if (SCHED_ALLOWED(tcb, idlest)) {
+			tcb->last_core = idlest->id;
+			tcb->migrations++;
+			__atomic_fetch_add(&tcb->owner_pcb->migrations, 1, __ATOMIC_RELAXED);
+			sched_queue_insert(idlest, tcb);
+			idlest->balanced_in++;
+		} else
+			sched_queue_add(tcb);
+		Mutex_Unlock(&tcb->state_spinlock);
+	}
+}
+
+/*
+  Start a new period of a CPU group, if the current one has ended. A
+  group that overran its quota carries the excess into the next period.
+
+  *** MUST BE CALLED WITH grp->spinlock HELD ***
+ */
+static void sched_group_refill(cpu_group_t* grp, TimerDuration now)
+{
+	if (now < grp->period_start + grp->period)
+		return;
+
+	TimerDuration periods = (now - grp->period_start) / grp->period;
+	grp->period_start += periods * grp->period;
+	grp->runtime = (periods == 1 && grp->runtime > grp->quota) ? grp->runtime - grp->quota : 0;
+	grp->throttled = 0;
+}
+
+/*
+  Charge CPU time to the group of a thread. If the group has used up
+  its quota, return when its next period starts, else NO_TIMEOUT.
+ */
+static TimerDuration sched_group_charge(TCB* tcb, TimerDuration used, TimerDuration now)
+{
+	cpu_group_t* grp = __atomic_load_n(&tcb->owner_pcb->cpu_group, __ATOMIC_RELAXED);
+	if (grp == NULL)
+		return NO_TIMEOUT;
+
+	TimerDuration refill = NO_TIMEOUT;
+	Mutex_Lock(&grp->spinlock);
+	sched_group_refill(grp, now);
+	grp->runtime += used;
+	if (grp->runtime >= grp->quota) {
+		refill = grp->period_start + grp->period;
+		if (!grp->throttled) {
+			grp->throttled = 1;
+			grp->throttled_periods++;
+			grp->throttled_time += refill - now;
+		}
+	}
+	Mutex_Unlock(&grp->spinlock);
+	return refill;
+}
+
+/* A time slice of the given length, cut to the quota left to the group of a thread */
+static TimerDuration sched_group_slice(TCB* tcb, TimerDuration slice)
+{
+	cpu_group_t* grp = __atomic_load_n(&tcb->owner_pcb->cpu_group, __ATOMIC_RELAXED);
+	if (grp == NULL)
+		return slice;
+
+	Mutex_Lock(&grp->spinlock);
+	sched_group_refill(grp, bios_clock_fine());
+	TimerDuration left = (grp->runtime < grp->quota) ? grp->quota - grp->runtime : 0;
+	Mutex_Unlock(&grp->spinlock);
+	return (left < slice) ? left : slice;
+}
+
+/*
+  Timeouts expire only when a core enters the scheduler, so a slice
+  longer than a QUANTUM ends at the next tick of the timer wheel, if
+  that comes earlier; the woken thread then need not wait for the whole
+  slice (see sched_queue_insert()).
+*/
+static TimerDuration sched_timeout_slice(TimerDuration slice)
+{
+	if (slice <= QUANTUM || tw_count == 0)
+		return slice;
+
+	Mutex_Lock(&timeout_spinlock);
+	TimerDuration next = (tw_count == 0) ? NO_TIMEOUT : tw_next_tick();
+	Mutex_Unlock(&timeout_spinlock);
+	if (next == NO_TIMEOUT)
+		return slice;
+
+	TimerDuration now = bios_clock_fine();
+	TimerDuration until = (next * TW_TICK > now + QUANTUM) ? next * TW_TICK - now : QUANTUM;
+	return (until < slice) ? until : slice;
+}
+
+/*
+  Whether the policy lets the yielding thread run again ahead of the
+  queued threads.
+
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
+ */
+static int sched_keeps(CCB* ccb, TCB* current)
+{
+	return sched_policy->keep != NULL && current->state == READY && current->type != IDLE_THREAD
+		&& !SCHED_IS_RT(current) && SCHED_ALLOWED(current, ccb) && sched_policy->keep(ccb, current);
+}
+
+/*
+  Select the next thread to run on the current core: the real-time
+  thread with the earliest deadline, or else a thread of the open gang,
+  or else the head of the local run queues, or else a thread stolen from
+  another core, or else the current thread (if still ready) or the idle
+  thread.
+*/
+static TCB* sched_queue_select(TCB* current)
+{
+	CCB* ccb = &CURCORE;
+	TCB* next_thread;
+	PCB* gang = sched_gang_current(bios_clock_fine());
+
+	for (;;) {
+		Mutex_Lock(&ccb->sched_spinlock);
+		next_thread = sched_rt_pop(ccb, current);
+		if (next_thread == NULL && gang != NULL)
+			next_thread = sched_queue_pop_allowed(ccb, ccb, gang);
+		if (next_thread == NULL && gang != NULL && current->owner_pcb == gang
+				&& current->state == READY && SCHED_ALLOWED(current, ccb))
+			next_thread = current;
+		if (next_thread == NULL && sched_keeps(ccb, current))
+			next_thread = current;
+		if (next_thread == NULL)
+			next_thread = sched_queue_pop(ccb);
+		Mutex_Unlock(&ccb->sched_spinlock);
+
+		if (next_thread == NULL || next_thread == current || SCHED_ALLOWED(next_thread, ccb))
+			break;
+
+		/* Its affinity has changed since it was queued; send it to a core it may run on */
+		Mutex_Lock(&next_thread->state_spinlock);
+		sched_queue_add(next_thread);
+		Mutex_Unlock(&next_thread->state_spinlock);
+	}
+
+	if (next_thread == NULL && gang != NULL)
+		next_thread = sched_queue_steal(ccb, gang);
+	if (next_thread == NULL)
+		next_thread = sched_queue_steal(ccb, NULL);
+
+	if (next_thread == NULL)
+		next_thread = (current->state == READY && SCHED_ALLOWED(current, ccb))
+			? current : &ccb->idle_thread;
+
+	TimerDuration slice = (sched_policy->slice != NULL && next_thread->type != IDLE_THREAD)
+		? sched_timeout_slice(sched_policy->slice(next_thread)) : QUANTUM;
+	next_thread->its = SCHED_IS_RT(next_thread) ? next_thread->rt_budget
+		: sched_group_slice(next_thread, slice);
+
+	return next_thread;
+}
+
+/*
+  Take the thread reserved for this core by wakeup_to(), if any, to run
+  for the remaining time slice of the yielding thread. If the slice is
+  used up, or real-time threads are waiting for the core, the reserved
+  thread is queued like any other ready thread, and NULL is returned.
+*/
+static TCB* sched_handoff_select(CCB* ccb, TimerDuration remaining)
+{
+	TCB* tcb = ccb->handoff;
+	if (tcb == NULL)
+		return NULL;
+	ccb->handoff = NULL;
+
+	if (remaining < TIMER_SLACK || !is_rlist_empty(&ccb->RT)) {
+		Mutex_Lock(&tcb->state_spinlock);
+		sched_queue_add(tcb);
+		Mutex_Unlock(&tcb->state_spinlock);
+		return NULL;
+	}
+
+	tcb->its = remaining;
+	return tcb;
+}
+
+#ifdef SCHED_TICKLESS
+
+/*
+  Decide whether the current core can run tickless, i.e., its run queues
+  are empty and its current thread is neither real-time nor in a CPU
+  group (whose budget and quota need the alarm). Record the decision in
+  the CCB, so that sched_queue_insert() knows to restart the quantum
+  alarm.
+*/
+static int sched_enter_tickless(CCB* ccb)
+{
+	Mutex_Lock(&ccb->sched_spinlock);
+	TCB* current = ccb->current_thread;
+	ccb->tickless = (ccb->nr_ready == 0 && !SCHED_IS_RT(current) && current->owner_pcb->cpu_group == NULL);
+	Mutex_Unlock(&ccb->sched_spinlock);
+	return ccb->tickless;
+}
+
+/*
+  Set the deadline of a tickless core, so that it only wakes up when the
+  timer wheel or the balancer needs service, if ever. An idle core with
+  nothing to wait for also disarms its timer, so that it is not woken up
+  by a stale alarm.
+*/
+static void sched_set_tickless_deadline(CCB* ccb)
+{
+	Mutex_Lock(&timeout_spinlock);
+	TimerDuration next = (tw_count == 0) ? NO_TIMEOUT : tw_next_tick();
+	Mutex_Unlock(&timeout_spinlock);
+
+	TimerDuration deadline = (next == NO_TIMEOUT) ? NO_TIMEOUT : next * TW_TICK;
+	if (ccb->id == BALANCE_CORE) {
+		TimerDuration balance = sched_balance_deadline();
+		if (balance < deadline)
+			deadline = balance;
+	}
+
+	if (deadline == NO_TIMEOUT) {
+		if (ccb->current_thread->type == IDLE_THREAD)
+			sched_cancel_timer(ccb);
+		else
+			sched_set_deadline(ccb, NO_TIMEOUT);
+		return;
+	}
+
+	/* Do not spin on an alarm that is too near */
+	TimerDuration curtime = bios_clock_fine();
+	if (deadline < curtime + TW_TICK)
+		deadline = curtime + TW_TICK;
+	sched_set_deadline(ccb, deadline);
+}
+
+#endif
+
+/*
+  Make the process ready.
+ */
+int wakeup(TCB* tcb)
+{
+	int ret = 0;
+
+	/* Preemption off */
+	int oldpre = preempt_off;
+
+	/* To touch tcb->state, we must get the thread's spinlock. */
+	Mutex_Lock(&tcb->state_spinlock);
+
+	if (tcb->state == STOPPED || tcb->state == INIT) {
+		sched_make_ready(tcb);
+		ret = 1;
+	}
+
+	Mutex_Unlock(&tcb->state_spinlock);
+
+	/* Restore preemption state */
+	if (oldpre)
+		preempt_on;
+
+	return ret;
+}
+
+/*
+  Make the thread ready, and reserve it for the next switch on the
+  current core (see sched_handoff_select()).
+ */
+int wakeup_to(TCB* tcb)
+{
+	int ret = 0;
+
+	/* Preemption off */
+	int oldpre = preempt_off;
+
+	CCB* ccb = &CURCORE;
+	Mutex_Lock(&tcb->state_spinlock);
+
+	if (tcb->state == STOPPED || tcb->state == INIT) {
+		/* 
+		  A thread that is still dirty will be queued by the core that
+		  is switching it out; we cannot reserve it.
+		 */
+		if (ccb->handoff == NULL && tcb->phase == CTX_CLEAN && SCHED_ALLOWED(tcb, ccb) && !SCHED_IS_RT(tcb)) {
+			sched_mark_ready(tcb);
+			ccb->handoff = tcb;
+		} else
+			sched_make_ready(tcb);
+		ret = 1;
+	}
+
+	Mutex_Unlock(&tcb->state_spinlock);
+
+#ifdef SCHED_TICKLESS
+	/* A reserved thread must not wait for ever on a tickless core */
+	if (ret && ccb->handoff == tcb) {
+		Mutex_Lock(&ccb->sched_spinlock);
+		int was_tickless = ccb->tickless;
+		ccb->tickless = 0;
+		Mutex_Unlock(&ccb->sched_spinlock);
+		if (was_tickless)
+			sched_set_deadline(ccb, bios_clock_fine() + QUANTUM);
+	}
+#endif
+
+	/* Restore preemption state */
+	if (oldpre)
+		preempt_on;
+
+	return ret;
+}
+
+/*
+  Return the core of a thread that runs on another core, where it may
+  no longer run, or -1.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+ */
+static int sched_stranded_core(TCB* tcb)
+{
+	if (tcb != CURTHREAD && tcb->state == RUNNING && !SCHED_ALLOWED(tcb, &cctx[tcb->last_core]))
+		return tcb->last_core;
+	return -1;
+}
+
+/*
+  Move a thread off a core it may no longer run on, after its affinity
+  or real-time admission changed, and restore preemption.
+
+  A thread stranded on another core moves at its next yield. The core
+  may be tickless, so make sure it yields soon. The current thread moves
+  away at once.
+ */
+static void sched_move_stranded(TCB* tcb, int stranded_core, int preempt)
+{
+	if (stranded_core >= 0)
+		cpu_ici(stranded_core);
+
+	if (preempt)
+		preempt_on;
+
+	if (tcb == CURTHREAD && !SCHED_ALLOWED(tcb, &cctx[cpu_core_id]))
+		yield(SCHED_USER);
+}
+
+/*
+  Change the affinity of a thread.
+ */
+int set_affinity(TCB* tcb, cpumask_t mask)
+{
+	mask &= CORE_MASK_ALL;
+	if (mask == 0)
+		return -1;
+
+	int preempt = preempt_off;
+
+	Mutex_Lock(&tcb->state_spinlock);
+
+	/* A real-time thread must keep the core it is admitted on */
+	if (SCHED_IS_RT(tcb) && !(mask & CORE_BIT(tcb->rt_core))) {
+		Mutex_Unlock(&tcb->state_spinlock);
+		if (preempt)
+			preempt_on;
+		return -1;
+	}
+
+	tcb->affinity = mask;
+	int stranded = sched_stranded_core(tcb);
+	Mutex_Unlock(&tcb->state_spinlock);
+
+	sched_move_stranded(tcb, stranded, preempt);
+	return 0;
+}
+
+/*
+  Make a thread real-time, or return it to the MLFQ.
+ */
+int set_realtime(TCB* tcb, TimerDuration runtime, TimerDuration period, TimerDuration deadline)
+{
+	if (runtime != 0 && !(runtime <= deadline && deadline <= period))
+		return -1;
+	unsigned long density = (runtime != 0) ? runtime * 1000000ul / deadline : 0;
+
+	int preempt = preempt_off;
+
+	Mutex_Lock(&tcb->state_spinlock);
+
+	/* Give back the old reservation, and reserve on a core with room */
+	Mutex_Lock(&rt_admit_spinlock);
+	if (SCHED_IS_RT(tcb))
+		cctx[tcb->rt_core].rt_util -= tcb->rt_density;
+	int core = (runtime != 0) ? sched_rt_admit(tcb, density) : -1;
+	if (core >= 0)
+		cctx[core].rt_util += density;
+	else if (runtime != 0 && SCHED_IS_RT(tcb))
+		cctx[tcb->rt_core].rt_util += tcb->rt_density;	/* rejected; keep the old one */
+	Mutex_Unlock(&rt_admit_spinlock);
+
+	if (runtime != 0 && core < 0) {
+		Mutex_Unlock(&tcb->state_spinlock);
+		if (preempt)
+			preempt_on;
+		return -1;
+	}
+
+	/*
+	  A queued thread is in the EDF queue of its rt_core, or in the policy
+	  queues of some core. Queue it again in its new class.
+	 */
+	int queued = (tcb->state == READY && sched_queue_remove(tcb));
+
+	tcb->rt_runtime = runtime;
+	if (runtime != 0) {
+		tcb->rt_period = period;
+		tcb->rt_deadline = deadline;
+		tcb->rt_density = density;
+		tcb->rt_core = core;
+		sched_rt_release_job(tcb, bios_clock_fine());
+	}
+	else if (queued && sched_policy->on_wakeup != NULL)
+		sched_policy->on_wakeup(tcb);
+	if (queued)
+		sched_queue_add(tcb);
+	if (tcb == CURTHREAD)
+		CURCORE.slice_start = bios_clock_fine();
+
+	int stranded = sched_stranded_core(tcb);
+	Mutex_Unlock(&tcb->state_spinlock);
+
+	sched_move_stranded(tcb, stranded, preempt);
+	return 0;
+}
+
+/*
+  End the current job of the current real-time thread, and sleep until
+  the next one is released.
+ */
+int wait_period()
+{
+	TCB* tcb = CURTHREAD;
+	if (!SCHED_IS_RT(tcb))
+		return -1;
+
+	int preempt = preempt_off;
+
+	Mutex_Lock(&tcb->state_spinlock);
+	TimerDuration now = bios_clock_fine();
+	int missed = (now > tcb->rt_job_deadline);
+
+	TimerDuration release = tcb->rt_release + tcb->rt_period;
+	if (release < now)
+		release = now;
+	sched_rt_release_job(tcb, release);
+
+	/* The time used so far was for the job that ended */
+	CURCORE.slice_start = now;
+	Mutex_Unlock(&tcb->state_spinlock);
+
+	if (release > now)
+		sleep_releasing(STOPPED, NULL, SCHED_USER, release - now);
+
+	if (preempt)
+		preempt_on;
+
+	return missed;
+}
+
+/*
+  Create a CPU group.
+ */
+int create_cpu_group(TimerDuration quota, TimerDuration period)
+{
+	if (quota == 0 || period == 0)
+		return -1;
+
+	for (int g = NOGROUP + 1; g < MAX_CPU_GROUPS; g++) {
+		cpu_group_t* grp = &cpu_groups[g];
+		if (grp->active)
+			continue;
+
+		grp->quota = quota;
+		grp->period = period;
+		grp->period_start = bios_clock_fine();
+		grp->runtime = 0;
+		grp->throttled = 0;
+		grp->nprocs = 0;
+		grp->throttled_periods = 0;
+		grp->throttled_time = 0;
+		grp->active = 1;
+		return g;
+	}
+	return -1;
+}
+
+/*
+  Move a process to a CPU group. Its threads are charged to the new
+  group from their next yield on.
+ */
+void set_cpu_group(PCB* pcb, cpu_group_t* grp)
+{
+	cpu_group_t* old = pcb->cpu_group;
+	if (old != NULL)
+		__atomic_fetch_sub(&old->nprocs, 1, __ATOMIC_RELAXED);
+	if (grp != NULL)
+		__atomic_fetch_add(&grp->nprocs, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&pcb->cpu_group, grp, __ATOMIC_RELAXED);
+}
+
+/*
+  Atomically put the current process to sleep, after unlocking mx or tl
+  (whichever is not NULL).
+ */
+static void sleep_releasing_lock(Thread_state state, Mutex* mx, TicketLock* tl,
+	enum SCHED_CAUSE cause, TimerDuration timeout)
+{
+	assert(state == STOPPED || state == EXITED);
+
+
+	int preempt = preempt_off;
+	TCB* tcb = CURTHREAD;
+	Mutex_Lock(&tcb->state_spinlock);
+
+	/* mark the thread as stopped or exited */
+	tcb->state = state;
+	__atomic_fetch_sub(&tcb->owner_pcb->runnable, 1, __ATOMIC_RELAXED);
+
+	/* register the timeout (if any) for the sleeping thread */
+	if (state != EXITED)
+		sched_register_timeout(tcb, timeout);
+
+	/* Release mx or tl */
+	if (mx != NULL)
+		Mutex_Unlock(mx);
+	if (tl != NULL)
+		Ticket_Unlock(tl);
+
+	/* Release the thread's spinlock before calling yield() !!! */
+	Mutex_Unlock(&tcb->state_spinlock);
+
+	/* call this to schedule someone else */
+	yield(cause);
+
+	/* Restore preemption state */
+	if (preempt)
+		preempt_on;
+}
+
+void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
+	TimerDuration timeout)
+{
+	sleep_releasing_lock(state, mx, NULL, cause, timeout);
+}
+
+void sleep_releasing_ticket(Thread_state state, TicketLock* tl, enum SCHED_CAUSE cause,
+	TimerDuration timeout)
+{
+	/* Ticket_Unlock must not restore preemption before the thread sleeps */
+	int preempt = tl->preempt;
+	tl->preempt = 0;
+	sleep_releasing_lock(state, NULL, tl, cause, timeout);
+	if (preempt)
+		preempt_on;
+}
+
+/* This function is the entry point to the scheduler's context switching */
+
+
+
+void yield(enum SCHED_CAUSE cause)
+{
+	/* We must stop preemption but save it! */
+	int preempt = preempt_off;
+
+	CCB* ccb = &CURCORE;
+	TCB* current = ccb->current_thread; /* Make a local copy of current process, for speed */
+
+	/* 
+	  The time left in the current slice. The timer is left armed; if it
+	  goes off before the next deadline, the alarm is ignored.
+	 */
+	TimerDuration now = bios_clock_fine();
+	TimerDuration remaining = (ccb->sched_deadline != NO_TIMEOUT && ccb->sched_deadline > now)
+		? ccb->sched_deadline - now : 0;
+
+	/* Let the policy account for the slice; real-time and idle threads are not its own */
+	if (sched_policy->on_yield != NULL && current->type != IDLE_THREAD && !SCHED_IS_RT(current))
+		sched_policy->on_yield(ccb, current, cause, now - ccb->slice_start);
+	if (sched_policy->on_tick != NULL)
+		sched_policy->on_tick(ccb, now);
+
+	/* Charge the CPU group; a thread whose group has used up its quota is parked until the refill */
+	TimerDuration refill = (current->type != IDLE_THREAD && !SCHED_IS_RT(current))
+		? sched_group_charge(current, now - ccb->slice_start, now) : NO_TIMEOUT;
+
+	/* Update CURTHREAD state */
+	Mutex_Lock(&current->state_spinlock);
+	if (current->state == RUNNING && refill != NO_TIMEOUT) {
+		current->state = STOPPED;
+		__atomic_fetch_sub(&current->owner_pcb->runnable, 1, __ATOMIC_RELAXED);
+		sched_register_timeout(current, refill - now);
+	}
+	if (current->state == RUNNING)
+		current->state = READY;
+	if (SCHED_IS_RT(current))
+		sched_rt_charge(current, now - ccb->slice_start);
+	Mutex_Unlock(&current->state_spinlock);
+
+	/* Update CURTHREAD scheduler data */
+	current->rts = remaining;
+	current->last_cause = current->curr_cause;
+	current->curr_cause = cause;
+
+	/* Wake up threads whose sleep timeout has expired */
+	sched_wakeup_expired_timeouts();
+
+	/* Get next: a thread handed this core, or the best ready thread */
+	TCB* next = sched_handoff_select(ccb, remaining);
+	if (next == NULL)
+		next = sched_queue_select(current);
+	assert(next != NULL);
+
+	/* Save the current TCB for the gain phase */
+	ccb->previous_thread = current;
+
+	/* Switch contexts */
+	if (current != next) {
+		ccb->current_thread = next;
+		cpu_swap_context(&current->context, &next->context);
+	}
+
+	/* This is where we get after we are switched back on! A long time
+	   may have passed. Start a new timeslice...
+	  */
+	gain(preempt);
+}
+
+/*
+  This function must be called at the beginning of each new timeslice.
+  This is done mostly from inside yield().
+  However, for threads that are executed for the first time, this
+  has to happen in thread_start.
 
   The 'preempt' argument determines whether preemption is turned on
   in the new timeslice. When returning to threads in the non-preemptive
@@ -518,42 +2361,74 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
+	CCB* ccb = &CURCORE;
+	TCB* current = ccb->current_thread;
 
-	TCB* current = CURTHREAD;
+	/* The slice starts now */
+	TimerDuration now = bios_clock_fine();
+	ccb->slice_start = now;
 
-	/* Mark current state */
+	/* Mark current state, and account for migrations; the idle thread never moves */
+	Mutex_Lock(&current->state_spinlock);
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
+	int migrated = (current->last_core != ccb->id);
+	current->last_core = ccb->id;
+	Mutex_Unlock(&current->state_spinlock);
+
+	if (migrated) {
+		current->migrations++;
+		__atomic_fetch_add(&current->owner_pcb->migrations, 1, __ATOMIC_RELAXED);
+	}
+
+	/* A thread of a gang brings the rest of its gang along */
+	if (current != ccb->previous_thread)
+		sched_gang_open(current, now);
+
+	if (current != ccb->previous_thread && current->type != IDLE_THREAD)
+		ccb->level_switches[current->priority]++;
+	ccb->current_load = (current->type == IDLE_THREAD) ? 0 : current->owner_pcb->weight;
 
 	/* Take care of the previous thread */
-	TCB* prev = CURCORE.previous_thread;
+	TCB* prev = ccb->previous_thread;
 	if (current != prev) {
+		Mutex_Lock(&prev->state_spinlock);
 		prev->phase = CTX_CLEAN;
-		switch (prev->state) {
+		Thread_state prev_state = prev->state;
+		switch (prev_state) {
 		case READY:
 			if (prev->type != IDLE_THREAD)
 				sched_queue_add(prev);
 			break;
 		case EXITED:
-			release_TCB(prev);
-			break;
 		case STOPPED:
 			break;
 		default:
 			assert(0); /* prev->state should not be INIT or RUNNING ! */
 		}
+		Mutex_Unlock(&prev->state_spinlock);
+
+		/* Nobody else can reach an exited thread */
+		if (prev_state == EXITED)
+			release_TCB(prev);
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	/*
+	  Set a 1-quantum deadline, unless the core can go tickless. This is done
+	  before preemption is restored, so that a thread added to our run
+	  queues by an interrupt handler cannot miss the alarm.
+	 */
+#ifdef SCHED_TICKLESS
+	if (sched_enter_tickless(ccb))
+		sched_set_tickless_deadline(ccb);
+	else
+#endif
+		sched_set_deadline(ccb, now + current->rts);
 
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
-
-	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
 }
 
 static void idle_thread()
@@ -568,20 +2443,65 @@ static void idle_thread()
 	}
 
 	/* If the idle thread exits here, we are leaving the scheduler! */
-	bios_cancel_timer();
+	int preempt = preempt_off;
+	sched_cancel_timer(&CURCORE);
+	if (preempt)
+		preempt_on;
 	cpu_core_restart_all();
 }
 
 /*
-  Initialize the scheduler queue
+  Initialize the scheduler queues
  */
 void initialize_scheduler()
 {
-	yieldCounter = 0;
-	for(int i=0; i<PRIORITY_QUEUES; i++){
-		rlnode_init(&SCHED[i], NULL);
+	if (mlfq_quanta[0] == 0)
+		mlfq_fill_quanta(MLFQ_QUANTUM_TOP, MLFQ_QUANTUM_BOTTOM);
+
+	for (uint c = 0; c < MAX_CORES; c++) {
+		CCB* ccb = &cctx[c];
+		/* The init process is placed before the cores enter the scheduler */
+		ccb->id = c;
+		ccb->current_thread = &ccb->idle_thread;
+		ccb->idle_thread.type = IDLE_THREAD;
+		ccb->idle_thread.affinity = CORE_MASK_ALL;
+		ccb->sched_spinlock = MUTEX_INIT;
+		for(int i=0; i<PRIORITY_QUEUES; i++){
+			rlnode_init(&ccb->SCHED[i], NULL);
+		}
+		ccb->ready_mask = 0;
+		rlnode_init(&ccb->RT, NULL);
+		ccb->nr_ready = 0;
+		ccb->rt_util = 0;
+		ccb->min_vruntime = 0;
+		ccb->next_aging = 0;
+		for(int i=0; i<PRIORITY_QUEUES; i++)
+			ccb->level_switches[i] = 0;
+		ccb->load = 0;
+		ccb->current_load = 0;
+		ccb->balanced_in = 0;
+		ccb->tickless = 0;
+		ccb->handoff = NULL;
+		ccb->sched_deadline = NO_TIMEOUT;
+		ccb->timer_deadline = NO_TIMEOUT;
+		ccb->timer_syscalls = 0;
+		rlnode_init(&ccb->thread_cache, NULL);
+		ccb->thread_cache_size = 0;
 	}
-	rlnode_init(&TIMEOUT_LIST, NULL);
+	for (int l = 0; l < TW_LEVELS; l++)
+		for (int i = 0; i < TW_SLOTS; i++)
+			rlnode_init(&TW[l][i], NULL);
+	rlnode_init(&TW_EXPIRED, NULL);
+	tw_now = bios_clock_fine() / TW_TICK;
+	tw_count = 0;
+
+	for (int g = 0; g < MAX_CPU_GROUPS; g++) {
+		cpu_groups[g].active = 0;
+		cpu_groups[g].spinlock = MUTEX_INIT;
+	}
+	gang_pcb = NULL;
+	balance_next = 0;
+	balance_from = balance_to = NULL;
 }
 
 void run_scheduler()
@@ -598,6 +2518,7 @@ void run_scheduler()
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+	curcore->idle_thread.state_spinlock = MUTEX_INIT;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
 
 	curcore->idle_thread.its = QUANTUM;
@@ -606,6 +2527,11 @@ void run_scheduler()
 	curcore->idle_thread.curr_cause = SCHED_IDLE;
 	curcore->idle_thread.last_cause = SCHED_IDLE;
 
+	curcore->idle_thread.affinity = CORE_MASK_ALL;
+	curcore->idle_thread.last_core = curcore->id;
+	curcore->idle_thread.migrations = 0;
+	curcore->idle_thread.rt_runtime = 0;
+
 	/* Initialize interrupt handler */
 	cpu_interrupt_handler(ALARM, yield_handler);
 	cpu_interrupt_handler(ICI, ici_handler);
@@ -618,4 +2544,5 @@ void run_scheduler()
 	assert(CURTHREAD == &CURCORE.idle_thread);
 	cpu_interrupt_handler(ALARM, NULL);
 	cpu_interrupt_handler(ICI, NULL);
+	drain_thread_cache(curcore);
 }
@@ -5,8 +5,7 @@
 
 #ifndef __KERNEL_SCHED_H
 #define __KERNEL_SCHED_H
-#define PRIORITY_QUEUES 50 	//Priority queues are needed for MLFQ
-#define N 7000	//after N yields the scheduler will boost
+#define PRIORITY_QUEUES 50 	//Priority queues are needed for MLFQ (at most 64, see CCB::ready_mask)
 /**
   @file kernel_sched.h
   @brief TinyOS kernel: The Scheduler API
@@ -89,7 +88,8 @@ enum SCHED_CAUSE {
 	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
 	SCHED_POLL, /**< @brief The thread is polling a device */
 	SCHED_IDLE, /**< @brief The idle thread called yield */
-	SCHED_USER /**< @brief User-space code called yield */
+	SCHED_USER, /**< @brief User-space code called yield */
+	SCHED_PREEMPT /**< @brief A real-time thread with an earlier deadline became ready */
 };
 
 /**
@@ -104,7 +104,9 @@ typedef struct thread_control_block {
 
   PTCB* ptcb; 
 
-  int priority;
+  int priority; /**< @brief MLFQ level, for the mlfq policy */
+  TimerDuration aging_time; /**< @brief Since when the thread waits at its MLFQ level, for the mlfq policy */
+  TimerDuration vruntime; /**< @brief Weighted CPU time used, for the fair policy */
 
 	cpu_context_t context; /**< @brief The thread context */
 	Thread_type type; /**< @brief The type of thread */
@@ -112,8 +114,11 @@ typedef struct thread_control_block {
 	Thread_phase phase; /**< @brief The phase of the thread */
 
 	void (*thread_func)(); /**< @brief The initial function executed by this thread */
+	size_t stack_size; /**< @brief The size of the thread's stack */
 
-	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
+	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler, on @c bios_clock_fine() */
+
+	Mutex state_spinlock; /**< @brief Protects @c state, @c phase and @c wakeup_time */
 
 	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue */
 	TimerDuration its; /**< @brief Initial time-slice for this thread */
@@ -122,6 +127,22 @@ typedef struct thread_control_block {
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
 
+	cpumask_t affinity; /**< @brief The cores this thread may run on; never empty */
+	uint last_core; /**< @brief The core that last ran this thread (or created it) */
+	unsigned long migrations; /**< @brief Times this thread resumed on a different core than @c last_core */
+	unsigned int load_weight; /**< @brief The weight of its process when it was queued, counted in @c CCB::load */
+	int queue_core; /**< @brief The core on whose run queues the thread waits, or -1 */
+
+	TimerDuration rt_runtime; /**< @brief Real-time budget per period, or 0 for an MLFQ thread */
+	TimerDuration rt_period; /**< @brief Real-time period */
+	TimerDuration rt_deadline; /**< @brief Real-time deadline, relative to the release of each job */
+	TimerDuration rt_release; /**< @brief Release time of the current job, on @c bios_clock_fine() */
+	TimerDuration rt_job_deadline; /**< @brief Absolute deadline of the current job */
+	TimerDuration rt_abs_deadline; /**< @brief The EDF deadline; later than @c rt_job_deadline after an overrun */
+	TimerDuration rt_budget; /**< @brief Budget left until @c rt_abs_deadline */
+	unsigned long rt_density; /**< @brief @c rt_runtime / @c rt_deadline, in millionths of a core */
+	uint rt_core; /**< @brief The core this real-time thread is admitted on */
+
 #ifndef NVALGRIND
 	unsigned valgrind_stack_id; /**< @brief Valgrind helper for stacks. 
 
@@ -137,7 +158,8 @@ typedef struct thread_control_block {
 
 /** @brief Thread stack size.
 
-  The default thread stack size in TinyOS is 128 kbytes.
+  The default thread stack size in TinyOS is 128 kbytes. Threads with
+  other stack sizes can be created by @c CreateThreadEx and @c ExecEx.
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
@@ -150,6 +172,36 @@ typedef struct thread_control_block {
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
+
+  Each core owns its own set of MLFQ run queues, protected by its own
+  spinlock. A thread that becomes ready is queued on the core that last
+  ran it, whose caches are likely warm, unless that core is busy and
+  some other core is idle. A core that runs out of ready threads steals
+  work from the run queues of other cores, and the balancer moves ready
+  threads from the busiest to the least loaded core (see
+  @ref BALANCE_PERIOD).
+
+  A thread is only queued on, and only stolen by, a core in its
+  @c affinity. A thread found queued on a core outside its affinity
+  (because its affinity changed) is moved when that core pops it.
+
+  Above the MLFQ levels, each core has a queue of real-time threads,
+  ordered by deadline (EDF). A real-time thread is admitted on one core,
+  whose capacity it reserves (see @ref RT_CAPACITY), and only runs
+  there. It preempts any MLFQ thread, and any real-time thread with a
+  later deadline. A thread that overruns its budget gets a fresh budget
+  with its deadline postponed by a period, so that it cannot take more
+  than its share of the core from other real-time threads.
+
+  A core with empty run queues runs @e tickless (see @ref SCHED_TICKLESS).
+
+  The core timer is programmed lazily: it is only reprogrammed when the
+  scheduler needs an earlier deadline than the one it is armed for. Alarms
+  that arrive before @c sched_deadline are stale, and just re-arm the timer.
+
+  Each core also keeps a cache of released TCB+stack blocks, of up to
+  @ref THREAD_CACHE_HIGH_WATER blocks. The cache is only accessed by its
+  own core, in the non-preemptive domain, so it needs no lock.
  */
 typedef struct core_control_block {
 	uint id; /**< @brief The core id */
@@ -158,8 +210,115 @@ typedef struct core_control_block {
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	Mutex sched_spinlock; /**< @brief Protects the run queues of this core */
+	rlnode SCHED[PRIORITY_QUEUES]; /**< @brief The MLFQ run queues of this core */
+	uint64_t ready_mask; /**< @brief Bit @c i is set iff @c SCHED[i] is not empty */
+	rlnode RT; /**< @brief The ready real-time threads of this core, by deadline */
+	unsigned int nr_ready; /**< @brief Number of threads in the run queues, including @c RT */
+	unsigned long load; /**< @brief Total weight of the processes of the threads in the run queues */
+	unsigned int current_load; /**< @brief Weight of the process of @c current_thread, or 0 if idle */
+	unsigned long rt_util; /**< @brief Total @c rt_density of the real-time threads admitted on this core */
+	TimerDuration slice_start; /**< @brief When @c current_thread started its slice, on @c bios_clock_fine() */
+	TimerDuration min_vruntime; /**< @brief Virtual time of this core, for the fair policy */
+	TimerDuration next_aging; /**< @brief When the MLFQ run queues of this core are next aged */
+	unsigned long level_switches[PRIORITY_QUEUES]; /**< @brief Threads dispatched at each MLFQ level */
+	unsigned long balanced_in; /**< @brief Threads moved to this core by the balancer */
+	int tickless; /**< @brief Set when the core runs without a periodic quantum alarm */
+	TCB* handoff; /**< @brief A ready thread reserved by @c wakeup_to() for the next switch on this core */
+
+	TimerDuration sched_deadline; /**< @brief When the core must next enter the scheduler, on @c bios_clock_fine() */
+	TimerDuration timer_deadline; /**< @brief When the core timer is armed to expire, or @c NO_TIMEOUT */
+	unsigned long timer_syscalls; /**< @brief Number of times the core timer was (re)programmed */
+
+	rlnode thread_cache; /**< @brief Released TCB+stack blocks, for reuse by spawn_thread() */
+	unsigned int thread_cache_size; /**< @brief Number of blocks in @c thread_cache */
+
 } CCB;
 
+/**
+  @brief A CPU group.
+
+  The processes of a group may use up to @c quota of CPU time in every
+  @c period, over all cores. A thread of the group that yields after
+  the group has used up its quota is parked in the timer wheel until
+  the next period starts, and the time slices of the group's threads
+  never extend past the quota left. A group that overruns its quota
+  starts the next period in debt. Real-time threads are not charged.
+
+  Group 0 (@c NOGROUP) is not used.
+ */
+typedef struct cpu_group {
+	int active; /**< @brief Set once the group has been created */
+	TimerDuration quota; /**< @brief CPU time per period, in microseconds */
+	TimerDuration period; /**< @brief The period, in microseconds */
+
+	Mutex spinlock; /**< @brief Protects the fields below */
+	TimerDuration period_start; /**< @brief Start of the current period, on @c bios_clock_fine() */
+	TimerDuration runtime; /**< @brief CPU time used in the current period */
+	int throttled; /**< @brief Set when the quota of the current period is used up */
+	unsigned long nprocs; /**< @brief Live processes in the group */
+	unsigned long throttled_periods; /**< @brief Periods in which the quota was used up */
+	TimerDuration throttled_time; /**< @brief Total time spent throttled, in microseconds */
+} cpu_group_t;
+
+/** @brief The CPU groups, indexed by group id */
+extern cpu_group_t cpu_groups[MAX_CPU_GROUPS];
+
+/**
+  @brief A scheduling policy.
+
+  A policy orders the ready threads of each core in its run queues,
+  except for real-time threads, which run before them in EDF order.
+  The policy owns @c SCHED and @c ready_mask of each core, and its own
+  fields of each thread. The available policies are
+  - @c mlfq: a multi-level feedback queue, with the priority of each
+    thread adjusted by the causes of its yields, and raised as it waits,
+    and longer time slices at lower levels (the default)
+  - @c rr: round-robin
+  - @c fair: the thread that has used the least CPU time, weighted by
+    its process (see SetWeight), runs next
+
+  The hooks marked as optional may be @c NULL.
+
+  @see set_sched_policy
+ */
+typedef struct sched_policy {
+	const char* name; /**< @brief The name, for @c set_sched_policy() */
+
+	/** @brief Add a ready thread to the run queues of a core, with @c ccb->sched_spinlock held */
+	void (*enqueue)(CCB* ccb, TCB* tcb);
+
+	/** @brief Remove and return the next thread to run from the run queues of a core, or @c NULL,
+	    with @c ccb->sched_spinlock held */
+	TCB* (*pick_next)(CCB* ccb);
+
+	/** @brief Like @c pick_next, but only for threads that may run on core @c thief
+	    and, unless @c only is @c NULL, belong to process @c only */
+	TCB* (*steal)(CCB* ccb, CCB* thief, PCB* only);
+
+	/** @brief Optional: account for the slice of the current thread, which used
+	    @c used usec and yields for @c cause */
+	void (*on_yield)(CCB* ccb, TCB* current, enum SCHED_CAUSE cause, TimerDuration used);
+
+	/** @brief Optional: called on every entry to the scheduler of a core, at time @c now */
+	void (*on_tick)(CCB* ccb, TimerDuration now);
+
+	/** @brief Optional: a thread becomes ready, after sleeping or being created */
+	void (*on_wakeup)(TCB* tcb);
+
+	/** @brief Optional: the time slice of a thread about to run; @c QUANTUM by default */
+	TimerDuration (*slice)(TCB* tcb);
+
+	/** @brief Optional: whether a thread that becomes ready should cut short a long
+	    time slice of thread @c current (see @ref QUANTUM) */
+	int (*outranks)(TCB* tcb, TCB* current);
+
+	/** @brief Optional: whether the yielding thread, still ready, runs again ahead of
+	    the queued threads, with @c ccb->sched_spinlock held. By default, it runs only
+	    if no other thread is ready. */
+	int (*keep)(CCB* ccb, TCB* current);
+} sched_policy_t;
+
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
 extern CCB cctx[MAX_CORES];
 
@@ -203,9 +362,13 @@ TCB* cur_thread();
                 otherwise ignores it
 
     @param func The function to execute in the new thread.
-    @returns  A pointer to the TCB of the new thread, in the @c INIT state.
+    @param stack_size The size of the new thread's stack, in bytes. It is
+                rounded up to a multiple of the page size. If 0, the
+                default @c THREAD_STACK_SIZE is used.
+    @returns  A pointer to the TCB of the new thread, in the @c INIT state,
+                or NULL if the memory for the thread cannot be allocated.
 */
-TCB* spawn_thread(PCB* pcb, void (*func)());
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size);
 
 /**
   @brief Wakeup a blocked thread.
@@ -219,6 +382,101 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/**
+  @brief Wakeup a blocked thread and hand it the current core.
+
+  Like @c wakeup(), but instead of adding the thread to the run queues
+  (and possibly restarting a halted core to run it), the thread is
+  reserved for the current core. At the next @c yield() on this core,
+  typically when the caller blocks, the scheduler switches directly to
+  the reserved thread. This keeps a producer and its consumer on the
+  same core, with warm caches.
+
+  The reserved thread runs for the rest of the time slice of the thread
+  that yields. If the slice is used up, the reserved thread is added to
+  the run queues instead, so that threads handing the core to each
+  other cannot starve other threads.
+
+  Only one thread can be reserved per core; if another thread is already
+  reserved, or the thread is still being switched out by another core,
+  this call behaves like @c wakeup().
+
+  This call should be used when the caller is about to block, e.g.,
+  when a consumer is woken by a producer that will wait for it.
+
+  @param tcb the thread to be made @c READY.
+  @returns 1 if the thread state was @c STOPPED or @c INIT, 0 otherwise
+  @see wakeup
+*/
+int wakeup_to(TCB* tcb);
+
+/**
+  @brief Set the cores that a thread may run on.
+
+  Bits of cores that do not exist are dropped from @c mask. A queued
+  thread is moved when popped from a core it may no longer run on. A
+  thread running on such a core moves within a quantum, unless it is the
+  current thread, which moves before this call returns.
+
+  @param tcb the thread
+  @param mask the new affinity of the thread
+  @returns 0 on success, or -1 if @c mask contains no existing core
+  @see cpumask_t
+*/
+int set_affinity(TCB* tcb, cpumask_t mask);
+
+/**
+  @brief Make a thread real-time, or return it to the MLFQ.
+
+  The thread runs periodic jobs, each of which needs up to @c runtime
+  of CPU time by @c deadline after its release; a job is released
+  every @c period. The first job is released at once. The thread is
+  admitted on a core in its affinity with enough spare capacity, or
+  rejected. A @c runtime of 0 makes the thread an MLFQ thread again.
+
+  @param tcb the thread
+  @param runtime the budget per job, in microseconds
+  @param period the period, in microseconds
+  @param deadline the relative deadline, in microseconds
+  @returns 0 on success, or -1 if the parameters are invalid
+     (we need @c runtime <= @c deadline <= @c period) or no core can
+     admit the thread
+  @see wait_period
+*/
+int set_realtime(TCB* tcb, TimerDuration runtime, TimerDuration period, TimerDuration deadline);
+
+/**
+  @brief End the current job of the current real-time thread.
+
+  The thread sleeps until its next job is released, a period after
+  the current one. If that time has passed, the next job is released
+  at once.
+
+  @returns 1 if the job that ended missed its deadline, 0 if not, or
+     -1 if the current thread is not real-time
+  @see set_realtime
+*/
+int wait_period(void);
+
+/**
+  @brief Create a CPU group.
+
+  @param quota the CPU time per period, in microseconds
+  @param period the period, in microseconds
+  @returns the id of the new group, or -1 if the parameters are 0 or
+    all groups are in use
+  @see cpu_group_t
+*/
+int create_cpu_group(TimerDuration quota, TimerDuration period);
+
+/**
+  @brief Move a process to a CPU group.
+
+  @param pcb the process
+  @param grp the group, or @c NULL to take the process out of its group
+*/
+void set_cpu_group(PCB* pcb, cpu_group_t* grp);
+
 /** 
   @brief Block the current thread.
 
@@ -251,6 +509,12 @@ int wakeup(TCB* tcb);
    */
 void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
 
+/**
+	@brief Like @c sleep_releasing, unlocking a ticket lock.
+	@see sleep_releasing
+   */
+void sleep_releasing_ticket(Thread_state newstate, TicketLock* tl, enum SCHED_CAUSE cause, TimerDuration timeout);
+
 /**
   @brief Give up the CPU.
 
@@ -280,9 +544,86 @@ void initialize_scheduler(void);
   @brief Quantum (in microseconds) 
 
   This is the default quantum for each thread, in microseconds.
+
+  A policy may give threads longer time slices (see
+  @c sched_policy_t::slice). A thread that becomes ready and outranks
+  the thread running on its core limits the rest of its slice to
+  @c QUANTUM.
   */
 #define QUANTUM (10000L)
 
+/**
+  @brief Default time slices of the top and the bottom MLFQ level (in microseconds).
+
+  The slices of the levels in between are interpolated linearly. They
+  can be changed before boot by @c set_sched_quanta().
+  */
+#define MLFQ_QUANTUM_TOP (QUANTUM/2)
+#define MLFQ_QUANTUM_BOTTOM (5*QUANTUM)
+
+/**
+  @brief Default aging period of the MLFQ (in microseconds).
+
+  A thread waiting in the MLFQ run queues of a core moves up one
+  priority level for every aging period it waits, so that threads at
+  low priority do not starve. The period is that of a level with a
+  time slice of @c QUANTUM, and scales with the slice of each level.
+  It can be changed before boot by @c set_sched_aging().
+  */
+#define MLFQ_AGING_PERIOD (QUANTUM)
+
+/**
+  @brief Real-time capacity of each core, in millionths of a core.
+
+  A real-time thread is only admitted on a core if the total density
+  (runtime/deadline) of the real-time threads of the core stays within
+  this limit. This guarantees that EDF meets all deadlines on the core,
+  and leaves some of the core to the MLFQ threads.
+  */
+#define RT_CAPACITY 950000
+
+/**
+  @brief Tickless scheduling.
+
+  When defined, a core whose run queues are empty (it is idle, or runs a
+  single thread) does not receive an ALARM every quantum. Instead, its
+  timer is programmed to the next sleep timeout, or not at all. The
+  quantum alarm is restarted as soon as a thread is added to the
+  run queues of the core.
+
+  Comment out to get a periodic quantum alarm on every core.
+  */
+#define SCHED_TICKLESS
+
+/**
+  @brief Period of the load balancer (in microseconds).
+
+  Every period, the ALARM of core @ref BALANCE_CORE compares the load
+  of the cores, i.e., the total weight of the processes of their ready
+  and running threads. Ready threads move from the busiest to the least
+  loaded core, while the difference is at least two threads' worth.
+  A core pair must be out of balance for two periods in a row, so that
+  passing bursts do not make threads bounce between cores.
+  */
+#define BALANCE_PERIOD (5*QUANTUM)
+
+/** @brief The core that runs the load balancer. */
+#define BALANCE_CORE 0
+
+/** @brief Maximum number of threads moved by the load balancer per period. */
+#define BALANCE_BATCH 8
+
+/**
+  @brief Maximum number of released threads cached by each core.
+
+  When a thread is released, its TCB and stack are kept by the core for
+  reuse, unless the core already caches this many blocks. It can be set
+  when building, e.g. @c -DTHREAD_CACHE_HIGH_WATER=0 disables the cache.
+  */
+#ifndef THREAD_CACHE_HIGH_WATER
+#define THREAD_CACHE_HIGH_WATER 16
+#endif
+
 /** @} */
 
 #endif
@@ -9,6 +9,12 @@
 
 SCB* PORT_MAP[MAX_PORT+1] = {NULL};
 
+/* 
+	Protects PORT_MAP, the state of the sockets and the listener queues.
+	The pipes of the peers have their own locks, taken after this one.
+ */
+static kernel_lock_t socket_lock = KERNEL_LOCK_INIT;
+
 static file_ops socket_file_ops = {
 	.Open = NULL,
 	.Read = socket_read,
@@ -42,7 +48,7 @@ Fid_t sys_Socket(port_t port)
 
 
 
-int sys_Listen(Fid_t sock)
+static int listen_locked(Fid_t sock)
 {
 	//get fcb from the fid
 	FCB* fcb = get_fcb(sock);
@@ -66,7 +72,16 @@ int sys_Listen(Fid_t sock)
 }
 
 
-Fid_t sys_Accept(Fid_t lsock)
+int sys_Listen(Fid_t sock)
+{
+	kernel_lock(&socket_lock);
+	int ret = listen_locked(sock);
+	kernel_unlock(&socket_lock);
+	return ret;
+}
+
+
+static Fid_t accept_locked(Fid_t lsock)
 {
 	//get the fcb of the listening socket
 	FCB* fcb = get_fcb(lsock);
@@ -83,7 +98,7 @@ Fid_t sys_Accept(Fid_t lsock)
 	listening_socket->refcount ++;
 	// wait for request 
 	while (is_rlist_empty(&listening_socket->listener_s.queue) && PORT_MAP[listening_socket->port] != NULL) {
-		kernel_wait(&listening_socket->listener_s.req_available, SCHED_IO);
+		kernel_wait(&socket_lock, &listening_socket->listener_s.req_available, SCHED_IO);
 	}
 
 
@@ -132,6 +147,7 @@ Fid_t sys_Accept(Fid_t lsock)
 	pipe1->w_position = 0;
 	pipe1->r_position = 0;
 	pipe1->buffer_size = 0;
+	pipe1->lock = KERNEL_LOCK_INIT;
 
 	pipe_cb* pipe2;
 	pipe2 = xmalloc(sizeof(pipe_cb));
@@ -142,6 +158,7 @@ Fid_t sys_Accept(Fid_t lsock)
 	pipe2->w_position = 0;
 	pipe2->r_position = 0;
 	pipe2->buffer_size = 0;
+	pipe2->lock = KERNEL_LOCK_INIT;
 
 	server_peer->type = SOCKET_PEER;
 	server_peer->peer_s.write_pipe = pipe2;
@@ -168,7 +185,16 @@ Fid_t sys_Accept(Fid_t lsock)
 }
 
 
-int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
+Fid_t sys_Accept(Fid_t lsock)
+{
+	kernel_lock(&socket_lock);
+	Fid_t fid = accept_locked(lsock);
+	kernel_unlock(&socket_lock);
+	return fid;
+}
+
+
+static int connect_locked(Fid_t sock, port_t port, timeout_t timeout)
 {
 	//the given port is illegal
 	if(port <= NOPORT || port > MAX_PORT) {
@@ -201,10 +227,11 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	cr->peer = client_socket;
 
 	rlist_push_back(&listening_socket->listener_s.queue, &cr->queue_node);
-	kernel_signal(&listening_socket->listener_s.req_available);
+	//hand the core to the server, since we wait for it to accept
+	kernel_signal_handoff(&listening_socket->listener_s.req_available);
 
 	client_socket->refcount ++;
-        kernel_timedwait(&(cr->connected_cv), SCHED_IO, timeout);
+        kernel_timedwait(&socket_lock, &(cr->connected_cv), SCHED_IO, timeout);
 	client_socket->refcount--;
 
 	if (client_socket->refcount < 0)
@@ -223,7 +250,16 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 }
 
 
-int sys_ShutDown(Fid_t sock, shutdown_mode mode)
+int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
+{
+	kernel_lock(&socket_lock);
+	int ret = connect_locked(sock, port, timeout);
+	kernel_unlock(&socket_lock);
+	return ret;
+}
+
+
+static int shutdown_locked(Fid_t sock, shutdown_mode mode)
 {
 	FCB* fcb = get_fcb(sock);
 	if(fcb == NULL) {
@@ -257,25 +293,42 @@ int sys_ShutDown(Fid_t sock, shutdown_mode mode)
 	return 0;
 }
 
+int sys_ShutDown(Fid_t sock, shutdown_mode mode)
+{
+	kernel_lock(&socket_lock);
+	int ret = shutdown_locked(sock, mode);
+	kernel_unlock(&socket_lock);
+	return ret;
+}
+
 	int socket_read(void* sock, char* buf, unsigned int size) 
 	{
 
 		SCB* socket = (SCB*) sock;
-		if(socket == NULL || socket->type != SOCKET_PEER || socket->peer_s.read_pipe == NULL)
+		pipe_cb* pipe = NULL;
+
+		kernel_lock(&socket_lock);
+		if(socket != NULL && socket->type == SOCKET_PEER)
+			pipe = socket->peer_s.read_pipe;
+		kernel_unlock(&socket_lock);
+
+		if(pipe == NULL)
 			return -1;
-        
-		pipe_cb* pipe = socket->peer_s.read_pipe;
 		return pipe_read(pipe, buf, size); 
 	}
 
 	int socket_write(void* sock, const char* buf, unsigned int size) 
 	{
 		SCB* socket = (SCB*) sock;
-		if(socket == NULL || socket->type != SOCKET_PEER || socket->peer_s.write_pipe == NULL)
+		pipe_cb* pipe = NULL;
+
+		kernel_lock(&socket_lock);
+		if(socket != NULL && socket->type == SOCKET_PEER)
+			pipe = socket->peer_s.write_pipe;
+		kernel_unlock(&socket_lock);
+
+		if(pipe == NULL)
 			return -1;
-        
-		pipe_cb* pipe = socket->peer_s.write_pipe;
-		
 		return pipe_write(pipe, buf, size);
 	}
 
@@ -287,6 +340,8 @@ int socket_close(void* sock){
 
     SCB* socket = (SCB*) sock;
 
+    kernel_lock(&socket_lock);
+
     switch (socket->type){
         case SOCKET_PEER:
             pipe_writer_close(socket->peer_s.write_pipe);
@@ -310,6 +365,8 @@ int socket_close(void* sock){
     if (socket->refcount < 0) {
 		free(socket);
 	}
+
+    kernel_unlock(&socket_lock);
    
     return 0;
 }
@@ -31,6 +31,10 @@ typedef struct unbound_s{
   rlnode unbound_socket;
 }unbound_socket;
 
+/* 
+  The pipes of a peer socket are never freed, so socket_read() and
+  socket_write() can use them after socket_lock is released.
+*/
 typedef struct peer_s{
   SCB* peer;
   pipe_cb* write_pipe;
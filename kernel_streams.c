@@ -11,6 +11,13 @@
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
 
+/*
+  Protects the file table (the freelist and the reference counts) and
+  the FIDTs of the processes. This is a leaf lock: the streams are
+  closed after it is released.
+ */
+static Mutex fcb_lock = MUTEX_INIT;
+
 
 void initialize_files()
 {
@@ -24,18 +31,22 @@ void initialize_files()
 }
 
 
-FCB* acquire_FCB()
+/* Must be called with fcb_lock held */
+static FCB* acquire_FCB()
 {
   if(! is_rlist_empty(& FCB_freelist)) {
     FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
     fcb->refcount = 0;
+    fcb->streamobj = NULL;
+    fcb->streamfunc = NULL;
     return fcb;
   }
   else
     return NULL;
 }
 
-void release_FCB(FCB* fcb)
+/* Must be called with fcb_lock held */
+static void release_FCB(FCB* fcb)
 {
   rlist_push_back(& FCB_freelist, & fcb->freelist_node);
 }
@@ -44,20 +55,76 @@ void release_FCB(FCB* fcb)
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
+  Mutex_Lock(&fcb_lock);
   fcb->refcount++;
+  Mutex_Unlock(&fcb_lock);
 }
 
-int FCB_decref(FCB* fcb)
+/* 
+  Drop a reference with fcb_lock held. If it was the last one, release 
+  the FCB and return the stream to close in *sobj and *sfunc.
+ */
+static void decref_locked(FCB* fcb, void** sobj, file_ops** sfunc)
 {
-  assert(fcb);
   fcb->refcount --;
   if(fcb->refcount==0) {
-    int retval = fcb->streamfunc->Close(fcb->streamobj);
+    *sobj = fcb->streamobj;
+    *sfunc = fcb->streamfunc;
     release_FCB(fcb);
-    return retval;
   }
   else
-    return 0;
+    *sfunc = NULL;
+}
+
+/* Close a stream released by decref_locked(), without fcb_lock */
+static int close_stream(void* sobj, file_ops* sfunc)
+{
+  return (sfunc != NULL && sfunc->Close != NULL) ? sfunc->Close(sobj) : 0;
+}
+
+int FCB_decref(FCB* fcb)
+{
+  void* sobj = NULL;
+  file_ops* sfunc;
+
+  assert(fcb);
+  Mutex_Lock(&fcb_lock);
+  decref_locked(fcb, &sobj, &sfunc);
+  Mutex_Unlock(&fcb_lock);
+
+  return close_stream(sobj, sfunc);
+}
+
+
+void FIDT_copy(PCB* dst, PCB* src)
+{
+  Mutex_Lock(&fcb_lock);
+  for(int i=0; i<MAX_FILEID; i++) {
+    dst->FIDT[i] = src->FIDT[i];
+    if(dst->FIDT[i])
+      dst->FIDT[i]->refcount++;
+  }
+  Mutex_Unlock(&fcb_lock);
+}
+
+
+void FIDT_clear(PCB* pcb)
+{
+  void* sobj[MAX_FILEID];
+  file_ops* sfunc[MAX_FILEID];
+
+  Mutex_Lock(&fcb_lock);
+  for(int i=0; i<MAX_FILEID; i++) {
+    sfunc[i] = NULL;
+    if(pcb->FIDT[i] != NULL) {
+      decref_locked(pcb->FIDT[i], &sobj[i], &sfunc[i]);
+      pcb->FIDT[i] = NULL;
+    }
+  }
+  Mutex_Unlock(&fcb_lock);
+
+  for(int i=0; i<MAX_FILEID; i++)
+    close_stream(sobj[i], sfunc[i]);
 }
 
 
@@ -68,6 +135,8 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
     size_t f=0;
     uint i;
 
+    Mutex_Lock(&fcb_lock);
+
     /* Find distinct fids */
     for(i=0; i<num; i++) {
 	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
@@ -75,7 +144,10 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	if(f==MAX_FILEID) break;
 	fid[i] = f; f++;
     }
-    if(i<num) return 0;
+    if(i<num) {
+	Mutex_Unlock(&fcb_lock);
+	return 0;
+    }
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
@@ -86,13 +158,15 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	    release_FCB(fcb[i-1]);
 	    i--;
 	}
+	Mutex_Unlock(&fcb_lock);
 	return 0;
     }
     /* Found all */
     for(i=0;i<num;i++) {
 	cur->FIDT[fid[i]]=fcb[i];
-	FCB_incref(fcb[i]);
+	fcb[i]->refcount++;
     }
+    Mutex_Unlock(&fcb_lock);
     return 1;
 }
 
@@ -101,11 +175,26 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    void* sobj;
+    file_ops* sfunc;
+
+    Mutex_Lock(&fcb_lock);
     for(size_t i=0; i<num ; i++) {
-	assert(cur->FIDT[fid[i]]==fcb[i]);
-	cur->FIDT[fid[i]] = NULL;
-	release_FCB(fcb[i]);
+	/* The stream was never set up, there is nothing to close */
+	fcb[i]->streamobj = NULL;
+	fcb[i]->streamfunc = NULL;
+
+	/* 
+	   The fids were visible to the other threads of the process, which
+	   may have closed them, or may hold references to the FCBs. Drop
+	   only the reference of the fid; the FCB is released by the last one.
+	 */
+	if(cur->FIDT[fid[i]]==fcb[i]) {
+	    cur->FIDT[fid[i]] = NULL;
+	    decref_locked(fcb[i], &sobj, &sfunc);
+	}
     }
+    Mutex_Unlock(&fcb_lock);
 }
 
 
@@ -128,23 +217,39 @@ FCB* get_fcb(Fid_t fid)
 }
 
 
+/*
+  Return the FCB of a fid of the current process, holding a reference 
+  to it, so that the stream will not be closed (by another thread) 
+  while we are using it! Returns NULL for a bad fid.
+ */
+static FCB* get_fcb_ref(Fid_t fid)
+{
+  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+
+  Mutex_Lock(&fcb_lock);
+  FCB* fcb = CURPROC->FIDT[fid];
+  if(fcb)
+    fcb->refcount++;
+  Mutex_Unlock(&fcb_lock);
+
+  return fcb;
+}
+
+
 int sys_Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
-  int (*devread)(void*,char*,uint);
-  void* sobj;
+  int (*devread)(void*,char*,uint) = NULL;
+  void* sobj = NULL;
 
   
   /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
     sobj = fcb->streamobj;
-    devread = fcb->streamfunc->Read;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
+    if(fcb->streamfunc)
+      devread = fcb->streamfunc->Read;
   
     if(devread)
       retcode = devread(sobj, buf, size);
@@ -152,8 +257,6 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
   }
-  
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
 
 
   return retcode;
@@ -168,17 +271,13 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 
   
   /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
 
     sobj = fcb->streamobj;
-    devwrite = fcb->streamfunc->Write;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
+    if(fcb->streamfunc)
+      devwrite = fcb->streamfunc->Write;
 
     if(devwrite)
       retcode = devwrite(sobj, buf, size);
@@ -196,12 +295,19 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 int sys_Close(int fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
+  void* sobj = NULL;
+  file_ops* sfunc = NULL;
+
+  if(retcode == 0) {
+    Mutex_Lock(&fcb_lock);
+    FCB* fcb = CURPROC->FIDT[fd];
+    if(fcb) {
+      CURPROC->FIDT[fd] = NULL;
+      decref_locked(fcb, &sobj, &sfunc);
+    }
+    Mutex_Unlock(&fcb_lock);
 
-  FCB* fcb = get_fcb(fd);
-
-  if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
-    retcode = FCB_decref(fcb);    
+    retcode = close_stream(sobj, sfunc);
   }
 
   return retcode;
@@ -218,22 +324,30 @@ int sys_Close(int fd)
 int sys_Dup2(int oldfd, int newfd)
 {
   int retcode=0;
+  void* sobj = NULL;
+  file_ops* sfunc = NULL;
+
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
-  FCB* old = get_fcb(oldfd);
-  FCB* new = get_fcb(newfd);
+  Mutex_Lock(&fcb_lock);
+
+  FCB* old = CURPROC->FIDT[oldfd];
+  FCB* new = CURPROC->FIDT[newfd];
 
   if(old==NULL) {
     retcode = -1;
   }
   else if(old!=new) {
     if(new)
-      FCB_decref(new);
-    FCB_incref(old);
+      decref_locked(new, &sobj, &sfunc);
+    old->refcount++;
     CURPROC->FIDT[newfd] = old;
   }
 
+  Mutex_Unlock(&fcb_lock);
+
+  close_stream(sobj, sfunc);
   return retcode;
 }
 
@@ -78,6 +78,27 @@ void FCB_incref(FCB* fcb);
 int FCB_decref(FCB* fcb);
 
 
+/**
+	@brief Copy the fileid table of a process to a new process.
+
+	Each stream copied gains a reference.
+
+	@param dst the new process
+	@param src the process whose streams are inherited
+*/
+void FIDT_copy(PCB* dst, PCB* src);
+
+
+/**
+	@brief Clear the fileid table of a process.
+
+	Each stream loses a reference, and is closed if it was the last one.
+
+	@param pcb the process whose streams are released
+*/
+void FIDT_clear(PCB* pcb);
+
+
 /** @brief Acquire a number of FCBs and corresponding fids.
 
    Given an array of fids and an array of pointers to FCBs  of
@@ -102,7 +123,8 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb);
 
    Given an array of fids of size @ num, this function will 
    return the fids to the free pool of the current process and
-   release the corresponding FCBs.
+   drop their references to the corresponding FCBs. An FCB is released
+   when no other thread of the process holds a reference to it.
 
    This is the opposite of operation @ref FCB_reserve. 
    Note that this is very different from closing open fids.
@@ -121,6 +143,9 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 /** @brief Translate an fid to an FCB.
 
 	This routine will return NULL if the fid is not legal.
+	No reference is taken, so the FCB may be closed by another thread
+	of the process; subsystems that keep using the stream object must
+	check it under their own lock.
 
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
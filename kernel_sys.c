@@ -12,13 +12,14 @@
  */
 
 
-#define PRE_CALL \
-kernel_lock();\
-
-
+/*
+	There is no global kernel lock around the system calls. Each
+	subsystem protects its own data with its own kernel lock (see
+	kernel_cc.h), so that calls on unrelated objects run in parallel.
+ */
+#define PRE_CALL
 
-#define POST_CALL \
-kernel_unlock();\
+#define POST_CALL
 
 
 /* with return */
@@ -6,15 +6,26 @@
 
 #define SYSCALLS \
 SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(ExecEx, int, (Task task, int argl, void* args, unsigned int stack_size), (task, argl, args, stack_size))\
 SYSCALLV(Exit, (int exitval), (exitval))\
 SYSCALL(GetPid, int, (void), ())\
 SYSCALL(GetPPid, int, (void), ())\
+SYSCALL(SetWeight, int, (Pid_t pid, unsigned int weight), (pid, weight))\
+SYSCALL(GetWeight, unsigned int, (Pid_t pid), (pid))\
+SYSCALL(SetGang, int, (Pid_t pid, int gang), (pid, gang))\
+SYSCALL(CreateCpuGroup, int, (timeout_t quota, timeout_t period), (quota, period))\
+SYSCALL(SetCpuGroup, int, (Pid_t pid, int group), (pid, group))\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(CreateThreadEx, Tid_t, (Task task, int argl, void* args, unsigned int stack_size), (task, argl, args, stack_size))\
 SYSCALL(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
+SYSCALL(SetAffinity, int, (Tid_t tid, cpumask_t mask), (tid, mask))\
+SYSCALL(GetAffinity, cpumask_t, (Tid_t tid), (tid))\
+SYSCALL(SetRealtime, int, (Tid_t tid, timeout_t runtime, timeout_t period, timeout_t deadline), (tid, runtime, period, deadline))\
+SYSCALL(WaitPeriod, int, (void), ())\
 SYSCALL(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
 SYSCALL(OpenNull, Fid_t, (), ())\
@@ -29,6 +40,11 @@ SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(OpenGroupInfo, Fid_t, (), ())\
+SYSCALLV(RWLock_ReadLock, (RWLock* rw), (rw))\
+SYSCALLV(RWLock_ReadUnlock, (RWLock* rw), (rw))\
+SYSCALLV(RWLock_WriteLock, (RWLock* rw), (rw))\
+SYSCALLV(RWLock_WriteUnlock, (RWLock* rw), (rw))\
 
 
 
@@ -10,6 +10,14 @@
   @brief Create a new thread in the current process.
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
+{
+  return sys_CreateThreadEx(task, argl, args, 0);
+}
+
+/** 
+  @brief Create a new thread in the current process, with the given stack size.
+  */
+Tid_t sys_CreateThreadEx(Task task, int argl, void* args, unsigned int stack_size)
 {
   PCB* pcb = CURPROC;
   
@@ -17,8 +25,18 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
     return NOTHREAD;
   }
 
+  if(stack_size != 0 && (stack_size < MIN_STACK_SIZE || stack_size > MAX_STACK_SIZE)){
+    return NOTHREAD;
+  }
+
   
-  TCB* tcb = spawn_thread(pcb, start_thread); //Initialize and return a new TCB
+  kernel_lock(&proc_lock);
+
+  TCB* tcb = spawn_thread(pcb, start_thread, stack_size); //Initialize and return a new TCB
+  if(tcb == NULL) {
+    kernel_unlock(&proc_lock);
+    return NOTHREAD;
+  }
 
   //Acquire a PTCB
   PTCB* ptcb = xmalloc(sizeof(PTCB)); //allocate space
@@ -39,6 +57,8 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
   
   //Wake up TCB
   wakeup(tcb);
+
+  kernel_unlock(&proc_lock);
 	return (Tid_t) ptcb;
 }
 
@@ -58,27 +78,31 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
 
   PTCB* ptcb = (PTCB*)tid;  //get the ptcb of the given thread
 
-  // Searches for this PTCB in the current process's list of PTCBs. If the PTCB isn't found, the function returns null
-  if (rlist_find(& CURPROC->ptcb_list, ptcb, NULL)==NULL) {
-    return -1;
-  }
- 
   //Can't join self
   if (tid == sys_ThreadSelf()) {
     return -1;
   }
+
+  kernel_lock(&proc_lock);
+
+  // Searches for this PTCB in the current process's list of PTCBs. If the PTCB isn't found, the function returns null
+  if (rlist_find(& CURPROC->ptcb_list, ptcb, NULL)==NULL) {
+    kernel_unlock(&proc_lock);
+    return -1;
+  }
   
   ptcb->refcount++; //refcount is increased since the given thread seems joinable
 
   //we need to wait until the given thread is exited or detached
   while(ptcb->exited == 0 && ptcb->detached == 0){
-    kernel_wait(& ptcb->exit_cv, SCHED_USER); 
+    kernel_wait(&proc_lock, & ptcb->exit_cv, SCHED_USER); 
   }
 
   ptcb->refcount--;
 
   //can't join if detached
   if(ptcb->detached == 1) {
+    kernel_unlock(&proc_lock);
     return -1;
   }
 
@@ -92,6 +116,8 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
     rlist_remove(&ptcb->ptcb_list_node);
     free(ptcb);
   }
+
+  kernel_unlock(&proc_lock);
 	return 0;
 }
 
@@ -104,13 +130,17 @@ int sys_ThreadDetach(Tid_t tid)
   //get the PTCB of the given thread
   PTCB* ptcb = (PTCB*)tid;
 
+  kernel_lock(&proc_lock);
+
   //if given PTCB does not exist in the current process the function fails
   if (rlist_find(& CURPROC->ptcb_list, ptcb, NULL)==NULL) {
+    kernel_unlock(&proc_lock);
     return -1;
   }
 
   //PTCB might have exited, function fails here too
   if(ptcb->exited == 1){
+    kernel_unlock(&proc_lock);
     return -1;
   }
 
@@ -120,6 +150,7 @@ int sys_ThreadDetach(Tid_t tid)
   //broadcast the exit_cv of the PTCB
   kernel_broadcast(&ptcb->exit_cv);
 
+  kernel_unlock(&proc_lock);
 	return 0;
 }
 
@@ -131,6 +162,8 @@ void sys_ThreadExit(int exitval)
   PCB* curproc = CURPROC;
   PTCB* ptcb = (PTCB*) sys_ThreadSelf();
 
+  kernel_lock(&proc_lock);
+
   curproc->thread_count--;  //thread count gets decreased since a thread exits
     /* 
     Here, we must check that we are not the init task. 
@@ -139,7 +172,9 @@ void sys_ThreadExit(int exitval)
   if(curproc->thread_count==0){
     if(get_pid(curproc)==1) {
 
+      kernel_unlock(&proc_lock);
       while(sys_WaitChild(NOPROC,NULL)!=NOPROC);
+      kernel_lock(&proc_lock);
 
     } else {
 
@@ -175,17 +210,17 @@ void sys_ThreadExit(int exitval)
 
     /* Release the args data */
     if(curproc->args) {
+      rwlock_write_lock(&pt_lock);
       free(curproc->args);
       curproc->args = NULL;
+      rwlock_write_unlock(&pt_lock);
     }
 
     /* Clean up FIDT */
-    for(int i=0;i<MAX_FILEID;i++) {
-      if(curproc->FIDT[i] != NULL) {
-        FCB_decref(curproc->FIDT[i]);
-        curproc->FIDT[i] = NULL;
-      }
-    }
+    FIDT_clear(curproc);
+
+    /* Leave the CPU group */
+    set_cpu_group(curproc, NULL);
 
     /* Disconnect my main_thread */
     curproc->main_thread = NULL; 
@@ -200,7 +235,73 @@ void sys_ThreadExit(int exitval)
     kernel_broadcast(&ptcb->exit_cv);
   
     /* Bye-bye cruel world */
-    kernel_sleep(EXITED, SCHED_USER);
+    kernel_sleep(&proc_lock, EXITED, SCHED_USER);
   
 }
 
+
+/**
+  @brief Set the cores the given thread may run on.
+  */
+int sys_SetAffinity(Tid_t tid, cpumask_t mask)
+{
+  PTCB* ptcb = (PTCB*)tid;
+  int ret = -1;
+
+  kernel_lock(&proc_lock);
+
+  //the thread must exist in the current process and not have exited
+  if (rlist_find(& CURPROC->ptcb_list, ptcb, NULL)!=NULL && ptcb->exited == 0) {
+    ret = set_affinity(ptcb->tcb, mask);
+  }
+
+  kernel_unlock(&proc_lock);
+  return ret;
+}
+
+/**
+  @brief Return the cores the given thread may run on.
+  */
+cpumask_t sys_GetAffinity(Tid_t tid)
+{
+  PTCB* ptcb = (PTCB*)tid;
+  cpumask_t mask = 0;
+
+  kernel_lock(&proc_lock);
+
+  //the thread must exist in the current process and not have exited
+  if (rlist_find(& CURPROC->ptcb_list, ptcb, NULL)!=NULL && ptcb->exited == 0) {
+    mask = ptcb->tcb->affinity;
+  }
+
+  kernel_unlock(&proc_lock);
+  return mask;
+}
+
+/**
+  @brief Make the given thread real-time, or return it to the MLFQ.
+  */
+int sys_SetRealtime(Tid_t tid, timeout_t runtime, timeout_t period, timeout_t deadline)
+{
+  PTCB* ptcb = (PTCB*)tid;
+  int ret = -1;
+
+  kernel_lock(&proc_lock);
+
+  //the thread must exist in the current process and not have exited
+  //the scheduler works in microseconds
+  if (rlist_find(& CURPROC->ptcb_list, ptcb, NULL)!=NULL && ptcb->exited == 0) {
+    ret = set_realtime(ptcb->tcb, runtime*1000ul, period*1000ul, deadline*1000ul);
+  }
+
+  kernel_unlock(&proc_lock);
+  return ret;
+}
+
+/**
+  @brief End the current job of the current real-time thread.
+  */
+int sys_WaitPeriod()
+{
+  return wait_period();
+}
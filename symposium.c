@@ -95,38 +95,38 @@ void SymposiumTable_philosopher(SymposiumTable* S, int i)
   int fmax = S->symp->fmax;
   PHIL* state = S->state;
 
-  Mutex_Lock(& S->mx);		/* Philosopher arrives in thinking state */
+  SleepMutex_Lock(& S->mx);		/* Philosopher arrives in thinking state */
   state[i] = THINKING;
   print_state(N, state, "     %d has arrived\n",i);
-  Mutex_Unlock(& S->mx);
+  SleepMutex_Unlock(& S->mx);
 
   for(int j=0; j<bites; j++) {	/* Number of bites (mpoykies) */
     think(fmin, fmax);
 
-    Mutex_Lock(& S->mx);
+    SleepMutex_Lock(& S->mx);
     state[i] = HUNGRY;
     trytoeat(S,i);		/* This may not succeed */
     while(state[i]==HUNGRY) {
       print_state(N, state, "     %d waits hungry\n",i);
-      Cond_Wait(& S->mx, &(S->hungry[i])); /* If hungry we sleep. trytoeat(i) will wake us. */
+      Cond_SleepWait(& S->mx, &(S->hungry[i])); /* If hungry we sleep. trytoeat(i) will wake us. */
     }
     assert(state[i]==EATING); 
-    Mutex_Unlock(& S->mx);
+    SleepMutex_Unlock(& S->mx);
     
     eat(fmin, fmax);
 
-    Mutex_Lock(& S->mx);
+    SleepMutex_Lock(& S->mx);
     state[i] = THINKING;	/* We are done eating, think again */
     print_state(N, state, "     %d is thinking\n",i);
     trytoeat(S, LEFT(i,N));		/* Check if our left and right can eat NOW. */
     trytoeat(S, RIGHT(i,N));
-    Mutex_Unlock(& S->mx);
+    SleepMutex_Unlock(& S->mx);
   }
 
-  Mutex_Lock(& S->mx);
+  SleepMutex_Lock(& S->mx);
   state[i] = NOTHERE;		/* We are done (eaten all the bites) */
   print_state(N, state, "     %d is leaving\n",i);
-  Mutex_Unlock(& S->mx);
+  SleepMutex_Unlock(& S->mx);
 }
 
 
@@ -134,7 +134,7 @@ void SymposiumTable_philosopher(SymposiumTable* S, int i)
 void SymposiumTable_init(SymposiumTable* table, symposium_t* symp)
 {
 	table->symp = symp;
-	table->mx = MUTEX_INIT;
+	table->mx = SLEEP_MUTEX_INIT;
 	table->state = (PHIL*) xmalloc(symp->N * sizeof(PHIL));
 	table->hungry = (CondVar*) xmalloc(symp->N * sizeof(CondVar));
 	for(int i=0; i<symp->N; i++) {
@@ -111,7 +111,7 @@ void adjust_symposium(symposium_t* table, int dBASE, int dGAP);
 	threads/processes.
 */
 typedef struct {
-	Mutex mx;			/**< Monitor mutex */
+	SleepMutex mx;		/**< Monitor mutex */
 	symposium_t* symp; 	/**< The symposium definition */
 	PHIL* state;		/**< state[i] i=1...N]: Philosopher state */
 	CondVar* hungry;    /**< hungry[i] i=...N: condition var for philosophers */
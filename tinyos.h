@@ -61,6 +61,14 @@ typedef uintptr_t Tid_t;
 /** @brief The invalid thread ID */
 #define NOTHREAD ((Tid_t)0)
 
+/**
+  @brief A set of cores, for thread affinity.
+
+  Bit @c c of the mask denotes core @c c.
+  @see SetAffinity
+  */
+typedef uint32_t cpumask_t;
+
 
 /*******************************************
  *      Concurrency control
@@ -72,11 +80,18 @@ typedef uintptr_t Tid_t;
     mutexes are suitable for use in user-space, as well as in the implementation 
     of the kernel.
 
+    A mutex locked in the preemptive domain records the thread that holds
+    it, so that the waiters can tell whether the owner is running.
+
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef struct {
+  char locked;          /**< Set while the mutex is locked */
+  unsigned char core;   /**< The core that @c owner locked the mutex on */
+  void* owner;          /**< The locking thread, or NULL if it cannot be preempted */
+} Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -86,13 +101,14 @@ typedef char Mutex;
    Mutex my_mutex = MUTEX_INIT;
   @endcode
  */
-#define MUTEX_INIT 0
+#define MUTEX_INIT ((Mutex){ 0, 0, NULL })
 
 
 /** @brief Lock a mutex.
 
   Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
+  in kernel-space (preemptive domain), the locking spins only while the owner of the
+  mutex is running on another core, and for no more than a few hundred times; else, it yields.
   In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
 
   @see Mutex
@@ -110,6 +126,57 @@ void Mutex_Lock(Mutex*);
 void Mutex_Unlock(Mutex*);
 
 
+/** @brief A ticket lock is a fair spinlock.
+
+  Each locker takes a ticket and waits until the ticket is served, so the
+  lock is granted in FIFO order. The waiters only read the lock while they
+  wait, and they back off in proportion to their place in the queue, so a
+  contended ticket lock does not turn into a storm of atomic writes the way
+  a @c Mutex does.
+
+  A ticket lock is held, and waited for, with preemption off, so it is
+  for short critical sections, such as the wait sets of condition
+  variables. The run queues of the scheduler are not guarded by ticket
+  locks: every core locks them at every context switch, and when the host
+  deschedules the core whose turn it is, every core behind it stalls too.
+
+  @see Ticket_Lock
+  @see Ticket_Unlock
+  @see TICKET_LOCK_INIT
+*/
+typedef struct {
+  unsigned int next;    /**< The next ticket to hand out */
+  unsigned int owner;   /**< The ticket being served */
+  int preempt;          /**< The preemption state of the holder, restored on unlock */
+} TicketLock;
+
+/**
+  @brief This macro is used to initialize ticket locks. 
+
+  @code
+   TicketLock my_lock = TICKET_LOCK_INIT;
+  @endcode
+ */
+#define TICKET_LOCK_INIT ((TicketLock){ 0, 0, 0 })
+
+/** @brief Lock a ticket lock.
+
+  Preemption is turned off until @c Ticket_Unlock, and the waiters spin
+  and are served in FIFO order. Since a holder cannot lose its core, a
+  waiter never waits for a thread that is not running.
+
+  @see TicketLock
+  @see Ticket_Unlock
+  */
+void Ticket_Lock(TicketLock*);
+
+/** @brief Unlock a ticket lock that you locked, serving the next ticket.
+    @see TicketLock
+    @see Ticket_Lock
+*/
+void Ticket_Unlock(TicketLock*);
+
+
 /** @brief Condition variables.
 
   A condition variable is used for longer synchronization. This implementation
@@ -122,7 +189,7 @@ void Mutex_Unlock(Mutex*);
  */
 typedef struct {
   void *waitset;        /**< The set of waiting threads */
-  Mutex waitset_lock;   /**< A mutex to protect `waitset` */
+  TicketLock waitset_lock;   /**< A lock to protect `waitset` */
 } CondVar;
 
 
@@ -133,7 +200,7 @@ typedef struct {
   CondVar my_cv = COND_INIT;
   @endcode
  */
-#define COND_INIT ((CondVar){ NULL, MUTEX_INIT })
+#define COND_INIT ((CondVar){ NULL, { 0, 0, 0 } })
 
 
 /** @brief Wait on a condition variable. 
@@ -202,6 +269,127 @@ void Cond_Signal(CondVar*);
 void Cond_Broadcast(CondVar*); 
 
 
+/** @brief A sleeping mutex.
+
+  Unlike a @c Mutex, a thread that finds a sleeping mutex locked does not
+  spin: it sleeps on the wait queue of the mutex, and the thread that 
+  unlocks it wakes it up. Locking and unlocking a free mutex takes a single
+  atomic operation each, as with a Linux futex. 
+
+  Use a sleeping mutex for locks that may be held for a long time, or by
+  many threads, so that the waiters do not burn their quantum spinning.
+  A sleeping mutex must not be used in the non-preemptive domain.
+
+  @see SleepMutex_Lock
+  @see SleepMutex_Unlock
+  @see Cond_SleepWait
+  @see SLEEP_MUTEX_INIT
+*/
+typedef struct {
+  int state;          /**< 0: unlocked, 1: locked, 2: locked and maybe with sleepers */
+  CondVar sleepers;   /**< The wait queue */
+} SleepMutex;
+
+/** @brief This macro is used to initialize sleeping mutexes. 
+
+  @code
+   SleepMutex my_mutex = SLEEP_MUTEX_INIT;
+  @endcode
+ */
+#define SLEEP_MUTEX_INIT ((SleepMutex){ 0, { NULL, { 0, 0, 0 } } })
+
+/** @brief Lock a sleeping mutex, sleeping as long as it is locked.
+  @see SleepMutex
+  */
+void SleepMutex_Lock(SleepMutex*);
+
+/** @brief Unlock a sleeping mutex that you locked, waking up a sleeper.
+  @see SleepMutex
+  */
+void SleepMutex_Unlock(SleepMutex*);
+
+/** @brief Wait on a condition variable, with a sleeping mutex. 
+
+  This is the same as @c Cond_Wait, for a monitor whose mutex is a
+  @c SleepMutex.
+  @see Cond_Wait
+  */
+int Cond_SleepWait(SleepMutex* mx, CondVar* cv);
+
+/** @brief Wait on a condition variable with a timeout, with a sleeping mutex. 
+
+  This is the same as @c Cond_TimedWait, for a monitor whose mutex is a
+  @c SleepMutex.
+  @see Cond_TimedWait
+  */
+int Cond_SleepTimedWait(SleepMutex* mx, CondVar* cv, timeout_t timeout);
+
+
+/** @brief The number of reader counters of a reader-writer lock. 
+
+  This must be no smaller than the number of cores.
+*/
+#define RWLOCK_SLOTS 32
+
+/** @brief A reader-writer lock.
+
+  Many readers may hold a reader-writer lock at the same time, or else a 
+  single writer. Each core has its own counter of readers, in a cache line
+  of its own, so readers on different cores do not write to the same
+  memory. A writer raises the @c writer flag and waits for the readers
+  to leave; new readers give way to it, so writers are not starved. 
+
+  A reader-writer lock suits read-mostly data. A writer pays for the
+  scalability of the readers, as it has to scan every counter. The lock
+  is not recursive: a reader that locks again while a writer waits will
+  deadlock.
+
+  @see RWLock_ReadLock
+  @see RWLock_WriteLock
+  @see RWLOCK_INIT
+*/
+typedef struct {
+  struct {
+    int count;          /**< Readers that locked on this core, less those that unlocked on it */
+    char pad[60];       /**< Keep each counter in a cache line of its own */
+  } readers[RWLOCK_SLOTS];
+  int writer;           /**< Set while a writer holds the lock or waits for the readers */
+  Mutex writers;        /**< Serializes the writers */
+} RWLock;
+
+/** @brief This macro is used to initialize reader-writer locks. 
+
+  @code
+   RWLock my_lock = RWLOCK_INIT;
+  @endcode
+ */
+#define RWLOCK_INIT ((RWLock){ { { 0 } }, 0, { 0, 0, NULL } })
+
+/** @brief Lock a reader-writer lock for reading. 
+
+  The caller waits as long as a writer holds the lock or waits for it.
+  @see RWLock
+  */
+void RWLock_ReadLock(RWLock* rw);
+
+/** @brief Unlock a reader-writer lock that you locked for reading.
+  @see RWLock
+  */
+void RWLock_ReadUnlock(RWLock* rw);
+
+/** @brief Lock a reader-writer lock for writing. 
+
+  The caller waits for the other writers, and then for the readers to leave.
+  @see RWLock
+  */
+void RWLock_WriteLock(RWLock* rw);
+
+/** @brief Unlock a reader-writer lock that you locked for writing.
+  @see RWLock
+  */
+void RWLock_WriteUnlock(RWLock* rw);
+
+
 /*******************************************
  *
  * Process creation
@@ -241,6 +429,38 @@ typedef int (*Task)(int, void*);
 Pid_t Exec(Task task, int argl, void* args);
 
 
+/** @brief The minimum stack size (in bytes) for @c ExecEx and @c CreateThreadEx */
+#define MIN_STACK_SIZE (16 * 1024)
+
+/** @brief The maximum stack size (in bytes) for @c ExecEx and @c CreateThreadEx */
+#define MAX_STACK_SIZE (64 * 1024 * 1024)
+
+/** @brief Create a new process, whose main thread has the given stack size.
+
+  This call is the same as @c Exec, except that the stack of the main
+  thread of the new process is @c stack_size bytes. The stack size is
+  rounded up to a whole number of memory pages. A @c stack_size of 0
+  selects the default stack size (as for @c Exec).
+
+  The stack is followed by a guard page, so that a stack overflow
+  is detected as a memory fault. Stack memory is only committed when
+  used, so large stacks are cheap if they are mostly untouched.
+
+  @param task the main function  of the new process
+  @param argl the length of byte array @c args
+  @param args the byte array copied as argument to `task`
+  @param stack_size the size of the stack of the main thread, or 0
+  @return On success, the pid of the new process is returned.
+    On error, NOPROC is returned.
+     Possible errors:
+   -  The maximum number of processes has been reached.
+   -  @c stack_size is not 0, and not between @c MIN_STACK_SIZE 
+      and @c MAX_STACK_SIZE.
+  @see Exec
+  */
+Pid_t ExecEx(Task task, int argl, void* args, unsigned int stack_size);
+
+
 /** @brief Exit the current process.
 
   When this function is called by a process thread, the process terminates
@@ -291,6 +511,109 @@ Pid_t GetPid(void);
  */
 Pid_t GetPPid(void);
 
+/** @brief The CPU weight of the init process (see @ref SetWeight). */
+#define DEFAULT_WEIGHT 1024
+
+/** @brief The largest CPU weight of a process. */
+#define MAX_WEIGHT (1024*DEFAULT_WEIGHT)
+
+/**
+  @brief Set the CPU weight of a process.
+
+  Under the fair scheduling policy (see @ref set_sched_policy), the
+  processes with threads ready to run on a core share its time in
+  proportion to their weights, no matter how many threads each one
+  has; the threads of a process share the time of the process equally.
+  The other policies ignore weights.
+
+  A new process inherits the weight of its parent.
+
+  @param pid the process, which must be the caller or one of its children
+  @param weight the new weight, from 1 to @c MAX_WEIGHT
+  @returns 0 on success and -1 on error. Possible errors are:
+    - the process is neither the caller nor a child of the caller.
+    - the process has exited.
+    - the weight is out of range.
+  @see GetWeight
+  */
+int SetWeight(Pid_t pid, unsigned int weight);
+
+/**
+  @brief Return the CPU weight of a process.
+
+  @param pid the process, which must be the caller or one of its children
+  @returns the weight of the process, or 0 on error. Possible errors are:
+    - the process is neither the caller nor a child of the caller.
+    - the process has exited.
+  @see SetWeight
+  */
+unsigned int GetWeight(Pid_t pid);
+
+/**
+  @brief Put a process in gang mode, or take it out.
+
+  The ready threads of a process in gang mode are dispatched together:
+  when one of them starts running, the others preempt the threads of
+  other processes on as many cores as they can use, for a quantum. This
+  helps threads that synchronize often, e.g., with @c BarrierSync,
+  which otherwise stall whenever one of them waits for a core. After
+  its quantum, a gang is not favoured for a quantum, so that it cannot
+  starve other processes.
+
+  A new process is not in gang mode.
+
+  @param pid the process, which must be the caller or one of its children
+  @param gang non-zero to enter gang mode, 0 to leave it
+  @returns 0 on success and -1 on error. Possible errors are:
+    - the process is neither the caller nor a child of the caller.
+    - the process has exited.
+  */
+int SetGang(Pid_t pid, int gang);
+
+/** @brief The id of no CPU group (see @ref SetCpuGroup). */
+#define NOGROUP 0
+
+/** @brief The max. number of CPU groups, plus one for @c NOGROUP. */
+#define MAX_CPU_GROUPS 16
+
+/**
+  @brief Create a CPU group.
+
+  The processes of a CPU group may use at most @c quota msec of CPU
+  time, in total, in every @c period msec, even when cores are idle.
+  When the quota of a period is used up, the threads of the group are
+  throttled until the next period starts. A quota larger than the
+  period allows a group to use more than one core.
+
+  Real-time threads (see @ref SetRealtime) are not throttled.
+
+  CPU groups last until the kernel shuts down.
+
+  @param quota the CPU time per period
+  @param period the period
+  @returns the id of the new group, or -1 on error. Possible errors are:
+    - @c quota or @c period is 0.
+    - @c MAX_CPU_GROUPS - 1 groups have been created already.
+  @see SetCpuGroup
+  @see OpenGroupInfo
+  */
+int CreateCpuGroup(timeout_t quota, timeout_t period);
+
+/**
+  @brief Move a process to a CPU group.
+
+  A new process starts in the group of its parent.
+
+  @param pid the process, which must be the caller or one of its children
+  @param group the group, or @c NOGROUP to take the process out of its group
+  @returns 0 on success and -1 on error. Possible errors are:
+    - the process is neither the caller nor a child of the caller.
+    - the process has exited.
+    - @c group has not been created.
+  @see CreateCpuGroup
+  */
+int SetCpuGroup(Pid_t pid, int group);
+
 /*******************************************
  *
  * Threads
@@ -319,6 +642,31 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** 
+  @brief Create a new thread in the current process, with the given stack size.
+
+  This call is the same as @c CreateThread, except that the stack of the 
+  new thread is @c stack_size bytes. The stack size is rounded up to a
+  whole number of memory pages. A @c stack_size of 0 selects the default
+  stack size (as for @c CreateThread).
+
+  The stack is followed by a guard page, so that a stack overflow
+  is detected as a memory fault. Stack memory is only committed when
+  used, so large stacks are cheap if they are mostly untouched.
+
+  @param task a function to execute
+  @param argl an integer argument passed to `task`
+  @param args a pointer argument passed to `task`
+  @param stack_size the size of the stack of the new thread, or 0
+  @returns the tid of the new thread, or @c NOTHREAD on error. Possible
+    errors are:
+    - @c task is NULL.
+    - @c stack_size is not 0, and not between @c MIN_STACK_SIZE 
+      and @c MAX_STACK_SIZE.
+  @see CreateThread
+  */
+Tid_t CreateThreadEx(Task task, int argl, void* args, unsigned int stack_size);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -374,6 +722,84 @@ int ThreadDetach(Tid_t tid);
   */
 void ThreadExit(int exitval);
 
+/**
+  @brief Set the cores that the given thread may run on.
+
+  After this call, thread @c tid is only scheduled on the cores in
+  @c mask. Bits of cores that do not exist are ignored. If the thread
+  is running on a core outside @c mask, it moves within a quantum; if
+  the caller changes its own affinity, it moves before this call returns.
+
+  New threads (and the main threads of new processes) inherit the
+  affinity of the thread that created them. Initially, a thread may
+  run on all cores.
+
+  @param tid the thread, which must belong to the current process
+  @param mask the set of cores allowed
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+    - @c mask contains no existing core.
+    - the thread is real-time, and @c mask does not contain the core
+      it is admitted on (see @ref SetRealtime).
+  @see GetAffinity
+  */
+int SetAffinity(Tid_t tid, cpumask_t mask);
+
+/**
+  @brief Return the cores that the given thread may run on.
+
+  @param tid the thread, which must belong to the current process
+  @returns the set of existing cores that the thread may run on, or
+    0 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+  @see SetAffinity
+  */
+cpumask_t GetAffinity(Tid_t tid);
+
+/**
+  @brief Make the given thread real-time, or return it to normal scheduling.
+
+  A real-time thread runs periodic jobs: a job is released every
+  @c period msec, and needs up to @c runtime msec of CPU time within
+  @c deadline msec of its release. The first job is released at once;
+  the thread ends each job by calling @ref WaitPeriod.
+
+  Real-time threads run before all other threads, earliest deadline
+  first. Each is admitted on one core in its affinity, and only runs
+  there. A thread is rejected if no such core has enough spare
+  capacity to meet all the deadlines of its real-time threads. A thread
+  that runs for more than @c runtime in a job may not delay the other
+  real-time threads; it continues with a later deadline.
+
+  Real-time scheduling is not inherited by new threads.
+
+  @param tid the thread, which must belong to the current process
+  @param runtime the CPU time per job, or 0 to return to normal scheduling
+  @param period the time between job releases
+  @param deadline the time after its release by which a job must complete
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+    - it is not the case that @c runtime <= @c deadline <= @c period.
+    - no core in the affinity of the thread can admit it.
+  @see WaitPeriod
+  */
+int SetRealtime(Tid_t tid, timeout_t runtime, timeout_t period, timeout_t deadline);
+
+/**
+  @brief End the current job of the calling real-time thread.
+
+  The caller sleeps until its next job is released, one period after
+  the release of the current job (or at once, if that time has passed).
+
+  @returns 1 if the job that ended missed its deadline, 0 if it did not,
+    and -1 if the caller is not real-time.
+  @see SetRealtime
+  */
+int WaitPeriod(void);
+
 
 
 /*******************************************
@@ -723,6 +1149,10 @@ typedef struct procinfo
   int alive;      /**< @brief Non-zero if process is alive, zero if process is zombie. */
 	
   unsigned long thread_count; /**< Current no of threads. */
+
+  unsigned long migrations; /**< @brief Times a thread of the process resumed on a different core. */
+
+  int cpu_group;   /**< @brief The CPU group of the process, or @c NOGROUP. */
 	
   Task main_task;  /**< @brief The main task of the process. */
 	
@@ -760,6 +1190,41 @@ typedef struct procinfo
 Fid_t OpenInfo();
 
 
+/**
+	@brief A struct containing information about a CPU group.
+
+	This structure is returned by group information streams.
+	@see OpenGroupInfo
+  */
+typedef struct cpugroupinfo
+{
+	int group;          /**< @brief The id of the group. */
+	timeout_t quota;    /**< @brief The CPU time of the group per period. */
+	timeout_t period;   /**< @brief The period of the group. */
+	unsigned long procs; /**< @brief The live processes in the group. */
+	unsigned long throttled_periods; /**< @brief The periods in which the group used up its quota. */
+	timeout_t throttled_time; /**< @brief The total time the group has been throttled. */
+} cpugroupinfo;
+
+
+/**
+	@brief Open a CPU group information stream.
+
+	This is a read-only stream that returns a sequence of
+	@c cpugroupinfo structures, one for each CPU group created,
+	each packed into a block of size @c sizeof(cpugroupinfo).
+
+	As with @ref OpenInfo, there is no guarantee of the timeliness
+	of the information.
+
+	@returns a file id on success, or NOFILE on error. Possible reasons
+		for error are:
+		- the available file ids for the process are exhausted.
+	@see CreateCpuGroup
+ */
+Fid_t OpenGroupInfo();
+
+
 
 
 /*******************************************
@@ -780,6 +1245,86 @@ Fid_t OpenInfo();
    */
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
+/** @brief Select the scheduling policy of tinyos3.
+
+   This must be called before @c boot(); the policy stays in force for
+   subsequent boots. The policies are
+   - @c "mlfq": a multi-level feedback queue (the default)
+   - @c "rr": round-robin
+   - @c "fair": the thread that has used the least CPU time runs next;
+     processes share the CPU by weight (see @ref SetWeight)
+
+   Real-time threads (see @ref SetRealtime) run before all others,
+   whatever the policy.
+
+   @param name the name of the policy
+   @returns 0 on success, or -1 if there is no policy with this name
+   */
+int set_sched_policy(const char* name);
+
+/** @brief Set the aging period of the @c "mlfq" scheduling policy.
+
+   A thread that waits for a core moves up one priority level for
+   every aging period it waits, scaled by the time slice of its level
+   to that of the standard quantum (see @c set_sched_quanta()). A
+   shorter period protects low-priority threads from starvation
+   better, at the expense of threads at high priority. The default is 10 msec.
+
+   This must be called before @c boot(); the period stays in force for
+   subsequent boots.
+
+   @param period the aging period, in msec
+   @returns 0 on success, or -1 if @c period is 0
+   */
+int set_sched_aging(timeout_t period);
+
+/** @brief Set the time slices of the @c "mlfq" scheduling policy.
+
+   Each priority level has its own time slice, from @c top msec at the
+   highest level to @c bottom msec at the lowest, interpolated linearly
+   in between. Longer slices at low priority let CPU-bound threads
+   switch less often. A thread that becomes ready at a higher level
+   than the running thread cuts a long slice short, so it does not wait
+   longer than with the standard quantum. The default is 5 msec at the
+   top and 50 msec at the bottom.
+
+   This must be called before @c boot(); the slices stay in force for
+   subsequent boots.
+
+   @param top the time slice of the highest level, in msec
+   @param bottom the time slice of the lowest level, in msec
+   @returns 0 on success, or -1 if either slice is 0
+   */
+int set_sched_quanta(timeout_t top, timeout_t bottom);
+
+/** @brief Select how the scheduler programs the timer of each core.
+
+   By default, the timer is programmed lazily: only when the scheduler
+   needs an earlier alarm than the one that is set. Otherwise, it is
+   programmed for every time slice, which costs a host system call per
+   context switch; this is only useful to measure the difference.
+
+   This must be called before @c boot(); the choice stays in force for
+   subsequent boots.
+
+   @param lazy non-zero to program the timer lazily (the default)
+   */
+void set_sched_lazy_timer(int lazy);
+
+/** @brief Limit the memory blocks of threads, for testing.
+
+   Each thread takes a block for its TCB and stack, and the cores keep
+   the blocks of released threads for reuse. With a limit, allocating a
+   block beyond it fails as if the host had refused the memory, so
+   @c CreateThread returns @c NOTHREAD and @c Exec returns @c NOPROC.
+   The default is 0, for no limit.
+
+   The limit stays in force for subsequent boots.
+
+   @param limit the most blocks held at a time, or 0 for no limit
+   */
+void set_thread_alloc_limit(unsigned int limit);
+
 
 /** @} */
 
@@ -835,6 +835,9 @@ static struct argp_option options [] = {
 	{"list", 'l', 0, 0, "Show a list of available tests" },
 	{"verbose", 'v', 0, 0, "Be verbose: show test descriptions"},
 	{"nocolor", 'n', 0, 0, "Do not color the output"},
+	{"policy", 'p', "<policy>", 0, "Scheduling policy: mlfq (default), rr or fair" },
+	{"aging", 'a', "<msec>", 0, "Aging period of the mlfq scheduling policy" },
+	{"quanta", 'q', "<top>,<bottom>", 0, "Time slices (msec) of the top and bottom levels of the mlfq scheduling policy" },
 	{ NULL }
 };
 
@@ -948,6 +951,23 @@ parse_options(int key, char *arg, struct argp_state *state)
 				argp_error(state, "Error in parsing list of terminals: %s\n",arg);				
 			break;
 
+		case 'p':
+			if(set_sched_policy(arg) != 0)
+				argp_error(state, "Unknown scheduling policy: %s\n",arg);
+			break;
+
+		case 'a':
+			if(set_sched_aging(strtoul(arg, NULL, 10)) != 0)
+				argp_error(state, "Bad aging period: %s\n",arg);
+			break;
+
+		case 'q': {
+			unsigned long top, bottom;
+			if(sscanf(arg, "%lu,%lu", &top, &bottom) != 2 || set_sched_quanta(top, bottom) != 0)
+				argp_error(state, "Bad time slices: %s\n",arg);
+			break;
+		}
+
 		case ARGP_KEY_ARG:
 			if(ARGS.ntests >= MAX_TESTS) {
 				argp_error(state, "Number of tests too large (maximum=%d)",MAX_TESTS);
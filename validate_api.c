@@ -69,6 +69,114 @@ BARE_TEST(test_boot,
 }
 
 
+BARE_TEST(test_sched_policies,
+	"Test that the kernel boots and runs a symposium of threads under every\n"
+	"scheduling policy, and that unknown policies are rejected.")
+{
+	/* The default comes last, so that it stays in force */
+	const char* policies[] = { "rr", "fair", "mlfq" };
+
+	ASSERT(set_sched_policy("no such policy") == -1);
+
+	for(int i=0; i<3; i++) {
+		symposium_t symp = { .N = 5, .bites = 5 };
+		adjust_symposium(&symp, 0, -5);
+
+		ASSERT(set_sched_policy(policies[i]) == 0);
+		boot(2, 0, SymposiumOfThreads, sizeof(symp), &symp);
+	}
+}
+
+
+/* Busy threads of two processes, counting their progress in work[] */
+static struct {
+	volatile int stop;
+	volatile unsigned long work[9];
+} share;
+
+static int share_spinner(int argl, void* args)
+{
+	while(! share.stop)
+		share.work[argl]++;
+	return 0;
+}
+
+/* Run threads first, ..., first+n-1, where args = { first, n } */
+static int share_process(int argl, void* args)
+{
+	int first = ((int*)args)[0], n = ((int*)args)[1];
+	Tid_t t[n];
+	for(int i=0; i<n; i++)
+		t[i] = CreateThread(share_spinner, first+i, NULL);
+	for(int i=0; i<n; i++)
+		ThreadJoin(t[i], NULL);
+	return 0;
+}
+
+static unsigned long share_sum(int first, int n)
+{
+	unsigned long sum = 0;
+	for(int i=first; i<first+n; i++)
+		sum += share.work[i];
+	return sum;
+}
+
+static void share_sleep(timeout_t msec)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, msec);
+	Mutex_Unlock(&mx);
+}
+
+/* Measure the progress of the 8 threads of one process and the 1 of another */
+static void share_measure(unsigned long* many, unsigned long* one)
+{
+	*many = share_sum(0, 8);
+	*one = share_sum(8, 1);
+	share_sleep(300);
+	*many = share_sum(0, 8) - *many;
+	*one = share_sum(8, 1) - *one;
+}
+
+static int share_by_weight(int argl, void* args)
+{
+	int many[2] = { 0, 8 }, one[2] = { 8, 1 };
+	share.stop = 0;
+	Pid_t pmany = Exec(share_process, sizeof(many), many);
+	Pid_t pone = Exec(share_process, sizeof(one), one);
+	unsigned long wmany, wone;
+
+	/* With equal weights, the thread count does not matter */
+	share_sleep(50);
+	share_measure(&wmany, &wone);
+	ASSERT(wmany < 2*wone && wone < 2*wmany);
+
+	/* The process with the larger weight gets more */
+	ASSERT(SetWeight(pone, 4*DEFAULT_WEIGHT) == 0);
+	share_sleep(50);
+	share_measure(&wmany, &wone);
+	ASSERT(wone > 2*wmany);
+
+	share.stop = 1;
+	ASSERT(WaitChild(pmany, NULL) == pmany);
+	ASSERT(WaitChild(pone, NULL) == pone);
+	return 0;
+}
+
+BARE_TEST(test_fair_share_between_processes,
+	"Test that the fair policy shares a core between processes by weight,\n"
+	"and not by their number of threads.")
+{
+	ASSERT(set_sched_policy("fair") == 0);
+	boot(1, 0, share_by_weight, 0, NULL);
+
+	/* Restore the default */
+	ASSERT(set_sched_policy("mlfq") == 0);
+}
+
+
 
 
 /*********************************************
@@ -329,6 +437,54 @@ static int dying_child(int arg, void* args)
 }
 
 
+/* Wait for a byte on the pipe whose read end is argl */
+static int reading_child(int argl, void* args)
+{
+	char c;
+	ASSERT(Read(argl, &c, 1) == 1);
+	return 0;
+}
+
+BOOT_TEST(test_weight_get_set,
+	"Test that SetWeight and GetWeight work on the caller and its children, and fail on bad arguments"
+	)
+{
+	Pid_t self = GetPid();
+	ASSERT(GetWeight(self) == DEFAULT_WEIGHT);
+
+	ASSERT(SetWeight(self, 1) == 0);
+	ASSERT(GetWeight(self) == 1);
+	ASSERT(SetWeight(self, MAX_WEIGHT) == 0);
+	ASSERT(GetWeight(self) == MAX_WEIGHT);
+
+	/* Bad weights do not change the weight */
+	ASSERT(SetWeight(self, 0) == -1);
+	ASSERT(SetWeight(self, MAX_WEIGHT+1) == -1);
+	ASSERT(GetWeight(self) == MAX_WEIGHT);
+
+	/* A child inherits the weight, and its parent may change it */
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe) == 0);
+	Pid_t child = Exec(reading_child, pipe.read, NULL);
+	ASSERT(GetWeight(child) == MAX_WEIGHT);
+	ASSERT(SetWeight(child, 7) == 0);
+	ASSERT(GetWeight(child) == 7);
+
+	/* Bad pids */
+	ASSERT(SetWeight(NOPROC, 1) == -1);
+	ASSERT(GetWeight(NOPROC) == 0);
+	ASSERT(SetWeight(MAX_PROC, 1) == -1);
+	ASSERT(GetWeight(GetPPid()) == 0);
+
+	ASSERT(Write(pipe.write, "x", 1) == 1);
+	ASSERT(WaitChild(child, NULL) == child);
+
+	/* An exited process has no weight */
+	ASSERT(GetWeight(child) == 0);
+	return 0;
+}
+
+
 BOOT_TEST(test_orphans_adopted_by_init,
 	"Test that when a process exits leaving orphans, init becomes the new parent."
 	)
@@ -378,6 +534,41 @@ static unsigned long tspec2msec(struct timespec t)
 }
 
 
+static void* mutex_owner_seen;
+
+static int mutex_owner_task(int argl, void* args) {
+	Mutex* mx = args;
+	Mutex_Lock(mx);
+	mutex_owner_seen = mx->owner;
+	Mutex_Unlock(mx);
+	return 0;
+}
+
+BOOT_TEST(test_mutex_records_owner,
+	"Test that a mutex records the thread holding it, keeps it while that thread sleeps,\n"
+	"and records the waiter that gets it next."
+	)
+{
+	Mutex mx = MUTEX_INIT;
+
+	Mutex_Lock(&mx);
+	void* owner = mx.owner;
+	ASSERT(owner != NULL);
+	Mutex_Unlock(&mx);
+	ASSERT(mx.owner == NULL);
+
+	/* The owner stays recorded while it sleeps holding the mutex */
+	Mutex_Lock(&mx);
+	Tid_t t = CreateThread(mutex_owner_task, 0, &mx);
+	share_sleep(50);
+	ASSERT(mx.owner == owner);
+	Mutex_Unlock(&mx);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(mutex_owner_seen != NULL && mutex_owner_seen != owner);
+	return 0;
+}
+
+
 static int do_timeout(int argl, void* args) {
 	timeout_t t = *((timeout_t *) args);
 
@@ -510,6 +701,48 @@ BOOT_TEST(test_cond_timedwait_broadcast,
 
 
 
+/*
+	Test that many concurrent timed waits, with timeouts spread over a wide
+	range, each terminate close to their own timeout.
+ */
+
+static int many_timeouts_thread(int argl, void* args)
+{
+	timeout_t t = argl;
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	struct timespec t1, t2;
+	clock_gettime(CLOCK_REALTIME, &t1);
+
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, t);
+
+	clock_gettime(CLOCK_REALTIME, &t2);
+
+	long Dt = tspec2msec(t2)-tspec2msec(t1);
+
+	/* The kernel clock is coarse, allow a few msec early, and 20% late */
+	ASSERT_MSG(Dt+5 >= t && Dt <= t + t/5 + 50, "timeout %lu: woke up after %ld msec\n", t, Dt);
+	return 0;
+}
+
+BOOT_TEST(test_cond_timedwait_many_timeouts,
+	"Test that many concurrent timed waits on condition variables terminate after their own timeout."
+	)
+{
+	const int N=200;
+	Tid_t tids[N];
+
+	for(int i=0; i<N; i++)
+		tids[i] = CreateThread(many_timeouts_thread, 1 + (i*37) % 1500, NULL);
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	return 0;
+}
+
+
 /*********************************************
  *
  *
@@ -586,6 +819,46 @@ BOOT_TEST(test_close_success_on_valid_nonfile_fid,
 	return 0;
 }
 
+static volatile int failed_opens_done;
+
+static int failed_opens_task(int argl, void* args)
+{
+	for(int i=0; i<20000; i++)
+		ASSERT(OpenTerminal(MAX_TERMINALS+1)==NOFILE);
+	failed_opens_done = 1;
+	return 0;
+}
+
+BOOT_TEST(test_failed_open_races_with_close,
+	"Test that a failed open does not corrupt the file table, while another\n"
+	"thread reads from and closes the fid it reserved."
+	)
+{
+	for(Fid_t i=0; i<MAX_FILEID; i++)
+		ASSERT(Close(i)==0);
+
+	failed_opens_done = 0;
+	Tid_t t = CreateThread(failed_opens_task, 0, NULL);
+	char c;
+	while(! failed_opens_done) {
+		ASSERT(Read(0, &c, 0) == -1);
+		ASSERT(Close(0) == 0);
+	}
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* Every fid can still be opened, to a distinct file */
+	Fid_t fid[MAX_FILEID];
+	for(int i=0; i<MAX_FILEID; i++)
+		ASSERT((fid[i] = OpenNull()) != NOFILE);
+	ASSERT(OpenNull() == NOFILE);
+	pipe_t pipe;
+	for(int i=0; i<MAX_FILEID; i++)
+		ASSERT(Close(fid[i]) == 0);
+	ASSERT(Pipe(&pipe) == 0);
+	ASSERT(Write(pipe.write, "x", 1) == 1 && Read(pipe.read, &c, 1) == 1 && c == 'x');
+	return 0;
+}
+
 BOOT_TEST(test_close_terminals,
 	"Test that terminals can be opened and then closed without error."
 	)
@@ -760,6 +1033,39 @@ BOOT_TEST(test_child_inherits_files,
 
 
 
+static int procinfo_child(int argl, void* args) { return 0; }
+
+BOOT_TEST(test_procinfo_lists_processes,
+	"Test that OpenInfo lists live processes with their arguments, and zombies."
+	)
+{
+	int arg = 42;
+	Pid_t child = Exec(procinfo_child, sizeof(arg), &arg);
+	ASSERT(child != NOPROC);
+	share_sleep(50);		/* the child is now a zombie */
+
+	Fid_t info = OpenInfo();
+	ASSERT(info != NOFILE);
+
+	procinfo pi;
+	int seen_me = 0, seen_child = 0;
+	while(Read(info, (char*)&pi, sizeof(pi)) == sizeof(pi)) {
+		if(pi.pid == GetPid()) {
+			seen_me = 1;
+			ASSERT(pi.alive);
+		}
+		if(pi.pid == child) {
+			seen_child = 1;
+			ASSERT(!pi.alive && pi.ppid == GetPid());
+		}
+	}
+	ASSERT(Close(info) == 0);
+	ASSERT(seen_me && seen_child);
+	ASSERT(WaitChild(child, NULL) == child);
+	return 0;
+}
+
+
 BOOT_TEST(test_null_device,
 	"Test the null device."
 	)
@@ -908,6 +1214,8 @@ TEST_SUITE(basic_tests,
 	)
 {
 	&test_boot,
+	&test_sched_policies,
+	&test_fair_share_between_processes,
 	&test_pid_of_init_is_one,
 	&test_waitchild_error_on_nonchild,
 	&test_waitchild_error_on_invalid_pid,
@@ -916,10 +1224,14 @@ TEST_SUITE(basic_tests,
 	&test_exit_returns_status,
 	&test_main_return_returns_status,
 	&test_wait_for_any_child,
+	&test_weight_get_set,
 	&test_orphans_adopted_by_init,
+	&test_mutex_records_owner,
 	&test_cond_timedwait_timeout,
 	&test_cond_timedwait_signal,
 	&test_cond_timedwait_broadcast,
+	&test_cond_timedwait_many_timeouts,
+	&test_procinfo_lists_processes,
 	&test_null_device,
 	&test_get_terminals,
 	&test_open_terminals,
@@ -928,6 +1240,7 @@ TEST_SUITE(basic_tests,
 	&test_dup2_copies_file,
 	&test_close_error_on_invalid_fid,
 	&test_close_success_on_valid_nonfile_fid,
+	&test_failed_open_races_with_close,
 	&test_close_terminals,
 	&test_read_kbd,
 	&test_read_kbd_big,
@@ -1064,6 +1377,568 @@ BOOT_TEST(test_create_join_thread,
 	return 0;
 }
 
+/* Use (touch) argl bytes of stack, and return a checksum */
+static int use_stack_task(int argl, void* args) {
+	volatile char buf[argl];
+	for(int i=0; i<argl; i++) buf[i] = (char) i;
+	int sum = 0;
+	for(int i=0; i<argl; i+=4096) sum += buf[i];
+	return sum;
+}
+
+static int use_stack_checksum(int argl) {
+	int sum = 0;
+	for(int i=0; i<argl; i+=4096) sum += (char) i;
+	return sum;
+}
+
+BOOT_TEST(test_create_thread_ex_stack_sizes,
+	"Test that threads can be created with various stack sizes, and use most of their stack."
+	)
+{
+	struct { unsigned int stack_size; int use; } cases[] = {
+		{ 0, 64*1024 },
+		{ MIN_STACK_SIZE, MIN_STACK_SIZE/2 },
+		{ MIN_STACK_SIZE+1, MIN_STACK_SIZE/2 },
+		{ 1024*1024, 1000*1024 },
+		{ MAX_STACK_SIZE, 32*1024*1024 }
+	};
+
+	for(unsigned int i=0; i < sizeof(cases)/sizeof(cases[0]); i++) {
+		Tid_t t = CreateThreadEx(use_stack_task, cases[i].use, NULL, cases[i].stack_size);
+		ASSERT(t!=NOTHREAD);
+		int exitval;
+		ASSERT(ThreadJoin(t, &exitval)==0);
+		ASSERT(exitval == use_stack_checksum(cases[i].use));
+	}
+	return 0;
+}
+
+
+BOOT_TEST(test_create_thread_ex_fails_on_illegal_size,
+	"Test that CreateThreadEx and ExecEx fail on illegal stack sizes."
+	)
+{
+	ASSERT(CreateThreadEx(use_stack_task, 0, NULL, MIN_STACK_SIZE-1)==NOTHREAD);
+	ASSERT(CreateThreadEx(use_stack_task, 0, NULL, MAX_STACK_SIZE+1)==NOTHREAD);
+	ASSERT(CreateThreadEx(NULL, 0, NULL, MIN_STACK_SIZE)==NOTHREAD);
+	ASSERT(ExecEx(use_stack_task, 0, NULL, 1)==NOPROC);
+	ASSERT(ExecEx(use_stack_task, 0, NULL, MAX_STACK_SIZE+1)==NOPROC);
+	return 0;
+}
+
+
+BOOT_TEST(test_exec_ex_stack_size,
+	"Test that a process can be created with a given main thread stack size."
+	)
+{
+	int status;
+	Pid_t pid = ExecEx(use_stack_task, MIN_STACK_SIZE/2, NULL, MIN_STACK_SIZE);
+	ASSERT(pid!=NOPROC);
+	ASSERT(WaitChild(pid, &status)==pid);
+	ASSERT(status == use_stack_checksum(MIN_STACK_SIZE/2));
+	return 0;
+}
+
+
+struct many_small_stacks {
+	Mutex mx;
+	CondVar arrived, go;
+	int count;
+};
+
+static int many_small_stacks_task(int argl, void* args) {
+	struct many_small_stacks *A = args;
+	Mutex_Lock(&A->mx);
+	A->count++;
+	Cond_Signal(&A->arrived);
+	while(A->count >= 0)
+		Cond_Wait(&A->mx, &A->go);
+	Mutex_Unlock(&A->mx);
+	return argl;
+}
+
+BOOT_TEST(test_many_small_stack_threads,
+	"Test that many threads with small stacks can exist at the same time.",
+	.timeout = 60
+	)
+{
+	const int N = 5000;
+	Tid_t* tids = malloc(N*sizeof(Tid_t));
+	struct many_small_stacks A = { MUTEX_INIT, COND_INIT, COND_INIT, 0 };
+
+	for(int i=0; i<N; i++) {
+		tids[i] = CreateThreadEx(many_small_stacks_task, i, &A, MIN_STACK_SIZE);
+		ASSERT(tids[i]!=NOTHREAD);
+	}
+
+	/* Wait until all threads are alive and blocked, then release them */
+	Mutex_Lock(&A.mx);
+	while(A.count < N)
+		Cond_Wait(&A.mx, &A.arrived);
+	A.count = -1;
+	Cond_Broadcast(&A.go);
+	Mutex_Unlock(&A.mx);
+
+	for(int i=0; i<N; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(tids[i], &exitval)==0);
+		ASSERT(exitval==i);
+	}
+	free(tids);
+	return 0;
+}
+
+
+BOOT_TEST(test_affinity_get_set,
+	"Test that SetAffinity and GetAffinity work on the current thread, and fail on bad arguments")
+{
+	Tid_t self = ThreadSelf();
+
+	/* Initially, all cores are allowed */
+	cpumask_t all = GetAffinity(self);
+	ASSERT(all & 1);
+	ASSERT((all & (all+1)) == 0);
+
+	ASSERT(SetAffinity(self, 1)==0);
+	ASSERT(GetAffinity(self)==1);
+
+	/* Cores that do not exist are ignored */
+	ASSERT(SetAffinity(self, ~(cpumask_t)0)==0);
+	ASSERT(GetAffinity(self)==all);
+
+	/* An empty mask is an error, and does not change the affinity */
+	ASSERT(SetAffinity(self, 0)==-1);
+	ASSERT(GetAffinity(self)==all);
+
+	/* Bad thread ids */
+	ASSERT(SetAffinity(NOTHREAD, all)==-1);
+	ASSERT(GetAffinity(NOTHREAD)==0);
+	ASSERT(SetAffinity(self+1, all)==-1);
+	ASSERT(GetAffinity(self+1)==0);
+
+	return 0;
+}
+
+
+static int return_affinity(int argl, void* args)
+{
+	return GetAffinity(ThreadSelf());
+}
+
+BOOT_TEST(test_affinity_inherited,
+	"Test that new threads and processes inherit the affinity of their creator")
+{
+	Tid_t self = ThreadSelf();
+	cpumask_t all = GetAffinity(self);
+
+	ASSERT(SetAffinity(self, 1)==0);
+
+	int exitval;
+	Tid_t t = CreateThread(return_affinity, 0, NULL);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval==1);
+
+	Pid_t pid = Exec(return_affinity, 0, NULL);
+	ASSERT(WaitChild(pid, &exitval)==pid);
+	ASSERT(exitval==1);
+
+	/* The creator's later changes do not affect its children */
+	t = CreateThread(return_affinity, 0, NULL);
+	ASSERT(SetAffinity(self, all)==0);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval==1);
+
+	return 0;
+}
+
+
+/* Move from core to core, checking the affinity as we go */
+static int wandering_thread(int argl, void* args)
+{
+	cpumask_t all = *(cpumask_t*) args;
+	int ncores = __builtin_popcount(all);
+
+	for(int r=0; r<100; r++) {
+		cpumask_t mask = ((cpumask_t)1) << ((argl + r) % ncores);
+		ASSERT(SetAffinity(ThreadSelf(), mask)==0);
+		ASSERT(GetAffinity(ThreadSelf())==mask);
+		fibo(15);
+	}
+	return argl;
+}
+
+/* Burn CPU on a single core */
+static int pinned_thread(int argl, void* args)
+{
+	for(int r=0; r<20; r++)
+		fibo(20);
+	return argl;
+}
+
+BOOT_TEST(test_affinity_moves_threads,
+	"Test that threads pinned to cores, or moved around by themselves or others, make progress",
+	.timeout = 60
+	)
+{
+	cpumask_t all = GetAffinity(ThreadSelf());
+	int ncores = __builtin_popcount(all);
+	const int N = 8;
+	Tid_t wanderers[N], pinned[N];
+
+	for(int i=0; i<N; i++) {
+		wanderers[i] = CreateThread(wandering_thread, i, &all);
+		pinned[i] = CreateThread(pinned_thread, i, NULL);
+		ASSERT(SetAffinity(pinned[i], ((cpumask_t)1) << (i % ncores))==0);
+	}
+
+	/* Move the pinned threads again, while they run */
+	for(int i=0; i<N; i++)
+		SetAffinity(pinned[i], ((cpumask_t)1) << ((i+1) % ncores));
+
+	for(int i=0; i<N; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(wanderers[i], &exitval)==0 && exitval==i);
+		ASSERT(ThreadJoin(pinned[i], &exitval)==0 && exitval==i);
+	}
+	return 0;
+}
+
+
+struct parking {
+	Mutex mx;
+	CondVar cv;
+	int release;
+};
+
+/* Wait until told to exit */
+static int parked_thread(int argl, void* args)
+{
+	struct parking* P = args;
+	Mutex_Lock(&P->mx);
+	while(! P->release)
+		Cond_Wait(&P->mx, &P->cv);
+	Mutex_Unlock(&P->mx);
+	return 0;
+}
+
+BOOT_TEST(test_realtime_admission,
+	"Test that SetRealtime checks its arguments, and admits real-time threads up to the capacity of the cores")
+{
+	int ncores = __builtin_popcount(GetAffinity(ThreadSelf()));
+	const int N = 2*ncores + 1;
+	Tid_t tids[N];
+	struct parking P = { MUTEX_INIT, COND_INIT, 0 };
+
+	/* Bad arguments */
+	ASSERT(SetRealtime(NOTHREAD, 1, 10, 10)==-1);
+	ASSERT(SetRealtime(ThreadSelf(), 5, 10, 4)==-1);
+	ASSERT(SetRealtime(ThreadSelf(), 5, 10, 20)==-1);
+	ASSERT(WaitPeriod()==-1);
+
+	/* Each core fits two threads of density 0.4, but not three */
+	int admitted = 0;
+	for(int i=0; i<N; i++) {
+		tids[i] = CreateThread(parked_thread, 0, &P);
+		if(SetRealtime(tids[i], 4, 10, 10)==0)
+			admitted++;
+	}
+	ASSERT(admitted == 2*ncores);
+
+	/* Returning a thread to normal scheduling frees its capacity */
+	ASSERT(SetRealtime(tids[0], 0, 0, 0)==0);
+	ASSERT(SetRealtime(tids[N-1], 4, 10, 10)==0);
+	ASSERT(SetRealtime(tids[0], 4, 10, 10)==-1);
+
+	Mutex_Lock(&P.mx);
+	P.release = 1;
+	Cond_Broadcast(&P.cv);
+	Mutex_Unlock(&P.mx);
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	/* So does exiting */
+	Tid_t t = CreateThread(parked_thread, 0, &P);
+	ASSERT(SetRealtime(t, 9, 10, 10)==0);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	return 0;
+}
+
+
+/* Milliseconds on the wall clock */
+static double wall_msec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1E3 + ts.tv_nsec / 1E6;
+}
+
+/* Burn CPU until told to stop */
+static int burner_thread(int argl, void* args)
+{
+	volatile int* stop = args;
+	while(! *stop)
+		fibo(20);
+	return 0;
+}
+
+#define RT_JOBS 25
+
+/* A periodic job that computes for 1 msec; return the number of deadline misses */
+static int periodic_thread(int argl, void* args)
+{
+	ASSERT(SetRealtime(ThreadSelf(), 2, 20, 20)==0);
+	int misses = 0;
+	for(int j=0; j<RT_JOBS; j++) {
+		double start = wall_msec();
+		while(wall_msec() < start + 1.0)
+			;
+		int missed = WaitPeriod();
+		ASSERT(missed == 0 || missed == 1);
+		misses += missed;
+	}
+	return misses;
+}
+
+BOOT_TEST(test_realtime_deadlines_under_load,
+	"Test that a periodic real-time thread meets its deadlines while every core is busy with CPU-bound threads",
+	.timeout = 60
+	)
+{
+	int ncores = __builtin_popcount(GetAffinity(ThreadSelf()));
+	const int N = 3*ncores;
+	Tid_t burners[N];
+	volatile int stop = 0;
+
+	for(int i=0; i<N; i++)
+		burners[i] = CreateThread(burner_thread, 0, (void*)&stop);
+
+	int misses;
+	Tid_t rt = CreateThread(periodic_thread, 0, NULL);
+	ASSERT(ThreadJoin(rt, &misses)==0);
+
+	stop = 1;
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(burners[i], NULL)==0);
+
+	MSG("deadline misses: %d of %d jobs\n", misses, RT_JOBS);
+	ASSERT(misses <= RT_JOBS/5);
+	return 0;
+}
+
+
+/* A real-time thread pinned to core argl, that burns CPU until told to stop */
+static int rt_burner_thread(int argl, void* args)
+{
+	volatile int* stop = args;
+	ASSERT(SetAffinity(ThreadSelf(), ((cpumask_t)1) << argl)==0);
+	ASSERT(SetRealtime(ThreadSelf(), 1, 100, 100)==0);
+	while(! *stop)
+		fibo(20);
+	return 0;
+}
+
+struct stamp {
+	Mutex mx;
+	CondVar cv;
+	int parked, release;
+	volatile double start;
+};
+
+/* Wait until released, and record when it ran */
+static int stamped_thread(int argl, void* args)
+{
+	struct stamp* S = args;
+	Mutex_Lock(&S->mx);
+	S->parked = 1;
+	while(! S->release)
+		Cond_Wait(&S->mx, &S->cv);
+	Mutex_Unlock(&S->mx);
+	S->start = wall_msec();
+	return 0;
+}
+
+BOOT_TEST(test_realtime_queued_thread,
+	"Test that SetRealtime moves a thread waiting in the run queues to the queues of its new class",
+	.timeout = 60
+	)
+{
+	int ncores = __builtin_popcount(GetAffinity(ThreadSelf()));
+	Tid_t burners[ncores];
+	volatile int stop = 0;
+	struct stamp T = { MUTEX_INIT, COND_INIT, 0, 1, 0.0 };
+	struct stamp X = { MUTEX_INIT, COND_INIT, 0, 0, 0.0 };
+
+	/* Stay ahead of the burners on core 0 */
+	ASSERT(SetAffinity(ThreadSelf(), 1)==0);
+	ASSERT(SetRealtime(ThreadSelf(), 1, 10, 10)==0);
+
+	Tid_t x = CreateThread(stamped_thread, 0, &X);
+	ASSERT(SetAffinity(x, 1)==0);
+	while(! X.parked)
+		share_sleep(1);
+
+	/* Every core runs a real-time burner; its deadline runs far ahead */
+	for(int i=0; i<ncores; i++)
+		burners[i] = CreateThread(rt_burner_thread, i, (void*)&stop);
+	share_sleep(200);
+
+	/* A normal thread waits in the run queues, until made real-time */
+	Tid_t t = CreateThread(stamped_thread, 0, &T);
+	double t0 = wall_msec();
+	ASSERT(SetRealtime(t, 2, 50, 50)==0);
+	share_sleep(50);
+	ASSERT(T.start != 0.0 && T.start - t0 < 50.0);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/*
+	  X wakes up in the EDF queue of core 0, behind this thread, and is
+	  returned to normal scheduling there: it must wait for the burners.
+	 */
+	ASSERT(SetRealtime(x, 1, 1000, 1000)==0);
+	Mutex_Lock(&X.mx);
+	X.release = 1;
+	Cond_Broadcast(&X.cv);
+	Mutex_Unlock(&X.mx);
+	ASSERT(SetRealtime(x, 0, 0, 0)==0);
+	share_sleep(100);
+	ASSERT(X.start == 0.0);
+
+	stop = 1;
+	for(int i=0; i<ncores; i++)
+		ASSERT(ThreadJoin(burners[i], NULL)==0);
+	ASSERT(ThreadJoin(x, NULL)==0);
+	ASSERT(X.start != 0.0);
+
+	ASSERT(SetRealtime(ThreadSelf(), 0, 0, 0)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_cpu_group_errors,
+	"Test that CreateCpuGroup and SetCpuGroup fail on bad arguments")
+{
+	ASSERT(CreateCpuGroup(0, 100)==-1);
+	ASSERT(CreateCpuGroup(10, 0)==-1);
+
+	int group = CreateCpuGroup(10, 100);
+	ASSERT(group != -1 && group != NOGROUP);
+
+	ASSERT(SetCpuGroup(GetPid(), group)==0);
+	ASSERT(SetCpuGroup(GetPid(), NOGROUP)==0);
+
+	/* Bad groups */
+	ASSERT(SetCpuGroup(GetPid(), -1)==-1);
+	ASSERT(SetCpuGroup(GetPid(), MAX_CPU_GROUPS)==-1);
+	ASSERT(SetCpuGroup(GetPid(), group+1)==-1);
+
+	/* Bad pids */
+	ASSERT(SetCpuGroup(NOPROC, group)==-1);
+	ASSERT(SetCpuGroup(GetPPid(), group)==-1);
+
+	/* The groups run out */
+	for(int g=group+1; g<MAX_CPU_GROUPS; g++)
+		ASSERT(CreateCpuGroup(10, 100)==g);
+	ASSERT(CreateCpuGroup(10, 100)==-1);
+	return 0;
+}
+
+
+#define GROUP_RUN_MSEC 600
+
+/* Spin for a while on the wall clock; return the msec actually run */
+static int group_spinner(int argl, void* args)
+{
+	double start = wall_msec(), last = start, now, ran = 0;
+	while((now = wall_msec()) < start + GROUP_RUN_MSEC) {
+		if(now - last < 1.0)
+			ran += now - last;
+		last = now;
+	}
+	return ran;
+}
+
+/* Run two spinners and return their total run time */
+static int group_process(int argl, void* args)
+{
+	Tid_t t1 = CreateThread(group_spinner, 0, NULL);
+	Tid_t t2 = CreateThread(group_spinner, 0, NULL);
+	int ran1, ran2;
+	ASSERT(ThreadJoin(t1, &ran1)==0 && ThreadJoin(t2, &ran2)==0);
+	return ran1 + ran2;
+}
+
+BOOT_TEST(test_cpu_group_quota,
+	"Test that the processes of a CPU group are throttled to its quota, even with idle cores,\n"
+	"and that the group information stream reports it")
+{
+	/* 20 msec per 100 msec, or a fifth of a core */
+	int group = CreateCpuGroup(20, 100);
+	ASSERT(group != -1);
+
+	Pid_t child = Exec(group_process, 0, NULL);
+	ASSERT(SetCpuGroup(child, group)==0);
+	int ran;
+	ASSERT(WaitChild(child, &ran)==child);
+
+	MSG("ran %d msec of %d\n", ran, GROUP_RUN_MSEC);
+	ASSERT(ran <= 2*GROUP_RUN_MSEC/5);
+
+	Fid_t finfo = OpenGroupInfo();
+	ASSERT(finfo != NOFILE);
+	cpugroupinfo info;
+	ASSERT(Read(finfo, (char*)&info, sizeof(info))==sizeof(info));
+	ASSERT(info.group == group);
+	ASSERT(info.quota == 20 && info.period == 100);
+	ASSERT(info.procs == 0);
+	ASSERT(info.throttled_periods >= 3);
+	ASSERT(info.throttled_time >= 3*(100-20)/2);
+	ASSERT(Read(finfo, (char*)&info, sizeof(info))==0);
+	ASSERT(Close(finfo)==0);
+	return 0;
+}
+
+
+static int gang_barrier_thread(int argl, void* args)
+{
+	for(int i=0; i<100; i++)
+		BarrierSync(args, argl);
+	return 0;
+}
+
+static int gang_process(int argl, void* args)
+{
+	barrier bar = BARRIER_INIT;
+	Tid_t t[argl];
+	for(int i=0; i<argl; i++)
+		t[i] = CreateThread(gang_barrier_thread, argl, &bar);
+	for(int i=0; i<argl; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	return 0;
+}
+
+BOOT_TEST(test_gang_mode,
+	"Test that SetGang fails on bad pids, and that the threads of a process in gang mode\n"
+	"run to completion next to CPU-bound threads of another process")
+{
+	ASSERT(SetGang(NOPROC, 1)==-1);
+	ASSERT(SetGang(GetPPid(), 1)==-1);
+	ASSERT(SetGang(GetPid(), 0)==0);
+
+	volatile int stop = 0;
+	Tid_t burner = CreateThread(burner_thread, 0, (void*)&stop);
+
+	Pid_t child = Exec(gang_process, 4, NULL);
+	ASSERT(SetGang(child, 1)==0);
+	ASSERT(WaitChild(child, NULL)==child);
+
+	stop = 1;
+	ASSERT(ThreadJoin(burner, NULL)==0);
+	return 0;
+}
+
+
 BOOT_TEST(test_detach_self,
 	"Test that a thread can detach itself")
 {
@@ -1397,6 +2272,178 @@ BOOT_TEST(test_cyclic_joins,
 }
 
 
+
+static int thread_limit_child(int argl, void* args) { return 0; }
+
+#define THREAD_LIMIT 100
+
+static int thread_limit_boot(int argl, void* args)
+{
+	Tid_t tids[THREAD_LIMIT];
+	struct many_small_stacks A = { MUTEX_INIT, COND_INIT, COND_INIT, 0 };
+
+	int n = 0;
+	while(n < THREAD_LIMIT && (tids[n] = CreateThreadEx(many_small_stacks_task, n, &A, MIN_STACK_SIZE)) != NOTHREAD)
+		n++;
+	ASSERT(n > 0 && n < THREAD_LIMIT);
+
+	/* At the limit, new threads and processes fail, without harm */
+	ASSERT(CreateThread(many_small_stacks_task, 0, &A) == NOTHREAD);
+	ASSERT(Exec(thread_limit_child, 0, NULL) == NOPROC);
+
+	/* Release the threads, then try again */
+	Mutex_Lock(&A.mx);
+	while(A.count < n)
+		Cond_Wait(&A.mx, &A.arrived);
+	A.count = -1;
+	Cond_Broadcast(&A.go);
+	Mutex_Unlock(&A.mx);
+	for(int i=0; i<n; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	Pid_t pid = Exec(thread_limit_child, 0, NULL);
+	ASSERT(pid != NOPROC);
+	ASSERT(WaitChild(pid, NULL) == pid);
+	return 0;
+}
+
+BARE_TEST(test_thread_limit_fails_cleanly,
+	"Test that when there is no memory for another thread, CreateThread fails\n"
+	"with NOTHREAD and Exec with NOPROC, and that the kernel recovers.")
+{
+	set_thread_alloc_limit(THREAD_LIMIT);
+	boot(1, 0, thread_limit_boot, 0, NULL);
+	boot(4, 0, thread_limit_boot, 0, NULL);
+	set_thread_alloc_limit(0);
+}
+
+
+struct sleep_mutex_race {
+	SleepMutex mx;
+	CondVar done;
+	int count, finished;
+};
+
+static int sleep_mutex_task(int argl, void* args) {
+	struct sleep_mutex_race *A = args;
+	for(int i=0; i<argl; i++) {
+		SleepMutex_Lock(&A->mx);
+		int c = A->count;
+		for(volatile int k=0; k<1000; k++);	/* widen the critical section */
+		A->count = c+1;
+		SleepMutex_Unlock(&A->mx);
+	}
+	SleepMutex_Lock(&A->mx);
+	A->finished++;
+	Cond_Signal(&A->done);
+	SleepMutex_Unlock(&A->mx);
+	return 0;
+}
+
+BOOT_TEST(test_sleep_mutex,
+	"Test that a SleepMutex excludes many threads, and works with condition variables.",
+	.timeout = 60
+	)
+{
+	const int N = 50, ROUNDS = 200;
+	struct sleep_mutex_race A = { SLEEP_MUTEX_INIT, COND_INIT, 0, 0 };
+
+	/* A timed wait with nobody to signal times out */
+	SleepMutex_Lock(&A.mx);
+	ASSERT(Cond_SleepTimedWait(&A.mx, &A.done, 20)==0);
+	SleepMutex_Unlock(&A.mx);
+
+	Tid_t tids[N];
+	for(int i=0; i<N; i++)
+		ASSERT((tids[i] = CreateThread(sleep_mutex_task, ROUNDS, &A))!=NOTHREAD);
+
+	SleepMutex_Lock(&A.mx);
+	while(A.finished < N)
+		Cond_SleepWait(&A.mx, &A.done);
+	ASSERT(A.count == N*ROUNDS);
+	SleepMutex_Unlock(&A.mx);
+
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	ASSERT(A.mx.state == 0);
+	return 0;
+}
+
+
+struct rwlock_race {
+	RWLock rw;
+	int a, b;			/* kept equal by the writers */
+	volatile int written;
+	int torn;
+};
+
+static int rwlock_try_read(int argl, void* args) {
+	struct rwlock_race *A = args;
+	RWLock_ReadLock(&A->rw);
+	RWLock_ReadUnlock(&A->rw);
+	return 0;
+}
+
+static int rwlock_try_write(int argl, void* args) {
+	struct rwlock_race *A = args;
+	RWLock_WriteLock(&A->rw);
+	A->written = 1;
+	RWLock_WriteUnlock(&A->rw);
+	return 0;
+}
+
+static int rwlock_race_task(int argl, void* args) {
+	struct rwlock_race *A = args;
+	for(int i=0; i<500; i++) {
+		if(i % 10 == argl) {
+			RWLock_WriteLock(&A->rw);
+			int a = A->a;
+			for(volatile int k=0; k<1000; k++);
+			A->a = a+1;
+			A->b = a+1;
+			RWLock_WriteUnlock(&A->rw);
+		}
+		else {
+			RWLock_ReadLock(&A->rw);
+			int a = A->a;
+			for(volatile int k=0; k<100; k++);
+			if(A->b != a) A->torn = 1;
+			RWLock_ReadUnlock(&A->rw);
+		}
+	}
+	return 0;
+}
+
+BOOT_TEST(test_rwlock,
+	"Test that a reader-writer lock admits many readers, or one writer.",
+	.timeout = 60
+	)
+{
+	struct rwlock_race A = { RWLOCK_INIT, 0, 0, 0, 0 };
+
+	/* A reader gets in beside another reader, but a writer does not */
+	RWLock_ReadLock(&A.rw);
+	Tid_t t = CreateThread(rwlock_try_read, 0, &A);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	t = CreateThread(rwlock_try_write, 0, &A);
+	share_sleep(50);
+	ASSERT(A.written == 0);
+	RWLock_ReadUnlock(&A.rw);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(A.written == 1);
+
+	/* Readers never see a write half done */
+	const int N = 10;
+	Tid_t tids[N];
+	for(int i=0; i<N; i++)
+		tids[i] = CreateThread(rwlock_race_task, i, &A);
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	ASSERT(A.torn == 0);
+	ASSERT(A.a == 500 && A.b == 500);
+	return 0;
+}
+
 TEST_SUITE(thread_tests, 
 	"A suite of tests for threads."
 	)
@@ -1410,6 +2457,22 @@ TEST_SUITE(thread_tests,
 	&test_detach_main_thread,
 	&test_detach_after_join,
 	&test_create_join_thread,
+	&test_create_thread_ex_stack_sizes,
+	&test_create_thread_ex_fails_on_illegal_size,
+	&test_exec_ex_stack_size,
+	&test_many_small_stack_threads,
+	&test_thread_limit_fails_cleanly,
+	&test_sleep_mutex,
+	&test_rwlock,
+	&test_affinity_get_set,
+	&test_affinity_inherited,
+	&test_affinity_moves_threads,
+	&test_realtime_admission,
+	&test_realtime_deadlines_under_load,
+	&test_realtime_queued_thread,
+	&test_cpu_group_errors,
+	&test_cpu_group_quota,
+	&test_gang_mode,
 	&test_join_many_threads,
 	&test_exit_many_threads,
 	&test_main_exit_cleanup,